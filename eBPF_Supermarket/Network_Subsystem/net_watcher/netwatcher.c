@@ -19,6 +19,7 @@
 #include "netwatcher.h"
 #include "dropreason.h"
 #include "netwatcher.skel.h"
+#include "../../Stack_Analyser/include/kallsyms.h"
 #include <argp.h>
 #include <arpa/inet.h>
 #include <bpf/bpf.h>
@@ -292,7 +293,7 @@ void print_logo() {
 #define ATTACH_URETPROBE_CHECKED(skel, sym_name, prog_name)                    \
     __ATTACH_UPROBE_CHECKED(skel, sym_name, prog_name, true)
 
-struct SymbolEntry symbols[300000];
+struct SymbolEntry *symbols;
 struct SymbolEntry cache[CACHEMAXSIZE];
 // LRU算法查找函数
 struct SymbolEntry find_in_cache(unsigned long int addr) {
@@ -352,25 +353,26 @@ struct SymbolEntry findfunc(unsigned long int addr) {
     add_to_cache(symbols[result]);
     return symbols[result];
 };
+// 读取内核符号表，索引按地址有序并缓存在KALLSYMS_CACHE_DIR下，再次启动时直接映射
 void readallsym() {
-    FILE *file = fopen("/proc/kallsyms", "r");
-    if (!file) {
-        perror("Error opening file");
+    struct kallsyms_index idx;
+    if (kallsyms__load(&idx, KALLSYMS_CACHE_DIR)) {
+        perror("Error loading kallsyms");
         exit(EXIT_FAILURE);
     }
-    char line[256];
-    while (fgets(line, sizeof(line), file)) {
-        unsigned long addr;
-        char type, name[30];
-        int ret = sscanf(line, "%lx %c %s", &addr, &type, name);
-        if (ret == 3) {
-            symbols[num_symbols].addr = addr;
-            strncpy(symbols[num_symbols].name, name, 30);
-            num_symbols++;
-        }
+    symbols = malloc(sizeof(*symbols) * idx.nr);
+    if (!symbols) {
+        perror("Error allocating symbols");
+        exit(EXIT_FAILURE);
     }
-
-    fclose(file);
+    for (size_t i = 0; i < idx.nr; i++) {
+        symbols[i].addr = idx.entries[i].addr;
+        strncpy(symbols[i].name, idx.names + idx.entries[i].name,
+                sizeof(symbols[i].name) - 1);
+        symbols[i].name[sizeof(symbols[i].name) - 1] = '\0';
+    }
+    num_symbols = idx.nr;
+    kallsyms__free(&idx);
 }
 /*
     指数加权移动平均算法（EWMA）
@@ -0,0 +1,659 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 采集器开销基准测试，在合成负载上分别不开启和开启各采集器运行，按JSON行输出
+// 吞吐下降、工具的CPU时间和内存、eBPF程序的运行时间以及eBPF表的填充情况，需要root权限
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_set>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+typedef std::chrono::steady_clock Clock;
+
+/// @brief 合成负载，setup在计时前准备数据，run执行一批操作并返回操作数
+struct Workload
+{
+    const char *name;
+    void (*setup)(void);
+    uint64_t (*run)(void);
+};
+
+static uint64_t rng_state = 88172645463325252ull;
+
+static inline uint64_t next_rand(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/// 分配风暴：不同大小的内存反复分配和释放，写入首字节使其真正被使用
+static void *slots[1024];
+
+static void malloc_setup(void) {}
+
+static uint64_t malloc_run(void)
+{
+    for (int i = 0; i < 1024; i++)
+    {
+        auto &p = slots[next_rand() % 1024];
+        free(p);
+        p = malloc(16 + next_rand() % 8192);
+        *(volatile char *)p = 1;
+    }
+    return 1024;
+}
+
+/// 上下文切换乒乓：同一进程的两个线程经管道交替唤醒对方
+static int ping[2], pong[2];
+
+static void ctxsw_setup(void)
+{
+    if (pipe(ping) || pipe(pong))
+        exit(1);
+    std::thread([]
+                {
+        char c;
+        while (read(ping[0], &c, 1) == 1 && write(pong[1], &c, 1) == 1)
+            ; })
+        .detach();
+}
+
+static uint64_t ctxsw_run(void)
+{
+    char c = 0;
+    for (int i = 0; i < 256; i++)
+        if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1)
+            exit(1);
+    return 256;
+}
+
+/// 读写循环：顺序读取文件并穿插随机写，每读完一遍丢弃页缓存使下一遍重新预读
+static const size_t file_bytes = 64ul << 20;
+static const size_t io_block = 4096;
+static int io_fd = -1;
+static size_t io_off = 0;
+
+static void rw_setup(void)
+{
+    char path[] = "/tmp/sa_bench.XXXXXX";
+    io_fd = mkstemp(path);
+    if (io_fd < 0)
+        exit(1);
+    unlink(path);
+    std::vector<char> buf(1 << 20, 'x');
+    for (size_t off = 0; off < file_bytes; off += buf.size())
+        if (pwrite(io_fd, buf.data(), buf.size(), off) != (ssize_t)buf.size())
+            exit(1);
+    fdatasync(io_fd);
+    posix_fadvise(io_fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static uint64_t rw_run(void)
+{
+    char buf[io_block];
+    for (int i = 0; i < 64; i++)
+    {
+        if (pread(io_fd, buf, io_block, io_off) != (ssize_t)io_block)
+            exit(1);
+        if (i % 16 == 0 && pwrite(io_fd, buf, io_block, next_rand() % (file_bytes / io_block) * io_block) != (ssize_t)io_block)
+            exit(1);
+        io_off += io_block;
+        if (io_off == file_bytes)
+        {
+            io_off = 0;
+            posix_fadvise(io_fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+    }
+    return 64 + 4;
+}
+
+/// 缓存颠簸：在远大于末级缓存的缓冲区上按随机环追踪指针，每一步都是缓存缺失
+static const size_t cache_bytes = 256ul << 20;
+static const size_t line_words = 64 / sizeof(uint64_t);
+static uint64_t *chase = NULL;
+static uint64_t chase_pos = 0;
+
+static void cache_setup(void)
+{
+    size_t lines = cache_bytes / 64;
+    chase = (uint64_t *)aligned_alloc(64, cache_bytes);
+    if (!chase)
+        exit(1);
+    std::vector<uint32_t> order(lines);
+    for (size_t i = 0; i < lines; i++)
+        order[i] = i;
+    // Sattolo算法生成单个环，保证遍历全部缓存行
+    for (size_t i = lines - 1; i > 0; i--)
+        std::swap(order[i], order[next_rand() % i]);
+    for (size_t i = 0; i < lines; i++)
+        chase[order[i] * line_words] = order[(i + 1) % lines] * line_words;
+}
+
+static uint64_t cache_run(void)
+{
+    uint64_t pos = chase_pos;
+    for (int i = 0; i < 4096; i++)
+        pos = chase[pos];
+    chase_pos = pos;
+    return 4096;
+}
+
+/// 密集函数调用：反复调用被uprobe挂载的函数
+extern "C" __attribute__((noinline)) uint64_t bench_uprobe_target(uint64_t x)
+{
+    asm volatile("" ::: "memory");
+    return x * 2654435761u;
+}
+
+static volatile uint64_t uprobe_sink;
+
+static void uprobe_setup(void) {}
+
+static uint64_t uprobe_run(void)
+{
+    uint64_t acc = 0;
+    for (int i = 0; i < 4096; i++)
+        acc += bench_uprobe_target(i);
+    uprobe_sink = acc;
+    return 4096;
+}
+
+static const Workload workloads[] = {
+    {"malloc", malloc_setup, malloc_run},
+    {"ctxsw", ctxsw_setup, ctxsw_run},
+    {"rw", rw_setup, rw_run},
+    {"cache", cache_setup, cache_run},
+    {"uprobe", uprobe_setup, uprobe_run},
+};
+
+/******************************** 工具的资源统计 ********************************/
+
+/// @brief 工具进程某一时刻的累计开销
+struct ToolSnapshot
+{
+    double cpu_ms = 0;   // 工具进程的用户态和内核态CPU时间
+    uint64_t bpf_ns = 0; // 工具加载的eBPF程序的累计运行时间，运行在被测负载的上下文中
+    uint64_t bpf_cnt = 0;
+};
+
+/// @brief 工具退出前eBPF表和内存的状态
+struct ToolFootprint
+{
+    uint64_t rss_kb = 0, hwm_kb = 0;
+    uint64_t memlock = 0;  // eBPF表占用的内存
+    uint64_t entries = 0;  // 哈希类表中的表项总数
+    uint64_t capacity = 0; // 哈希类表的容量总和
+    std::string fullest;   // 填充率最高的表
+    double fullest_fill = 0;
+};
+
+static long sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/// @brief 读取/proc/<pid>/fdinfo中的一个字段
+static bool fdinfo_field(const std::string &info, const char *field, uint64_t &val)
+{
+    auto p = info.find(std::string("\n") + field + ":");
+    if (p == std::string::npos)
+        return false;
+    val = strtoull(info.c_str() + p + strlen(field) + 2, NULL, 10);
+    return true;
+}
+
+/// @brief 遍历工具进程中某一类eBPF对象的文件描述符，kind为bpf-prog或bpf-map
+template <typename F>
+static void for_each_bpf_fd(pid_t pid, const char *kind, F f)
+{
+    char path[PATH_MAX], link[PATH_MAX];
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return;
+    while (auto ent = readdir(dir))
+    {
+        snprintf(path, sizeof(path), "/proc/%d/fd/%s", pid, ent->d_name);
+        ssize_t len = readlink(path, link, sizeof(link) - 1);
+        if (len <= 0)
+            continue;
+        link[len] = '\0';
+        if (!strstr(link, kind))
+            continue;
+        snprintf(path, sizeof(path), "/proc/%d/fdinfo/%s", pid, ent->d_name);
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        std::string info = "\n";
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+            info.append(buf, n);
+        fclose(fp);
+        f(info);
+    }
+    closedir(dir);
+}
+
+static ToolSnapshot snapshot(pid_t pid)
+{
+    ToolSnapshot s;
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (fp)
+    {
+        size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+        fclose(fp);
+        buf[len] = '\0';
+        char *p = strrchr(buf, ')');
+        unsigned long utime = 0, stime = 0;
+        if (p)
+            sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+        s.cpu_ms = (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+    }
+    std::unordered_set<uint64_t> seen;
+    for_each_bpf_fd(pid, "bpf-prog", [&](const std::string &info)
+                    {
+        uint64_t id, ns = 0, cnt = 0;
+        if (!fdinfo_field(info, "prog_id", id) || !seen.insert(id).second)
+            return;
+        fdinfo_field(info, "run_time_ns", ns);
+        fdinfo_field(info, "run_cnt", cnt);
+        s.bpf_ns += ns;
+        s.bpf_cnt += cnt; });
+    return s;
+}
+
+/// @brief 统计表中的表项数，遍历次数以容量为上限，避免并发修改时无限循环
+static uint64_t count_keys(int fd, uint32_t key_size, uint64_t max_entries)
+{
+    std::vector<char> key(key_size), next(key_size);
+    void *cur = NULL;
+    uint64_t n = 0;
+    while (n < max_entries)
+    {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = fd;
+        attr.key = (uintptr_t)cur;
+        attr.next_key = (uintptr_t)next.data();
+        if (sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr))
+            break;
+        n++;
+        key.swap(next);
+        cur = key.data();
+    }
+    return n;
+}
+
+static ToolFootprint footprint(pid_t pid)
+{
+    ToolFootprint f;
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *fp = fopen(path, "r");
+    if (fp)
+    {
+        while (fgets(line, sizeof(line), fp))
+        {
+            sscanf(line, "VmRSS: %lu", &f.rss_kb);
+            sscanf(line, "VmHWM: %lu", &f.hwm_kb);
+        }
+        fclose(fp);
+    }
+    std::unordered_set<uint64_t> seen;
+    for_each_bpf_fd(pid, "bpf-map", [&](const std::string &info)
+                    {
+        uint64_t id, memlock = 0, type = 0, max_entries = 0, key_size = 0;
+        if (!fdinfo_field(info, "map_id", id) || !seen.insert(id).second)
+            return;
+        fdinfo_field(info, "memlock", memlock);
+        fdinfo_field(info, "map_type", type);
+        fdinfo_field(info, "max_entries", max_entries);
+        fdinfo_field(info, "key_size", key_size);
+        f.memlock += memlock;
+        // 数组类的表预先分配，只统计按需插入的表
+        if (type != BPF_MAP_TYPE_HASH && type != BPF_MAP_TYPE_PERCPU_HASH &&
+            type != BPF_MAP_TYPE_LRU_HASH && type != BPF_MAP_TYPE_LRU_PERCPU_HASH &&
+            type != BPF_MAP_TYPE_STACK_TRACE)
+            return;
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_id = id;
+        int fd = sys_bpf(BPF_MAP_GET_FD_BY_ID, &attr);
+        if (fd < 0)
+            return;
+        struct bpf_map_info map_info;
+        memset(&map_info, 0, sizeof(map_info));
+        memset(&attr, 0, sizeof(attr));
+        attr.info.bpf_fd = fd;
+        attr.info.info_len = sizeof(map_info);
+        attr.info.info = (uintptr_t)&map_info;
+        sys_bpf(BPF_OBJ_GET_INFO_BY_FD, &attr);
+        uint64_t n = count_keys(fd, key_size, max_entries);
+        close(fd);
+        f.entries += n;
+        f.capacity += max_entries;
+        double fill = max_entries ? 100.0 * n / max_entries : 0;
+        if (f.fullest.empty() || fill > f.fullest_fill)
+        {
+            f.fullest = map_info.name;
+            f.fullest_fill = fill;
+        } });
+    return f;
+}
+
+/******************************** 运行 ********************************/
+
+namespace Config
+{
+    double duration = 5; // 每次运行负载的时间
+    double warmup = 3;   // 启动工具后等待其加载eBPF程序的时间
+    int repeat = 1;      // 重复次数，吞吐取中位数
+    std::string tool = "./stack_analyzer";
+}
+
+/// @brief 一次运行的结果
+struct Run
+{
+    std::string error;
+    double rate = 0; // 每秒操作数
+    ToolSnapshot cost;
+    ToolFootprint fp;
+};
+
+/// @brief 负载子进程，准备完成后通知父进程，等待开始信号后运行给定时间并回报吞吐
+static void workload_child(const Workload &w, int to_parent, int from_parent)
+{
+    w.setup();
+    char c = 0;
+    if (write(to_parent, &c, 1) != 1 || read(from_parent, &c, 1) != 1)
+        _exit(1);
+    auto begin = Clock::now();
+    auto end = begin + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(Config::duration));
+    uint64_t ops = 0;
+    do
+        ops += w.run();
+    while (Clock::now() < end);
+    double rate = ops / std::chrono::duration<double>(Clock::now() - begin).count();
+    if (write(to_parent, &rate, sizeof(rate)) != sizeof(rate))
+        _exit(1);
+    _exit(0);
+}
+
+/// @brief 启动工具并只跟踪负载进程，输出间隔长于测量窗口，使测量期间表不被清空
+static pid_t start_tool(const std::string &args, pid_t target)
+{
+    std::vector<std::string> argv = {Config::tool};
+    size_t b = 0, e;
+    while ((e = args.find(' ', b)) != std::string::npos)
+    {
+        argv.push_back(args.substr(b, e - b));
+        b = e + 1;
+    }
+    argv.push_back(args.substr(b));
+    for (auto a : {"-p", "", "-u", "-k", "-i", ""})
+        argv.push_back(a);
+    argv[argv.size() - 5] = std::to_string(target);
+    argv.back() = std::to_string((int)(Config::warmup + Config::duration) + 30);
+    pid_t pid = fork();
+    if (pid)
+        return pid;
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    std::vector<char *> cargv;
+    for (auto &a : argv)
+        cargv.push_back((char *)a.c_str());
+    cargv.push_back(NULL);
+    execv(cargv[0], cargv.data());
+    _exit(127);
+}
+
+static void stop(pid_t pid)
+{
+    kill(pid, SIGINT);
+    for (int i = 0; i < 100; i++)
+    {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return;
+        usleep(100000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+/// @brief 运行一次负载，collector为空时不启动工具
+static Run run_once(const Workload &w, const std::string &collector)
+{
+    Run r;
+    int up[2], down[2];
+    if (pipe(up) || pipe(down))
+    {
+        r.error = "pipe failed";
+        return r;
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    if (!child)
+    {
+        close(up[0]);
+        close(down[1]);
+        workload_child(w, up[1], down[0]);
+    }
+    close(up[1]);
+    close(down[0]);
+    char c;
+    pid_t tool = 0;
+    if (read(up[0], &c, 1) != 1)
+        r.error = "workload setup failed";
+    else if (collector.size())
+    {
+        tool = start_tool(collector, child);
+        usleep(Config::warmup * 1e6);
+        if (waitpid(tool, NULL, WNOHANG) == tool)
+        {
+            r.error = "tool exited during warmup";
+            tool = 0;
+        }
+    }
+    ToolSnapshot before;
+    if (tool)
+        before = snapshot(tool);
+    if (r.error.empty() && (write(down[1], &c, 1) != 1 || read(up[0], &r.rate, sizeof(r.rate)) != sizeof(r.rate)))
+        r.error = "workload failed";
+    if (tool)
+    {
+        auto after = snapshot(tool);
+        r.cost.cpu_ms = after.cpu_ms - before.cpu_ms;
+        r.cost.bpf_ns = after.bpf_ns - before.bpf_ns;
+        r.cost.bpf_cnt = after.bpf_cnt - before.bpf_cnt;
+        r.fp = footprint(tool);
+        stop(tool);
+    }
+    close(up[0]);
+    close(down[1]);
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    return r;
+}
+
+/// @brief 重复运行，吞吐取中位数，其余指标取最后一次
+static Run run(const Workload &w, const std::string &collector)
+{
+    std::vector<double> rates;
+    Run r;
+    for (int i = 0; i < Config::repeat; i++)
+    {
+        r = run_once(w, collector);
+        if (r.error.size())
+            return r;
+        rates.push_back(r.rate);
+    }
+    std::sort(rates.begin(), rates.end());
+    r.rate = rates[rates.size() / 2];
+    return r;
+}
+
+static std::vector<std::string> split(const std::string &s)
+{
+    std::vector<std::string> res;
+    size_t b = 0, e;
+    while ((e = s.find(',', b)) != std::string::npos)
+    {
+        res.push_back(s.substr(b, e - b));
+        b = e + 1;
+    }
+    res.push_back(s.substr(b));
+    return res;
+}
+
+static std::string bpf_stats_enabled;
+
+static void restore_bpf_stats(void)
+{
+    FILE *fp = fopen("/proc/sys/kernel/bpf_stats_enabled", "w");
+    if (fp)
+    {
+        fputs(bpf_stats_enabled.c_str(), fp);
+        fclose(fp);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string wl = "malloc,ctxsw,rw,cache,uprobe";
+    std::string cl = "on_cpu,off_cpu,wall_clock,memleak,io,readahead,llc_stat,pmu,probe";
+    int opt;
+    while ((opt = getopt(argc, argv, "t:W:r:b:w:c:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            Config::duration = atof(optarg);
+            break;
+        case 'W':
+            Config::warmup = atof(optarg);
+            break;
+        case 'r':
+            Config::repeat = std::max(1, atoi(optarg));
+            break;
+        case 'b':
+            Config::tool = optarg;
+            break;
+        case 'w':
+            wl = optarg;
+            break;
+        case 'c':
+            cl = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-t seconds] [-W warmup] [-r repeat] [-b stack_analyzer] "
+                    "[-w workload,...] [-c collector,...|none]\n"
+                    "workloads: malloc ctxsw rw cache uprobe\n"
+                    "collectors: on_cpu off_cpu wall_clock memleak io readahead llc_stat pmu probe\n",
+                    argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    // probe采集器挂载本程序中的函数
+    char self[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    self[len > 0 ? len : 0] = '\0';
+    std::vector<std::pair<std::string, std::string>> collectors;
+    if (cl != "none")
+    {
+        for (auto &c : split(cl))
+            collectors.emplace_back(c, c == "probe" ? c + " " + self + ":bench_uprobe_target" : c);
+        if (geteuid())
+        {
+            fprintf(stderr, "collectors need root, or use -c none for baselines only\n");
+            return 1;
+        }
+        // 开启内核对eBPF程序运行时间的统计，退出时恢复
+        FILE *fp = fopen("/proc/sys/kernel/bpf_stats_enabled", "r+");
+        if (fp)
+        {
+            char buf[8] = "0";
+            if (fgets(buf, sizeof(buf), fp))
+                bpf_stats_enabled = buf;
+            rewind(fp);
+            fputs("1", fp);
+            fclose(fp);
+            atexit(restore_bpf_stats);
+        }
+    }
+
+    for (auto &name : split(wl))
+    {
+        auto w = std::find_if(std::begin(workloads), std::end(workloads), [&](const Workload &w)
+                              { return name == w.name; });
+        if (w == std::end(workloads))
+        {
+            fprintf(stderr, "unknown workload %s\n", name.c_str());
+            return 1;
+        }
+        fprintf(stderr, "%s: baseline\n", w->name);
+        auto base = run(*w, "");
+        if (base.error.size())
+        {
+            printf("{\"workload\":\"%s\",\"collector\":\"none\",\"error\":\"%s\"}\n", w->name, base.error.c_str());
+            continue;
+        }
+        printf("{\"workload\":\"%s\",\"collector\":\"none\",\"ops_per_sec\":%.1f}\n", w->name, base.rate);
+        for (auto &c : collectors)
+        {
+            fprintf(stderr, "%s: %s\n", w->name, c.first.c_str());
+            auto r = run(*w, c.second);
+            if (r.error.size())
+            {
+                printf("{\"workload\":\"%s\",\"collector\":\"%s\",\"error\":\"%s\"}\n",
+                       w->name, c.first.c_str(), r.error.c_str());
+                continue;
+            }
+            printf("{\"workload\":\"%s\",\"collector\":\"%s\",\"ops_per_sec\":%.1f,\"slowdown_pct\":%.2f,"
+                   "\"tool_cpu_ms\":%.1f,\"bpf_run_ms\":%.3f,\"bpf_run_cnt\":%lu,"
+                   "\"tool_rss_kb\":%lu,\"tool_hwm_kb\":%lu,\"bpf_memlock_kb\":%lu,"
+                   "\"map_entries\":%lu,\"map_capacity\":%lu,\"fullest_map\":\"%s\",\"fullest_fill_pct\":%.2f}\n",
+                   w->name, c.first.c_str(), r.rate, 100.0 * (base.rate - r.rate) / base.rate,
+                   r.cost.cpu_ms, r.cost.bpf_ns / 1e6, r.cost.bpf_cnt,
+                   r.fp.rss_kb, r.fp.hwm_kb, r.fp.memlock / 1024,
+                   r.fp.entries, r.fp.capacity, r.fp.fullest.c_str(), r.fp.fullest_fill);
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 计数竞争的微基准测试，用多线程模拟多核eBPF程序更新同一计数表，
+// 比较共享计数的非原子自增、原子自增与每CPU计数的耗时和丢失的计数
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <stdlib.h>
+
+// 热点调用栈的数量，采样通常集中在少数调用栈上
+static const int hot_keys = 64;
+static const uint64_t ops_per_thread = 4000000;
+
+struct alignas(64) PerCpu
+{
+    uint64_t vals[hot_keys];
+};
+
+template <typename F>
+static double run_threads(int nr, F f)
+{
+    std::vector<std::thread> threads;
+    auto begin = std::chrono::steady_clock::now();
+    for (int t = 0; t < nr; t++)
+        threads.emplace_back(f, t);
+    for (auto &t : threads)
+        t.join();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - begin).count() / ops_per_thread;
+}
+
+/// @brief 线程各自的键序列，模拟不同CPU采到的调用栈
+static inline int next_key(uint64_t &x)
+{
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x % hot_keys;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    std::cout << "keys=" << hot_keys << " ops/thread=" << ops_per_thread << "\n"
+              << "threads\tplain(ns/op)\tlost(%)\tatomic(ns/op)\tpercpu(ns/op)\n";
+    for (int nr = 1; nr <= max_threads; nr *= 2)
+    {
+        uint64_t total = ops_per_thread * nr;
+
+        // 共享表上的非原子自增，即原有eBPF程序中的(*count)++
+        std::vector<std::atomic<uint64_t>> shared(hot_keys);
+        double plain = run_threads(nr, [&](int t)
+                                   {
+            uint64_t x = t + 1;
+            for (uint64_t i = 0; i < ops_per_thread; i++)
+            {
+                auto &v = shared[next_key(x)];
+                v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            } });
+        uint64_t counted = 0;
+        for (auto &v : shared)
+            counted += v.load();
+
+        // 共享表上的原子自增，计数不丢失但缓存行仍在核间往返
+        for (auto &v : shared)
+            v.store(0);
+        double atomic = run_threads(nr, [&](int t)
+                                    {
+            uint64_t x = t + 1;
+            for (uint64_t i = 0; i < ops_per_thread; i++)
+                shared[next_key(x)].fetch_add(1, std::memory_order_relaxed); });
+
+        // 每CPU表，各自累加，读取时归约
+        std::vector<PerCpu> percpu(nr);
+        double local = run_threads(nr, [&](int t)
+                                   {
+            uint64_t x = t + 1;
+            auto &p = percpu[t];
+            for (uint64_t i = 0; i < ops_per_thread; i++)
+                (*(volatile uint64_t *)&p.vals[next_key(x)])++; });
+        uint64_t reduced = 0;
+        for (auto &p : percpu)
+            for (auto v : p.vals)
+                reduced += v;
+        if (reduced != total)
+            std::cerr << "percpu reduction mismatch\n";
+
+        std::cout << nr << std::fixed << std::setprecision(2)
+                  << '\t' << plain << '\t' << 100.0 * (total - counted) / total
+                  << '\t' << atomic << '\t' << local << '\n';
+    }
+    return 0;
+}
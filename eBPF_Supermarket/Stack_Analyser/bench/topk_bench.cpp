@@ -0,0 +1,107 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 计数表排序的微基准测试，比较逐项有序插入与top-K选择在不同psid数量下的耗时
+
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <iomanip>
+
+#include "bpf_wapper/eBPFStackCollector.h"
+
+static const int scale_num = 2;
+
+/// @brief 生成模拟的计数表原始数据
+static void gen_counts(std::vector<psid> &keys, std::vector<uint32_t> &raw, uint32_t n)
+{
+    std::mt19937 rng(n);
+    // 调用栈计数通常呈长尾分布
+    std::geometric_distribution<uint32_t> dist(0.01);
+    keys.resize(n);
+    raw.resize((size_t)n * scale_num);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        keys[i] = {.pid = (uint32_t)(rng() % 4096), .ksid = (int32_t)(rng() % MAX_ENTRIES), .usid = (int32_t)(rng() % MAX_ENTRIES)};
+        raw[i * scale_num] = dist(rng) + 1;
+        raw[i * scale_num + 1] = dist(rng) + 1;
+    }
+}
+
+/// @brief 原有做法：每项分配一次值数组，并有序插入
+static void by_insertion(const std::vector<psid> &keys, const std::vector<uint32_t> &raw)
+{
+    std::vector<CountItem> D;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        CountItem d(keys[i], new uint64_t[scale_num]{raw[i * scale_num], raw[i * scale_num + 1]});
+        D.insert(std::lower_bound(D.begin(), D.end(), d), d);
+    }
+    for (auto &i : D)
+        delete[] i.v;
+}
+
+/// @brief 现有做法：值放入预分配的连续区域，再做top-K选择
+static void by_selection(const std::vector<psid> &keys, const std::vector<uint32_t> &raw, uint32_t top,
+                         std::vector<uint64_t> &arena, std::vector<CountItem> &D)
+{
+    arena.resize(keys.size() * scale_num);
+    D.clear();
+    D.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        uint64_t *v = arena.data() + i * scale_num;
+        v[0] = raw[i * scale_num];
+        v[1] = raw[i * scale_num + 1];
+        D.emplace_back(keys[i], v);
+    }
+    selectTopCounts(D, top);
+}
+
+template <typename F>
+static double time_ms(F f, int rounds)
+{
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++)
+        f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - begin).count() / rounds;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t top = argc > 1 ? atoi(argv[1]) : 10;
+    std::vector<psid> keys;
+    std::vector<uint32_t> raw;
+    std::vector<uint64_t> arena;
+    std::vector<CountItem> D;
+    std::cout << "top=" << top << "\n"
+              << "keys\tinsertion(ms)\tselection(ms)\tfull_sort(ms)\n";
+    for (uint32_t n : {1000u, 5000u, 10000u, 20000u, 40000u, 80000u, (uint32_t)MAX_ENTRIES})
+    {
+        gen_counts(keys, raw, n);
+        int rounds = n > 20000 ? 1 : 5;
+        double ins = time_ms([&]
+                             { by_insertion(keys, raw); }, rounds);
+        double sel = time_ms([&]
+                             { by_selection(keys, raw, top, arena, D); }, rounds * 4);
+        double all = time_ms([&]
+                             { by_selection(keys, raw, 0, arena, D); }, rounds * 4);
+        std::cout << n << std::fixed << std::setprecision(3)
+                  << '\t' << ins << '\t' << sel << '\t' << all << '\n';
+    }
+    return 0;
+}
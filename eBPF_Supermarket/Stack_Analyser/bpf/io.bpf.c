@@ -27,14 +27,84 @@
 
 COMMON_MAPS(io_tuple);
 COMMON_VALS;
+// 进行中的io系统调用，以线程id为键
+BPF_HASH(io_starts, u32, io_start, MAX_ENTRIES/10);
+// 进行中的io_uring请求，以请求的地址为键
+BPF_HASH(uring_starts, u64, io_start, MAX_ENTRIES/10);
+// 各fd类型的延迟直方图，以fid即类型加1为下标
+BPF_ARRAY(type_hist_map, io_hist, IO_FD_TYPES + 1);
+
+// 套接字、管道和eventfd的file_operations地址，由用户态从内核符号表中查得，为0时按inode类型判断
+const volatile __u64 type_fops[IO_FD_TYPES] = {};
 
 const char LICENSE[] SEC("license") = "GPL";
 
-static int do_stack(struct trace_event_raw_sys_enter *ctx)
+#ifndef S_IFMT
+#define S_IFMT 00170000
+#define S_IFSOCK 0140000
+#define S_IFREG 0100000
+#define S_IFIFO 0010000
+#endif
+
+/// @brief 根据文件的操作函数表和inode类型判断fd类型
+static __always_inline u32 file_type(struct file *file)
+{
+    if (!file)
+        return IO_FD_OTHER;
+    u64 fop = (u64)BPF_CORE_READ(file, f_op);
+    for (int i = IO_FD_SOCK; i < IO_FD_TYPES; i++)
+        if (type_fops[i] && fop == type_fops[i])
+            return i;
+    switch (BPF_CORE_READ(file, f_inode, i_mode) & S_IFMT)
+    {
+    case S_IFREG:
+        return IO_FD_FILE;
+    case S_IFSOCK:
+        return IO_FD_SOCK;
+    case S_IFIFO:
+        return IO_FD_PIPE;
+    default:
+        return IO_FD_OTHER;
+    }
+}
+
+/// @brief 从当前线程的文件表中取出fd对应的文件并判断类型
+static __always_inline u32 fd_type(struct task_struct *curr, s64 fd)
+{
+    struct fdtable *fdt = BPF_CORE_READ(curr, files, fdt);
+    if (fd < 0 || !fdt || fd >= BPF_CORE_READ(fdt, max_fds))
+        return IO_FD_OTHER;
+    struct file **fds = BPF_CORE_READ(fdt, fd);
+    struct file *file = NULL;
+    bpf_probe_read_kernel(&file, sizeof(file), fds + fd);
+    return file_type(file);
+}
+
+/// @brief 计算log2的整数部分，v为0时为0
+static __always_inline u32 log2_u64(u64 v)
+{
+    u32 r, shift;
+    r = (v > 0xFFFFFFFF) << 5;
+    v >>= r;
+    shift = (v > 0xFFFF) << 4;
+    v >>= shift;
+    r |= shift;
+    shift = (v > 0xFF) << 3;
+    v >>= shift;
+    r |= shift;
+    shift = (v > 0xF) << 2;
+    v >>= shift;
+    r |= shift;
+    shift = (v > 0x3) << 1;
+    v >>= shift;
+    r |= shift;
+    return r | (v >> 1);
+}
+
+/// @brief 过滤并采集调用栈，存入开始记录的键中
+/// @return 需要记录时返回真
+static __always_inline bool io_begin(void *ctx, struct task_struct *curr, io_start *s)
 {
-    CHECK_ACTIVE;
-    CHECK_FREQ(TS);
-    struct task_struct *curr = GET_CURR;
     CHECK_KTHREAD(curr);
     u32 tgid = BPF_CORE_READ(curr, tgid);
     CHECK_TGID(tgid);
@@ -44,39 +114,153 @@ static int do_stack(struct trace_event_raw_sys_enter *ctx)
     u32 pid = BPF_CORE_READ(curr, pid);
     TRY_SAVE_INFO(curr, pid, tgid, knode);
     psid apsid = TRACE_AND_GET_COUNT_KEY(pid, ctx);
-    io_tuple *d = bpf_map_lookup_elem(&psid_count_map, &apsid); // count指向psid_count表当中的apsid表项，即size
-    u64 len = BPF_CORE_READ(ctx, args[2]);                      // 读取系统调用的第三个参数
+    s->id = apsid;
+    return 1;
+}
+
+/// @brief 一次io结束，将延迟和传输的字节数计入开始时的调用栈
+static __always_inline void io_end(io_start *s, s64 ret)
+{
+    u64 delta = TS - s->ts;
+    u64 len = ret > 0 ? ret : 0;
+    u32 fid = s->id.fid;
+    io_hist *h = bpf_map_lookup_elem(&type_hist_map, &fid);
+    if (h)
+    {
+        u32 slot = log2_u64(delta);
+        if (slot >= IO_HIST_SLOTS)
+            slot = IO_HIST_SLOTS - 1;
+        __sync_fetch_and_add(&h->slots[slot], 1);
+    }
+    io_tuple *d = bpf_map_lookup_elem(COUNT_MAP, &s->id);
     if (!d)
     {
-        io_tuple tmp = {.count = 1, .size = len};
-        bpf_map_update_elem(&psid_count_map, &apsid, &tmp, BPF_NOEXIST);
+        io_tuple tmp = {.size = len, .count = 1, .lat = delta};
+        bpf_map_update_elem(COUNT_MAP, &s->id, &tmp, BPF_NOEXIST);
     }
     else
     {
         d->count++;
         d->size += len;
+        d->lat += delta;
     }
+}
+
+static int do_enter(struct trace_event_raw_sys_enter *ctx)
+{
+    CHECK_ACTIVE;
+    u64 ts = TS;
+    CHECK_FREQ(ts);
+    struct task_struct *curr = GET_CURR;
+    io_start s = {.ts = ts};
+    if (!io_begin(ctx, curr, &s))
+        return 0;
+    // 这些系统调用的第一个参数都是fd，fd类型加1后存入键的fid
+    s.id.fid = fd_type(curr, BPF_CORE_READ(ctx, args[0])) + 1;
+    bpf_map_update_elem(&io_starts, &s.id.pid, &s, BPF_ANY);
     return 0;
 }
 
-#define io_sec_tp(name)                 \
-    SEC("tp/syscalls/sys_enter_" #name) \
-    int prog_t_##name(struct trace_event_raw_sys_enter *ctx) { return do_stack(ctx); }
+static int do_exit(struct trace_event_raw_sys_exit *ctx)
+{
+    CHECK_ACTIVE;
+    u32 pid = bpf_get_current_pid_tgid();
+    io_start *s = bpf_map_lookup_elem(&io_starts, &pid);
+    if (!s)
+        return 0;
+    io_end(s, BPF_CORE_READ(ctx, ret));
+    bpf_map_delete_elem(&io_starts, &pid);
+    return 0;
+}
+
+#define io_sec_tp(name)                                                                     \
+    SEC("tp/syscalls/sys_enter_" #name)                                                     \
+    int prog_t_##name(struct trace_event_raw_sys_enter *ctx) { return do_enter(ctx); }     \
+    SEC("tp/syscalls/sys_exit_" #name)                                                      \
+    int prog_t_##name##_ret(struct trace_event_raw_sys_exit *ctx) { return do_exit(ctx); }
 
 io_sec_tp(write);
 io_sec_tp(read);
+io_sec_tp(pwrite64);
+io_sec_tp(pread64);
+io_sec_tp(writev);
+io_sec_tp(readv);
+io_sec_tp(pwritev);
+io_sec_tp(preadv);
 io_sec_tp(recvfrom);
 io_sec_tp(sendto);
+io_sec_tp(recvmsg);
+io_sec_tp(sendmsg);
+
+// 以下结构只声明用到的字段，由CO-RE在加载时重定位，
+// 使没有io_uring或io_uring跟踪点较旧的内核上也能编译，此时不加载io_uring程序
+struct trace_event_raw_io_uring_submit_req___sa
+{
+    void *req;
+    u8 opcode;
+} __attribute__((preserve_access_index));
+
+struct trace_event_raw_io_uring_complete___sa
+{
+    void *req;
+    int res;
+} __attribute__((preserve_access_index));
 
-// tracepoint:syscalls:sys_exit_select
-// tracepoint:syscalls:sys_enter_poll
-// tracepoint:syscalls:sys_enter_epoll_wait
+struct io_kiocb___sa
+{
+    struct file *file;
+} __attribute__((preserve_access_index));
+
+/// @brief 是否为读写数据的io_uring操作，其结果为传输的字节数，操作码取自uapi
+static __always_inline bool uring_rw_op(u8 op)
+{
+    switch (op)
+    {
+    case 1:  // IORING_OP_READV
+    case 2:  // IORING_OP_WRITEV
+    case 4:  // IORING_OP_READ_FIXED
+    case 5:  // IORING_OP_WRITE_FIXED
+    case 9:  // IORING_OP_SENDMSG
+    case 10: // IORING_OP_RECVMSG
+    case 22: // IORING_OP_READ
+    case 23: // IORING_OP_WRITE
+    case 26: // IORING_OP_SEND
+    case 27: // IORING_OP_RECV
+        return 1;
+    default:
+        return 0;
+    }
+}
 
-// 1. 设置挂载点
-// tracepoint/syscalls/sys_enter_write 读操作
-// tracepoint/syscalls/sys_enter_read 写操作
-// tracepoint/syscalls/sys_enter_recvfrom 接收数据
-// tracepoint/syscalls/sys_enter_sendto 发送数据
+// io_uring请求异步完成，提交时记录提交者的调用栈，完成时按请求的地址取回
+SEC("tp/io_uring/io_uring_submit_req")
+int uring_submit(struct trace_event_raw_io_uring_submit_req___sa *ctx)
+{
+    CHECK_ACTIVE;
+    if (!uring_rw_op(BPF_CORE_READ(ctx, opcode)))
+        return 0;
+    u64 ts = TS;
+    CHECK_FREQ(ts);
+    struct task_struct *curr = GET_CURR;
+    struct io_kiocb___sa *req = BPF_CORE_READ(ctx, req);
+    io_start s = {.ts = ts};
+    if (!io_begin(ctx, curr, &s))
+        return 0;
+    s.id.fid = file_type(BPF_CORE_READ(req, file)) + 1;
+    u64 key = (u64)req;
+    bpf_map_update_elem(&uring_starts, &key, &s, BPF_ANY);
+    return 0;
+}
 
-// 2. 执行程序 int prog_t_##name(struct trace_event_raw_sys_enter *ctx) { return do_stack(ctx); }
-// 最终调用上面的do_stack函数
\ No newline at end of file
+SEC("tp/io_uring/io_uring_complete")
+int uring_complete(struct trace_event_raw_io_uring_complete___sa *ctx)
+{
+    CHECK_ACTIVE;
+    u64 key = (u64)BPF_CORE_READ(ctx, req);
+    io_start *s = bpf_map_lookup_elem(&uring_starts, &key);
+    if (!s)
+        return 0;
+    io_end(s, BPF_CORE_READ(ctx, res));
+    bpf_map_delete_elem(&uring_starts, &key);
+    return 0;
+}
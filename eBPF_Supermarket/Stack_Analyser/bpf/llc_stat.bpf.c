@@ -42,11 +42,11 @@ static __always_inline int trace_event(__u64 sample_period, bool miss, struct bp
     u32 tgid = BPF_CORE_READ(curr, tgid);
     TRY_SAVE_INFO(curr, pid, tgid, knode);
     psid apsid = TRACE_AND_GET_COUNT_KEY(pid, ctx);
-    llc_stat *infop = bpf_map_lookup_elem(&psid_count_map, &apsid);
+    llc_stat *infop = bpf_map_lookup_elem(COUNT_MAP, &apsid);
     if (!infop)
     {
         llc_stat tmp = {miss, !miss};
-        bpf_map_update_elem(&psid_count_map, &apsid, &tmp, BPF_NOEXIST);
+        bpf_map_update_elem(COUNT_MAP, &apsid, &tmp, BPF_NOEXIST);
     }
     else
     {
@@ -30,16 +30,72 @@ COMMON_VALS;
 const volatile bool wa_missing_free = false;
 const volatile size_t page_size = 4096;
 const volatile bool trace_all = false;
+// 平均每多少字节采样一次分配，为0时记录所有分配
+const volatile __u64 sample_bytes = 0;
 
 BPF_HASH(pid_size_map, u32, u64, MAX_ENTRIES);             // 记录了对应进程使用malloc,calloc等函数申请内存的大小
 BPF_HASH(piddr_meminfo_map, piddr, mem_info, MAX_ENTRIES); // 记录了每次申请的内存空间的起始地址等信息
 BPF_HASH(memptrs_map, u32, u64, MAX_ENTRIES);
+// 各CPU距下一次采样还需分配的字节数
+typedef struct
+{
+    s64 left;
+    bool seeded; // 是否已抽取第一个间隔
+} sample_state;
+BPF_PERCPU_ARRAY(sample_left_map, sample_state, 1);
 
 const char LICENSE[] SEC("license") = "GPL";
 
+/// @brief 以16位定点数生成均值为1的近似指数分布随机数，即-ln(u/2^32)
+/// @note log2的小数部分对尾数线性近似，其均值偏大0.0573，
+///       故以1/1.5代替ln2作为系数，使结果的均值为1
+static __always_inline u64 exp_rand_q16(void)
+{
+    u32 u = bpf_get_prandom_u32() | 1;
+    u32 x = u, msb = 0;
+    if (x >= 1u << 16)
+        x >>= 16, msb += 16;
+    if (x >= 1u << 8)
+        x >>= 8, msb += 8;
+    if (x >= 1u << 4)
+        x >>= 4, msb += 4;
+    if (x >= 1u << 2)
+        x >>= 2, msb += 2;
+    if (x >= 1u << 1)
+        msb += 1;
+    u64 log2_q16 = ((u64)msb << 16) + ((((u64)u << 16) >> msb) - (1 << 16));
+    // -ln(u/2^32) = (32 - log2(u)) * ln2，1/1.5的16位定点数为43691
+    return (((32ull << 16) - log2_q16) * 43691) >> 16;
+}
+
+/// @brief 按字节的泊松采样，平均每sample_bytes字节采样一次分配
+/// @note 各CPU独立计算间隔，指数分布的无记忆性保证线程迁移不影响采样概率
+static __always_inline bool sample_alloc(u64 size)
+{
+    u32 zero = 0;
+    sample_state *st = bpf_map_lookup_elem(&sample_left_map, &zero);
+    if (!st)
+        return true;
+    // 第一次见到该CPU时先抽取间隔，否则每个CPU上的第一次分配都必被采样
+    if (!st->seeded)
+    {
+        st->left = (sample_bytes * exp_rand_q16()) >> 16;
+        st->seeded = true;
+    }
+    st->left -= size;
+    if (st->left > 0)
+        return false;
+    // 一次分配可能跨过多个采样点，只需重新抽取下一个间隔
+    st->left = (sample_bytes * exp_rand_q16()) >> 16;
+    return true;
+}
+
 static int gen_alloc_enter(size_t size)
 {
     CHECK_ACTIVE;
+    // 在任何表操作之前决定是否采样
+    if (sample_bytes && !sample_alloc(size))
+        return 0;
     CHECK_FREQ(TS);
     struct task_struct *curr = GET_CURR;
     CHECK_KTHREAD(curr);
@@ -51,8 +107,9 @@ static int gen_alloc_enter(size_t size)
     TRY_SAVE_INFO(curr, tgid, tgid, knode);
     if (trace_all)
         bpf_printk("alloc entered, size = %lu\n", size);
-    // record size
-    return bpf_map_update_elem(&pid_size_map, &tgid, &size, BPF_ANY);
+    // record size，与返回时一样以线程id为键
+    u32 pid = bpf_get_current_pid_tgid();
+    return bpf_map_update_elem(&pid_size_map, &pid, &size, BPF_ANY);
 }
 
 static int gen_alloc_exit2(void *ctx, u64 addr)
@@ -61,18 +118,22 @@ static int gen_alloc_exit2(void *ctx, u64 addr)
     if (!addr)
         return 0;
     u32 tgid = bpf_get_current_pid_tgid();
-    u64 *size = bpf_map_lookup_elem(&pid_size_map, &tgid);
-    if (!size)
+    u64 *psize = bpf_map_lookup_elem(&pid_size_map, &tgid);
+    if (!psize)
         return 0;
+    // 取出后即删除，未被采样的分配返回时不会误用此前的大小
+    u64 sz = *psize;
+    u64 *size = &sz;
+    bpf_map_delete_elem(&pid_size_map, &tgid);
     // record counts
     psid apsid = TRACE_AND_GET_COUNT_KEY(tgid, ctx);
-    union combined_alloc_info *count = bpf_map_lookup_elem(&psid_count_map, &apsid);
+    union combined_alloc_info *count = bpf_map_lookup_elem(COUNT_MAP, &apsid);
     union combined_alloc_info cur = {
         .number_of_allocs = 1,
         .total_size = *size,
     };
     if (!count)
-        bpf_map_update_elem(&psid_count_map, &apsid, &cur, BPF_NOEXIST);
+        bpf_map_update_elem(COUNT_MAP, &apsid, &cur, BPF_NOEXIST);
     else
         __sync_fetch_and_add(&(count->bits), cur.bits);
     if (trace_all)
@@ -87,6 +148,7 @@ static int gen_alloc_exit2(void *ctx, u64 addr)
         .size = *size,
         .usid = apsid.usid,
         .ksid = apsid.ksid,
+        .cgid = apsid.cgid,
     };
     return bpf_map_update_elem(&piddr_meminfo_map, &a, &info, BPF_NOEXIST);
 }
@@ -110,9 +172,10 @@ static int gen_free_enter(const void *addr)
         .pid = tgid,
         .ksid = info->ksid,
         .usid = info->usid,
+        .cgid = info->cgid,
     };
 
-    union combined_alloc_info *size = bpf_map_lookup_elem(&psid_count_map, &apsid);
+    union combined_alloc_info *size = bpf_map_lookup_elem(COUNT_MAP, &apsid);
     if (!size)
         return -1;
     union combined_alloc_info cur = {
@@ -123,7 +186,7 @@ static int gen_free_enter(const void *addr)
     __sync_fetch_and_sub(&(size->bits), cur.bits);
 
     if (size->total_size == 0)
-        bpf_map_delete_elem(&psid_count_map, &apsid);
+        bpf_map_delete_elem(COUNT_MAP, &apsid);
     if (trace_all)
         bpf_printk("free entered, address = %lx, size = %lu\n", addr, info->size);
     // del freeing addr info
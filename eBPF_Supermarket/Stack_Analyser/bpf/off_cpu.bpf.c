@@ -28,6 +28,19 @@ COMMON_MAPS(u32);
 COMMON_VALS;
 // 记录进程运行的起始时间
 BPF_HASH(pid_offTs_map, u32, u64, MAX_ENTRIES/10);
+// 流式采集时记录被唤醒线程的唤醒者及其调用栈
+BPF_HASH(pid_waker_map, u32, psid, MAX_ENTRIES/10);
+// 流式采集时向用户态提交阻塞事件
+struct
+{
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, OFFCPU_RINGBUF_SIZE);
+} offcpu_events SEC(".maps");
+
+// 是否逐次提交纳秒级的阻塞事件，而非按毫秒累计
+const volatile bool stream = false;
+// 环形缓冲区已满而丢弃的事件数
+__u64 __stream_lost = 0;
 
 const char LICENSE[] SEC("license") = "GPL";
 
@@ -45,6 +58,34 @@ static int prev_part(struct task_struct *prev)
     return 0;
 }
 
+// 缓冲区中未读数据超过该值时才唤醒用户态，使事件被批量消费
+#define WAKEUP_DATA_SIZE (OFFCPU_RINGBUF_SIZE / 8)
+
+static int submit_event(psid *wakee, u64 delta)
+{
+    offcpu_event *e = bpf_ringbuf_reserve(&offcpu_events, sizeof(offcpu_event), 0);
+    if (!e)
+    {
+        __sync_fetch_and_add(&__stream_lost, 1);
+        return 0;
+    }
+    e->wakee = *wakee;
+    psid *waker = bpf_map_lookup_elem(&pid_waker_map, &wakee->pid);
+    if (waker)
+    {
+        e->waker = *waker;
+        bpf_map_delete_elem(&pid_waker_map, &wakee->pid);
+    }
+    else
+        __builtin_memset(&e->waker, 0, sizeof(psid));
+    e->delta = delta;
+    long flags = bpf_ringbuf_query(&offcpu_events, BPF_RB_AVAIL_DATA) > WAKEUP_DATA_SIZE
+                     ? BPF_RB_FORCE_WAKEUP
+                     : BPF_RB_NO_WAKEUP;
+    bpf_ringbuf_submit(e, flags);
+    return 0;
+}
+
 static int next_part(struct task_struct *next, void *ctx)
 {
     // 利用帮助函数获取next指向的tsk的pid
@@ -54,24 +95,31 @@ static int next_part(struct task_struct *next, void *ctx)
     if (!tsp)
         return 0;
     // delta为当前时间戳 - 原先tsp指向start表中的pid的值.代表运行时间
-    u32 delta = (bpf_ktime_get_ns() - *tsp) >> 20;
-    if (!delta)
+    u64 delta_ns = bpf_ktime_get_ns() - *tsp;
+    u32 delta = delta_ns >> 20;
+    if (!stream && !delta)
         return 0;
 
     // record data
     struct kernfs_node *knode = GET_KNODE(next);
     TRY_SAVE_INFO(next, pid, BPF_CORE_READ(next, tgid), knode);
     psid apsid = TRACE_AND_GET_COUNT_KEY(pid, ctx);
+    if (stream)
+    {
+        // 只为仍处于阻塞的线程记录唤醒者
+        bpf_map_delete_elem(&pid_offTs_map, &pid);
+        return submit_event(&apsid, delta_ns);
+    }
 
     // record time delta
     // count指向psid_count中的apsid对应的值
-    u32 *count = bpf_map_lookup_elem(&psid_count_map, &apsid);
+    u32 *count = bpf_map_lookup_elem(COUNT_MAP, &apsid);
     if (count)
         // 如果count存在，则psid_count中的apsid对应的值+=时间戳
         (*count) += delta;
     else
         // 如果不存在，则将psid_count表中的apsid设置为delta
-        bpf_map_update_elem(&psid_count_map, &apsid, &delta, BPF_NOEXIST);
+        bpf_map_update_elem(COUNT_MAP, &apsid, &delta, BPF_NOEXIST);
     return 0;
 }
 
@@ -84,4 +132,21 @@ int BPF_KPROBE(do_stack, struct task_struct *prev)
     // calculate time delta, next ready to run
     next_part(GET_CURR, ctx);
     return 0;
+}
+
+// sched_waking在唤醒者的上下文中触发，此时的调用栈即唤醒者的调用栈
+SEC("tp/sched/sched_waking")
+int do_wakeup(struct trace_event_raw_sched_wakeup_template *ctx)
+{
+    CHECK_ACTIVE;
+    u32 wakee = ctx->pid;
+    if (!bpf_map_lookup_elem(&pid_offTs_map, &wakee))
+        return 0;
+    struct task_struct *curr = GET_CURR;
+    u32 pid = BPF_CORE_READ(curr, pid);
+    struct kernfs_node *knode = GET_KNODE(curr);
+    TRY_SAVE_INFO(curr, pid, BPF_CORE_READ(curr, tgid), knode);
+    psid waker = TRACE_AND_GET_COUNT_KEY(pid, ctx);
+    bpf_map_update_elem(&pid_waker_map, &wakee, &waker, BPF_ANY);
+    return 0;
 }
\ No newline at end of file
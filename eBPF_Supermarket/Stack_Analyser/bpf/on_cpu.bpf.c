@@ -29,6 +29,75 @@ const char LICENSE[] SEC("license") = "GPL";
 COMMON_MAPS(u32);
 COMMON_VALS;
 
+// 在用户态回溯用户栈时，向用户态提交采样
+struct
+{
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, USTACK_RINGBUF_SIZE);
+} ustack_samples SEC(".maps");
+// 组装待提交的采样，采样太大无法放在bpf栈上
+BPF_PERCPU_ARRAY(ustack_scratch, ustack_sample, 1);
+
+// 每次采样复制的用户栈长度，为0时在内核中按帧指针回溯用户栈
+const volatile __u32 ustack_bytes = 0;
+// 环形缓冲区已满而丢弃的采样数
+__u64 __ustack_lost = 0;
+
+// 缓冲区中未读数据超过该值时才唤醒用户态，使采样被批量回溯
+#define WAKEUP_DATA_SIZE (USTACK_RINGBUF_SIZE / 8)
+
+/// @brief 复制用户态寄存器和栈指针处的一段用户栈，提交给用户态回溯
+static int submit_ustack(void *ctx, u32 pid, u32 tgid)
+{
+    u32 zero = 0;
+    ustack_sample *s = bpf_map_lookup_elem(&ustack_scratch, &zero);
+    if (!s)
+        return 0;
+    s->id.pid = pid;
+    s->id.usid = -1;
+    s->id.fid = 0;
+    s->id.cgid = cgroup_key ? bpf_get_current_cgroup_id() : 0;
+    s->id.ksid = trace_kernel ? (stack_depth ? GET_HASHED_SID(ctx, 0)
+                                             : bpf_get_stackid(ctx, &sid_trace_map, BPF_F_FAST_STACK_CMP))
+                              : -1;
+    s->tgid = tgid;
+    // 无论采样时处于内核态还是用户态，task_pt_regs都保存着用户态的寄存器
+    // bpf_task_pt_regs要求可信的BTF指针，GET_CURR得到的只是标量，不能传入
+    struct pt_regs *regs = (struct pt_regs *)bpf_task_pt_regs(bpf_get_current_task_btf());
+    s->ip = PT_REGS_IP_CORE(regs);
+    s->sp = PT_REGS_SP_CORE(regs);
+    s->fp = PT_REGS_FP_CORE(regs);
+#if defined(__TARGET_ARCH_arm64)
+    s->lr = PT_REGS_RET_CORE(regs);
+#else
+    s->lr = 0;
+#endif
+    // 栈指针到栈底不足设定长度时整段读取会失败，减半重试
+    u32 size = ustack_bytes;
+    s->size = 0;
+    for (int i = 0; i < 4; i++, size >>= 1)
+    {
+        if (size > USTACK_MAX_BYTES)
+            size = USTACK_MAX_BYTES;
+        if (size < 64)
+            break;
+        if (!bpf_probe_read_user(s->stack, size, (void *)s->sp))
+        {
+            s->size = size;
+            break;
+        }
+    }
+    u32 len = offsetof(ustack_sample, stack) + s->size;
+    if (len > sizeof(ustack_sample))
+        len = sizeof(ustack_sample);
+    long flags = bpf_ringbuf_query(&ustack_samples, BPF_RB_AVAIL_DATA) > WAKEUP_DATA_SIZE
+                     ? BPF_RB_FORCE_WAKEUP
+                     : BPF_RB_NO_WAKEUP;
+    if (bpf_ringbuf_output(&ustack_samples, s, len, flags))
+        __sync_fetch_and_add(&__ustack_lost, 1);
+    return 0;
+}
+
 SEC("perf_event") // 挂载点为perf_event
 int do_stack(void *ctx)
 {
@@ -40,15 +109,18 @@ int do_stack(void *ctx)
     CHECK_CGID(knode);
 
     u32 pid = BPF_CORE_READ(curr, pid);
-    TRY_SAVE_INFO(curr, pid, BPF_CORE_READ(curr, tgid), knode);
+    u32 tgid = BPF_CORE_READ(curr, tgid);
+    TRY_SAVE_INFO(curr, pid, tgid, knode);
+    if (ustack_bytes && trace_user)
+        return submit_ustack(ctx, pid, tgid);
     psid apsid = TRACE_AND_GET_COUNT_KEY(pid, ctx);
-    u32 *count = bpf_map_lookup_elem(&psid_count_map, &apsid); // count指向psid_count对应的apsid的值
+    u32 *count = bpf_map_lookup_elem(COUNT_MAP, &apsid); // count指向psid_count对应的apsid的值
     if (count)
         (*count)++; // count不为空，则psid_count对应的apsid的值+1
     else
     {
         u32 orig = 1;
-        bpf_map_update_elem(&psid_count_map, &apsid, &orig, BPF_ANY); // 否则psid_count对应的apsid的值=1
+        bpf_map_update_elem(COUNT_MAP, &apsid, &orig, BPF_ANY); // 否则psid_count对应的apsid的值=1
     }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,93 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 内核态bpf的pmu模块代码，按组长事件采样，将组内各事件在两次采样之间的增量归属到被采样的调用栈
+
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+
+#include "ebpf.h"
+#include "task.h"
+
+COMMON_MAPS(pmu_count);
+COMMON_VALS;
+// 组内各事件在各CPU上的perf事件，第i个事件在第cpu个CPU上的索引为i*nr_cpus+cpu
+struct
+{
+    __uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
+    __uint(key_size, sizeof(u32));
+    __uint(value_size, sizeof(u32));
+    __uint(max_entries, 1);
+} pmu_events SEC(".maps");
+// 各CPU上组内事件上次采样时的计数值
+BPF_PERCPU_ARRAY(pmu_last, pmu_count, 1);
+
+// 组内的事件数，包括组长
+const volatile __u32 nr_events = 1;
+const volatile __u32 nr_cpus = 1;
+
+const char LICENSE[] SEC("license") = "GPL";
+
+SEC("perf_event")
+int do_sample(struct bpf_perf_event_data *ctx)
+{
+    CHECK_ACTIVE;
+    u32 zero = 0;
+    pmu_count *last = bpf_map_lookup_elem(&pmu_last, &zero);
+    if (!last)
+        return 0;
+    // 无论本次采样是否被过滤都更新上次的计数值，增量只归属到两次采样之间被采样的线程
+    pmu_count delta = {0};
+    delta.vals[0] = ctx->sample_period;
+    u32 cpu = bpf_get_smp_processor_id();
+    for (u32 i = 1; i < MAX_PMU_EVENTS && i < nr_events; i++)
+    {
+        struct bpf_perf_event_value v;
+        if (bpf_perf_event_read_value(&pmu_events, i * nr_cpus + cpu, &v, sizeof(v)))
+            continue;
+        delta.vals[i] = v.counter - last->vals[i];
+        last->vals[i] = v.counter;
+    }
+    // 组长的增量取自采样周期，不使用其上次的计数值，该位置标记本CPU是否已记录初值。
+    // 本CPU的第一次采样之前没有起点，其余事件的计数是打开以来的累计值，只记录初值而不计入
+    if (!last->vals[0])
+    {
+        last->vals[0] = 1;
+        return 0;
+    }
+
+    struct task_struct *curr = GET_CURR;
+    CHECK_KTHREAD(curr);
+    // perf事件跟踪所有进程，需要在这里过滤tgid
+    u32 tgid = BPF_CORE_READ(curr, tgid);
+    CHECK_TGID(tgid);
+    struct kernfs_node *knode = GET_KNODE(curr);
+    CHECK_CGID(knode);
+    u32 pid = BPF_CORE_READ(curr, pid);
+    TRY_SAVE_INFO(curr, pid, tgid, knode);
+    psid apsid = TRACE_AND_GET_COUNT_KEY(pid, ctx);
+    pmu_count *count = bpf_map_lookup_elem(COUNT_MAP, &apsid);
+    if (!count)
+    {
+        bpf_map_update_elem(COUNT_MAP, &apsid, &delta, BPF_NOEXIST);
+        return 0;
+    }
+    for (u32 i = 0; i < MAX_PMU_EVENTS && i < nr_events; i++)
+        count->vals[i] += delta.vals[i];
+    return 0;
+}
@@ -29,6 +29,10 @@
 COMMON_MAPS(time_tuple);
 COMMON_VALS;
 BPF_HASH(starts, u32, u64, MAX_ENTRIES/10);
+// 同时探测多个函数时，以函数id和pid为键记录进入函数的时间，函数互相调用时不会覆盖
+BPF_HASH(fid_starts, u64, u64, MAX_ENTRIES/10);
+// 各函数的延迟直方图，以函数id为下标，长度在加载前按函数数设定
+BPF_ARRAY(fid_hist_map, lat_hist, 1);
 
 static int entry(void *ctx)
 {
@@ -51,18 +55,18 @@ static int entry(void *ctx)
 static int exit(void *ctx)
 {
     CHECK_ACTIVE;
-    u32 pid = bpf_get_current_pid_tgid() >> 32;
+    u32 pid = (u32)bpf_get_current_pid_tgid(); // 与入口处一致，按线程id配对
     u64 *start = bpf_map_lookup_elem(&starts, &pid);
     if (!start)
         return 0;
     u64 delta = TS - *start;
 
     psid a_psid = TRACE_AND_GET_COUNT_KEY(pid, ctx);
-    time_tuple *d = bpf_map_lookup_elem(&psid_count_map, &a_psid);
+    time_tuple *d = bpf_map_lookup_elem(COUNT_MAP, &a_psid);
     if (!d)
     {
         time_tuple tmp = {.lat = delta, .count = 1};
-        bpf_map_update_elem(&psid_count_map, &a_psid, &tmp, BPF_NOEXIST);
+        bpf_map_update_elem(COUNT_MAP, &a_psid, &tmp, BPF_NOEXIST);
     }
     else
     {
@@ -72,6 +76,83 @@ static int exit(void *ctx)
     return 0;
 }
 
+/// @brief 计算log2的整数部分，v为0时为0
+static __always_inline u32 log2_u64(u64 v)
+{
+    u32 r, shift;
+    r = (v > 0xFFFFFFFF) << 5;
+    v >>= r;
+    shift = (v > 0xFFFF) << 4;
+    v >>= shift;
+    r |= shift;
+    shift = (v > 0xFF) << 3;
+    v >>= shift;
+    r |= shift;
+    shift = (v > 0xF) << 2;
+    v >>= shift;
+    r |= shift;
+    shift = (v > 0x3) << 1;
+    v >>= shift;
+    r |= shift;
+    return r | (v >> 1);
+}
+
+static int multi_entry(void *ctx)
+{
+    CHECK_ACTIVE;
+    u64 ts = bpf_ktime_get_ns();
+    CHECK_FREQ(ts);
+    struct task_struct *curr = GET_CURR;
+    CHECK_KTHREAD(curr);
+    u32 tgid = BPF_CORE_READ(curr, tgid);
+    CHECK_TGID(tgid);
+    struct kernfs_node *knode = GET_KNODE(curr);
+    CHECK_CGID(knode);
+
+    u32 pid = BPF_CORE_READ(curr, pid);
+    TRY_SAVE_INFO(curr, pid, tgid, knode);
+    // 挂载时以函数id作为cookie
+    u64 key = bpf_get_attach_cookie(ctx) << 32 | pid;
+    bpf_map_update_elem(&fid_starts, &key, &ts, BPF_ANY);
+    return 0;
+}
+
+static int multi_exit(void *ctx)
+{
+    CHECK_ACTIVE;
+    u32 pid = (u32)bpf_get_current_pid_tgid(); // 与入口处一致，按线程id配对
+    u32 fid = bpf_get_attach_cookie(ctx);
+    u64 key = (u64)fid << 32 | pid;
+    u64 *start = bpf_map_lookup_elem(&fid_starts, &key);
+    if (!start)
+        return 0;
+    u64 delta = TS - *start;
+    bpf_map_delete_elem(&fid_starts, &key);
+
+    lat_hist *h = bpf_map_lookup_elem(&fid_hist_map, &fid);
+    if (h)
+    {
+        u32 slot = log2_u64(delta);
+        if (slot >= PROBE_HIST_SLOTS)
+            slot = PROBE_HIST_SLOTS - 1;
+        __sync_fetch_and_add(&h->slots[slot], 1);
+    }
+
+    psid a_psid = TRACE_AND_GET_COUNT_KEY(pid, ctx);
+    a_psid.fid = fid;
+    time_tuple *d = bpf_map_lookup_elem(COUNT_MAP, &a_psid);
+    if (!d)
+    {
+        time_tuple tmp = {.lat = delta, .count = 1};
+        bpf_map_update_elem(COUNT_MAP, &a_psid, &tmp, BPF_NOEXIST);
+    }
+    else
+    {
+        d->lat += delta;
+        d->count++;
+    }
+    return 0;
+}
 
 SEC("kprobe/dummy_kprobe")
 int BPF_KPROBE(dummy_kprobe)
@@ -115,17 +196,45 @@ static int static_tracing_handler(void *ctx)
     u32 pid = BPF_CORE_READ(curr, pid);
     TRY_SAVE_INFO(curr, pid, tgid, knode);
     psid a_psid = TRACE_AND_GET_COUNT_KEY(pid, ctx);
-    time_tuple *d = bpf_map_lookup_elem(&psid_count_map, &a_psid);
+    time_tuple *d = bpf_map_lookup_elem(COUNT_MAP, &a_psid);
     if (!d)
     {
         time_tuple tmp = {.lat = 0, .count = 1};
-        bpf_map_update_elem(&psid_count_map, &a_psid, &tmp, BPF_NOEXIST);
+        bpf_map_update_elem(COUNT_MAP, &a_psid, &tmp, BPF_NOEXIST);
     }
     else
         d->count++;
     return 0;
 }
 
+SEC("kprobe.multi")
+int multi_kprobe(struct pt_regs *ctx)
+{
+    multi_entry(ctx);
+    return 0;
+}
+
+SEC("kretprobe.multi")
+int multi_kretprobe(struct pt_regs *ctx)
+{
+    multi_exit(ctx);
+    return 0;
+}
+
+SEC("uprobe.multi")
+int multi_uprobe(struct pt_regs *ctx)
+{
+    multi_entry(ctx);
+    return 0;
+}
+
+SEC("uretprobe.multi")
+int multi_uretprobe(struct pt_regs *ctx)
+{
+    multi_exit(ctx);
+    return 0;
+}
+
 SEC("tp/sched/dummy_tp")
 int tp_exit(void *ctx)
 {
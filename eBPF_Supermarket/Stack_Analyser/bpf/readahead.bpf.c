@@ -32,10 +32,13 @@ COMMON_MAPS(ra_tuple);
 COMMON_VALS;
 
 BPF_HASH(in_ra_map, u32, psid, MAX_ENTRIES/10);
+// 不支持folio的内核上按4K页记录预读的页
 BPF_HASH(page_psid_map, struct page *, psid, MAX_ENTRIES);
+// 按folio记录预读的页，一个folio一项，由用户态在两种方式中选择一种加载
+BPF_HASH(folio_psid_map, struct folio *, ra_folio, MAX_ENTRIES);
 
-SEC("fentry/page_cache_ra_unbounded") // fentry在内核函数page_cache_ra_unbounded进入时触发的挂载点
-int BPF_PROG(page_cache_ra_unbounded)
+/// @brief 进入预读时记录当前线程的调用栈，其间分配的页都归属于该调用栈
+static int enter_ra(void *ctx)
 {
     CHECK_ACTIVE;
     CHECK_FREQ(TS);
@@ -49,26 +52,39 @@ int BPF_PROG(page_cache_ra_unbounded)
     u32 pid = BPF_CORE_READ(curr, pid);
     TRY_SAVE_INFO(curr, pid, tgid, knode);
     psid apsid = TRACE_AND_GET_COUNT_KEY(pid, ctx);
-    ra_tuple *d = bpf_map_lookup_elem(&psid_count_map, &apsid); // d指向psid_count表中的apsid对应的类型为tuple的值
+    ra_tuple *d = bpf_map_lookup_elem(COUNT_MAP, &apsid); // d指向psid_count表中的apsid对应的类型为tuple的值
     if (!d)
     {
         ra_tuple a = {.expect = 0, .truth = 0};                    // 初始化为0
-        bpf_map_update_elem(&psid_count_map, &apsid, &a, BPF_ANY); // 更新psid_count表中的apsid的值为a
+        bpf_map_update_elem(COUNT_MAP, &apsid, &a, BPF_ANY); // 更新psid_count表中的apsid的值为a
     }
     bpf_map_update_elem(&in_ra_map, &pid, &apsid, BPF_ANY); // 更新in_ra表中的pid对应的值为apsid
     return 0;
 }
 
+SEC("fentry/page_cache_ra_unbounded") // fentry在内核函数page_cache_ra_unbounded进入时触发的挂载点
+int BPF_PROG(page_cache_ra_unbounded)
+{
+    return enter_ra(ctx);
+}
+
+// 支持大folio的内核中，预读由page_cache_ra_order分配大folio，不一定经过page_cache_ra_unbounded
+SEC("fentry/page_cache_ra_order")
+int BPF_PROG(page_cache_ra_order)
+{
+    return enter_ra(ctx);
+}
+
 SEC("fexit/alloc_pages") // fexit在内核函数alloc_pages退出时触发，挂载点为alloc_pages
-int BPF_PROG(filemap_alloc_folio_ret, gfp_t gfp, unsigned int order, u64 ret)
+int BPF_PROG(alloc_pages_ret, gfp_t gfp, unsigned int order, u64 ret)
 {
     CHECK_ACTIVE;
-    u32 pid = bpf_get_current_pid_tgid() >> 32;                 // pid为当前进程的pid
+    u32 pid = (u32)bpf_get_current_pid_tgid();                  // pid为当前线程的id，与in_ra_map的键一致
     struct psid *apsid = bpf_map_lookup_elem(&in_ra_map, &pid); // apsid指向了当前in_ra中pid的表项内容
     if (!apsid)
         return 0;
 
-    ra_tuple *a = bpf_map_lookup_elem(&psid_count_map, apsid); // a是指向psid_count的apsid对应的内容
+    ra_tuple *a = bpf_map_lookup_elem(COUNT_MAP, apsid); // a是指向psid_count的apsid对应的内容
     if (!a)
         return 0;
 
@@ -82,25 +98,64 @@ int BPF_PROG(filemap_alloc_folio_ret, gfp_t gfp, unsigned int order, u64 ret)
     return 0;
 }
 
+/// @brief 预读分配了一个folio，整个folio只记录一项
+static int record_folio(struct folio *folio, unsigned int order)
+{
+    u32 pid = (u32)bpf_get_current_pid_tgid();
+    psid *apsid = bpf_map_lookup_elem(&in_ra_map, &pid);
+    if (!apsid || !folio)
+        return 0;
+    ra_tuple *a = bpf_map_lookup_elem(COUNT_MAP, apsid);
+    if (!a)
+        return 0;
+    ra_folio f = {.id = *apsid, .nr = 1u << order};
+    a->expect += f.nr;
+    bpf_map_update_elem(&folio_psid_map, &folio, &f, BPF_ANY);
+    return 0;
+}
+
+SEC("fexit/filemap_alloc_folio")
+int BPF_PROG(filemap_alloc_folio_ret, gfp_t gfp, unsigned int order, struct folio *ret)
+{
+    CHECK_ACTIVE;
+    return record_folio(ret, order);
+}
+
+// 开启内存分配标记的内核中filemap_alloc_folio为宏，实际的函数带_noprof后缀
+SEC("fexit/filemap_alloc_folio_noprof")
+int BPF_PROG(filemap_alloc_folio_noprof_ret, gfp_t gfp, unsigned int order, struct folio *ret)
+{
+    CHECK_ACTIVE;
+    return record_folio(ret, order);
+}
+
 SEC("fexit/page_cache_ra_unbounded")
 int BPF_PROG(page_cache_ra_unbounded_ret) // fexit在内核函数page_cache_ra_unbounded退出时触发的挂载点
 {
     CHECK_ACTIVE;
-    u32 pid = bpf_get_current_pid_tgid() >> 32; // 获取当前进程的pid
+    u32 pid = (u32)bpf_get_current_pid_tgid(); // 获取当前线程的id
     bpf_map_delete_elem(&in_ra_map, &pid);      // 删除了in_ra对应的pid的表项,即删除对应的栈计数信息
     return 0;
 }
 
+SEC("fexit/page_cache_ra_order")
+int BPF_PROG(page_cache_ra_order_ret)
+{
+    CHECK_ACTIVE;
+    u32 pid = (u32)bpf_get_current_pid_tgid();
+    bpf_map_delete_elem(&in_ra_map, &pid);
+    return 0;
+}
+
 SEC("fentry/mark_page_accessed") // fentry在内核函数/mark_page_accessed进入时触发的挂载点，用于标记页面（page）已经被访问
 int BPF_PROG(mark_page_accessed, u64 page)
 {
     CHECK_ACTIVE;
-    u32 pid = bpf_get_current_pid_tgid() >> 32; // 获取当前进程的pid
     psid *apsid;
     apsid = bpf_map_lookup_elem(&page_psid_map, &page); // 查看page_psid对应的 地址page 对应类型为psid的值，并保存在apsid
     if (!apsid)
         return 0;
-    ra_tuple *a = bpf_map_lookup_elem(&psid_count_map, apsid); // a指向psid_count的apsid的内容
+    ra_tuple *a = bpf_map_lookup_elem(COUNT_MAP, apsid); // a指向psid_count的apsid的内容
     if (!a)
         return 0;
     a->truth++;                                 // 已访问
@@ -108,4 +163,60 @@ int BPF_PROG(mark_page_accessed, u64 page)
     return 0;
 }
 
+// 读路径按folio内的偏移和长度拷贝数据，据此按位记录实际访问的页，
+// 每页只计一次，folio的页全部访问后删除该项
+SEC("fentry/copy_page_to_iter")
+int BPF_PROG(copy_page_to_iter, struct page *page, size_t offset, size_t bytes)
+{
+    CHECK_ACTIVE;
+    // filemap_read传入的是folio的首页，其地址即folio的地址
+    struct folio *folio = (struct folio *)page;
+    ra_folio *f = bpf_map_lookup_elem(&folio_psid_map, &folio);
+    if (!f || !bytes)
+        return 0;
+    u32 nr = f->nr < RA_FOLIO_PAGES ? f->nr : RA_FOLIO_PAGES;
+    u64 first = offset >> 12, last = (offset + bytes - 1) >> 12;
+    if (last >= nr)
+        last = nr - 1;
+    u32 fresh = 0;
+    for (u32 i = 0; i < RA_FOLIO_PAGES; i++)
+    {
+        u64 p = first + i;
+        if (p > last)
+            break;
+        u64 bit = 1ULL << (p & 63);
+        u64 *w = &f->seen[(p >> 6) & (RA_FOLIO_PAGES / 64 - 1)];
+        if (!(*w & bit))
+        {
+            *w |= bit;
+            fresh++;
+        }
+    }
+    if (!fresh)
+        return 0;
+    ra_tuple *a = bpf_map_lookup_elem(COUNT_MAP, &f->id);
+    if (a)
+        a->truth += fresh;
+    f->used += fresh;
+    if (f->used >= nr)
+        bpf_map_delete_elem(&folio_psid_map, &folio);
+    return 0;
+}
+
+// 无法挂载读路径时退回访问标记，标记以folio为单位，filemap_read在同一folio内的
+// 后续读取也不再标记，因此folio被访问即计其全部页为已使用，得到的是上界
+SEC("fentry/folio_mark_accessed")
+int BPF_PROG(folio_mark_accessed, struct folio *folio)
+{
+    CHECK_ACTIVE;
+    ra_folio *f = bpf_map_lookup_elem(&folio_psid_map, &folio);
+    if (!f)
+        return 0;
+    ra_tuple *a = bpf_map_lookup_elem(COUNT_MAP, &f->id);
+    if (a)
+        a->truth += f->nr;
+    bpf_map_delete_elem(&folio_psid_map, &folio);
+    return 0;
+}
+
 const char LICENSE[] SEC("license") = "GPL";
\ No newline at end of file
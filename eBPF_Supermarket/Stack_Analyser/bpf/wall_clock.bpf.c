@@ -0,0 +1,110 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 内核态bpf的wall-clock模块代码，将on-cpu采样换算为时间，与off-cpu时间合并计入同一计数表
+
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+
+#include "ebpf.h"
+#include "task.h"
+
+COMMON_MAPS(u64);
+COMMON_VALS;
+// 记录线程被换出的时间
+BPF_HASH(pid_offTs_map, u32, u64, MAX_ENTRIES/10);
+// 只跟踪其中的线程
+BPF_HASH(tid_filter_map, u32, u8, MAX_TID_FILTER);
+
+// 是否按tid_filter_map过滤线程
+const volatile bool filter_tids = false;
+
+const char LICENSE[] SEC("license") = "GPL";
+
+#define CHECK_TID(_pid)                                              \
+    if (filter_tids && !bpf_map_lookup_elem(&tid_filter_map, &_pid)) \
+        return 0;
+
+/// @brief 将一段时间累加到调用栈的计数上
+static int add_time(u32 pid, u64 delta, void *ctx)
+{
+    psid apsid = TRACE_AND_GET_COUNT_KEY(pid, ctx);
+    u64 *count = bpf_map_lookup_elem(COUNT_MAP, &apsid);
+    if (count)
+        (*count) += delta;
+    else
+        bpf_map_update_elem(COUNT_MAP, &apsid, &delta, BPF_NOEXIST);
+    return 0;
+}
+
+// 按时钟周期采样在cpu上运行的线程，每次采样代表一个采样周期的运行时间
+SEC("perf_event")
+int do_oncpu(struct bpf_perf_event_data *ctx)
+{
+    CHECK_ACTIVE;
+    struct task_struct *curr = GET_CURR;
+    CHECK_KTHREAD(curr);
+    // perf事件跟踪所有进程，需要在这里过滤tgid
+    u32 tgid = BPF_CORE_READ(curr, tgid);
+    CHECK_TGID(tgid);
+    struct kernfs_node *knode = GET_KNODE(curr);
+    CHECK_CGID(knode);
+    u32 pid = BPF_CORE_READ(curr, pid);
+    CHECK_TID(pid);
+    TRY_SAVE_INFO(curr, pid, tgid, knode);
+    // 事件为cpu-clock，采样周期即以纳秒计的运行时间，运行时调整周期后仍然准确
+    return add_time(pid, ctx->sample_period, ctx);
+}
+
+static int prev_part(struct task_struct *prev)
+{
+    CHECK_KTHREAD(prev);
+    u32 tgid = BPF_CORE_READ(prev, tgid);
+    CHECK_TGID(tgid);
+    struct kernfs_node *knode = GET_KNODE(prev);
+    CHECK_CGID(knode);
+    u32 pid = BPF_CORE_READ(prev, pid);
+    CHECK_TID(pid);
+    u64 ts = bpf_ktime_get_ns();
+    bpf_map_update_elem(&pid_offTs_map, &pid, &ts, BPF_ANY);
+    return 0;
+}
+
+static int next_part(struct task_struct *next, void *ctx)
+{
+    u32 pid = BPF_CORE_READ(next, pid);
+    u64 *tsp = bpf_map_lookup_elem(&pid_offTs_map, &pid);
+    if (!tsp)
+        return 0;
+    // 换出到换入的全部时间都计入，包括阻塞和在运行队列中等待，不舍去不足1ms的部分
+    u64 delta = bpf_ktime_get_ns() - *tsp;
+    bpf_map_delete_elem(&pid_offTs_map, &pid);
+    struct kernfs_node *knode = GET_KNODE(next);
+    TRY_SAVE_INFO(next, pid, BPF_CORE_READ(next, tgid), knode);
+    return add_time(pid, delta, ctx);
+}
+
+// 动态挂载点finish_task_switch.isra.0，此时已切换到next，调用栈即其阻塞时的调用栈
+SEC("kprobe/finish_task_switch")
+int BPF_KPROBE(do_offcpu, struct task_struct *prev)
+{
+    CHECK_ACTIVE;
+    prev_part(prev);
+    next_part(GET_CURR, ctx);
+    return 0;
+}
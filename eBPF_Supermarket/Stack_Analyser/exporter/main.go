@@ -24,8 +24,11 @@ import (
 	"bufio"
 	"bytes"
 	"context"
+	"encoding/binary"
 	"flag"
 	"fmt"
+	"io"
+	"net"
 	"os"
 	"regexp"
 	"strconv"
@@ -48,6 +51,8 @@ import (
 )
 
 var server = flag.String("server", "http://localhost:4040", "")
+var format = flag.String("format", "text", "input format, text or pprof (stack_analyzer -O pprof)")
+var listen = flag.String("listen", "", "unix socket path to receive pprof records on, stdin if empty")
 
 var (
 	logger log.Logger
@@ -61,6 +66,12 @@ func main() {
 	logger = log.NewLogfmtLogger(log.NewSyncWriter(os.Stderr))
 	// 创建画像数据发送信道
 	profiles := make(chan *pushv1.PushRequest, 128)
+	if *format == "pprof" {
+		// 数据已是pprof格式，直接转发
+		go forwardListen(profiles)
+		ingest(profiles)
+		return
+	}
 	go ingest(profiles)
 	for {
 		time.Sleep(5 * time.Second)
@@ -145,8 +156,7 @@ func ingest(profiles chan *pushv1.PushRequest) {
 	}
 	client := pushv1connect.NewPusherServiceClient(httpClient, *server)
 
-	for {
-		it := <-profiles
+	for it := range profiles {
 		res, err := client.Push(context.TODO(), connect.NewRequest(it))
 		if err != nil {
 			fmt.Println(err)
@@ -158,10 +168,84 @@ func ingest(profiles chan *pushv1.PushRequest) {
 
 }
 
+// 读取一个4字节大端长度前缀的字段
+func readField(r io.Reader) ([]byte, error) {
+	var n uint32
+	if err := binary.Read(r, binary.BigEndian, &n); err != nil {
+		return nil, err
+	}
+	buf := make([]byte, n)
+	_, err := io.ReadFull(r, buf)
+	return buf, err
+}
+
+// 转发一个输入流中的pprof记录，每条记录为采集器名称和profile数据
+func forwardProfiles(r io.Reader, profiles chan *pushv1.PushRequest) error {
+	br := bufio.NewReader(r)
+	for {
+		name, err := readField(br)
+		if err != nil {
+			return err
+		}
+		raw, err := readField(br)
+		if err != nil {
+			return err
+		}
+		req := &pushv1.PushRequest{Series: []*pushv1.RawProfileSeries{{
+			Labels: []*typesv1.LabelPair{
+				{Name: labels.MetricName, Value: string(name)},
+				{Name: "service_name", Value: "Stack_Analyzer"},
+			},
+			Samples: []*pushv1.RawSample{{RawProfile: raw}},
+		}}}
+		if *listen == "" {
+			// 标准输入由单一写者产生，阻塞等待发送即可形成背压
+			profiles <- req
+			continue
+		}
+		select {
+		case profiles <- req:
+		default:
+			_ = level.Error(logger).Log("err", "dropping profile", "collector", string(name))
+		}
+	}
+}
+
+// 从标准输入或unix套接字接收pprof记录
+func forwardListen(profiles chan *pushv1.PushRequest) {
+	if *listen == "" {
+		if err := forwardProfiles(os.Stdin, profiles); err != io.EOF {
+			_ = level.Error(logger).Log("err", err)
+		}
+		// 输入结束，发送完剩余数据后退出
+		close(profiles)
+		return
+	}
+	os.Remove(*listen)
+	l, err := net.Listen("unix", *listen)
+	if err != nil {
+		panic(err)
+	}
+	for {
+		conn, err := l.Accept()
+		if err != nil {
+			panic(err)
+		}
+		go func() {
+			defer conn.Close()
+			if err := forwardProfiles(conn, profiles); err != io.EOF {
+				_ = level.Error(logger).Log("err", err)
+			}
+		}()
+	}
+}
+
 type psid struct {
 	pid  uint32
 	usid int32
 	ksid int32
+	fid  uint32
+	cgid uint64
 }
 
 type scale struct {
@@ -195,10 +279,22 @@ func CollectProfiles(cb CollectProfilesCallback) error {
 			return err
 		}
 	}
-	// read scale
+	// read scale, the probe and io collectors add a fid column for function or fd type ids,
+	// and -G adds a cgid column after it
 	scales := make([]scale, 0)
-	if scales_str := strings.Split(line, "\t"); len(scales_str) > 3 {
-		for i, scale_str := range strings.Split(line, "\t")[3:] {
+	keys := 3
+	hasFid, hasCgid := false, false
+	heads := strings.Split(line, "\t")
+	if len(heads) > keys && heads[keys] == "fid" {
+		hasFid = true
+		keys++
+	}
+	if len(heads) > keys && heads[keys] == "cgid" {
+		hasCgid = true
+		keys++
+	}
+	if scales_str := strings.Split(line, "\t"); len(scales_str) > keys {
+		for i, scale_str := range strings.Split(line, "\t")[keys:] {
 			parts := regexp.MustCompile(`([_a-zA-Z0-9]+)/([0-9]+)([a-zA-Z]+)`).FindStringSubmatch(scale_str)
 			scales = append(scales, scale{
 				Type: parts[1],
@@ -223,7 +319,25 @@ func CollectProfiles(cb CollectProfilesCallback) error {
 			// has read traces title
 			break
 		}
-		if vals_str := strings.Split(line, "\t")[3:]; len(vals_str) == len(scales) {
+		cols := strings.Split(line, "\t")
+		if len(cols) < keys {
+			return fmt.Errorf("keys not match heads")
+		}
+		col := 3
+		if hasFid {
+			var fid uint64
+			if fid, err = strconv.ParseUint(cols[col], 10, 32); err != nil {
+				return err
+			}
+			k.fid = uint32(fid)
+			col++
+		}
+		if hasCgid {
+			if k.cgid, err = strconv.ParseUint(cols[col], 10, 64); err != nil {
+				return err
+			}
+		}
+		if vals_str := cols[keys:]; len(vals_str) == len(scales) {
 			vals := make([]uint64, len(vals_str))
 			for i, val_str := range vals_str {
 				if vals[i], err = strconv.ParseUint(val_str, 10, 64); err != nil {
@@ -254,6 +368,26 @@ func CollectProfiles(cb CollectProfilesCallback) error {
 		trace = trace[:len(trace)-1]
 		traces[k] = trace
 	}
+	// read paths of cgroups, which precede the info table when there is a cgid column
+	cgroups := make(map[uint64]string)
+	if hasCgid && strings.Contains(line, "cgroups:") {
+		// omit cgroups table head
+		if _, err = reader.ReadString('\n'); err != nil {
+			return err
+		}
+		for {
+			var cgid uint64
+			var path string
+			if line, err = reader.ReadString('\n'); err != nil {
+				return err
+			}
+			if _, err = fmt.Sscanf(line, "%d\t%s\n", &cgid, &path); err != nil {
+				// has read info title
+				break
+			}
+			cgroups[cgid] = path
+		}
+	}
 	// omit info table head
 	if line, err = reader.ReadString('\n'); err != nil {
 		return err
@@ -285,9 +419,42 @@ func CollectProfiles(cb CollectProfilesCallback) error {
 			cid:  secs[4],
 		}
 	}
+	// read names of probed functions, which follow the info table when there is a fid column
+	funcs := make(map[uint32]string)
+	for hasFid && !strings.Contains(line, "OK") {
+		if strings.Contains(line, "funcs:") {
+			// omit funcs table head
+			if _, err = reader.ReadString('\n'); err != nil {
+				break
+			}
+			for {
+				var fid uint32
+				var name string
+				if line, err = reader.ReadString('\n'); err != nil {
+					break
+				}
+				if _, err = fmt.Sscanf(line, "%d\t%s\n", &fid, &name); err != nil {
+					// has read the next title
+					break
+				}
+				funcs[fid] = name
+			}
+			continue
+		}
+		if line, err = reader.ReadString('\n'); err != nil {
+			break
+		}
+	}
 	for k, v := range counts {
 		base := []string{info[k.pid].cid, "tgid:" + fmt.Sprint(info[k.pid].tgid), "comm:" + info[k.pid].comm + ", pid:" + fmt.Sprint(info[k.pid].pid)}
+		if path, ok := cgroups[k.cgid]; ok {
+			// same as the folded output, the cgroup path is the outermost frame
+			base = append([]string{"cgroup:" + path}, base...)
+		}
 		trace := append(traces[k.usid], traces[k.ksid]...)
+		if name, ok := funcs[k.fid]; ok {
+			trace = append(trace, name)
+		}
 		group_trace := lo.Reverse(append(base, trace...))
 		for i, s := range scales {
 			target := sd.NewTarget("", k.pid, sd.DiscoveryTarget{
@@ -23,7 +23,10 @@
 #include <unistd.h>
 #include <vector>
 #include <string>
+#include <map>
+#include <algorithm>
 #include "user.h"
+#include "symbol.h"
 
 struct Scale
 {
@@ -42,9 +45,121 @@ struct CountItem
     /// @brief count对象的大小取决于val的大小
     /// @param b 要比较的对象
     /// @return 小于b则为真，否则为假
-    friend bool operator<(const CountItem a, const CountItem b);
+    friend bool operator<(const CountItem a, const CountItem b)
+    {
+        return a.v[0] < b.v[0] || (a.v[0] == b.v[0] && a.k.pid < b.k.pid);
+    }
+};
+
+/// @brief 按pid、ksid、usid、fid、cgid的顺序比较，便于将psid用作有序表的键
+inline bool operator<(const psid &a, const psid &b)
+{
+    if (a.pid != b.pid)
+        return a.pid < b.pid;
+    if (a.ksid != b.ksid)
+        return a.ksid < b.ksid;
+    if (a.usid != b.usid)
+        return a.usid < b.usid;
+    if (a.fid != b.fid)
+        return a.fid < b.fid;
+    return a.cgid < b.cgid;
+}
+
+/// @brief 唤醒关系图的一条边，记录唤醒者在某个调用栈上结束被唤醒者阻塞的次数和阻塞总时长
+struct WakeEdge
+{
+    psid waker; // 没有唤醒者时全为0
+    psid wakee;
+    uint64_t count;
+    uint64_t time;
 };
 
+/// @brief 从计数列表中选出值最大的top项并按升序排列
+/// @param D 计数列表，完成后只保留选出的项
+/// @param top 保留的项数，为0时对全部项排序
+/// @note 先用nth_element做O(n)的划分，只对留下的top项排序
+inline void selectTopCounts(std::vector<CountItem> &D, uint32_t top)
+{
+    if (top && D.size() > top)
+    {
+        auto begin = D.end() - top;
+        std::nth_element(D.begin(), begin, D.end());
+        D.erase(D.begin(), begin);
+    }
+    std::sort(D.begin(), D.end());
+}
+
+/// @brief 在每个cgroup内分别选出值最大的top项，结果按cgroup id分组，组内按升序排列
+/// @param D 计数列表，完成后只保留选出的项
+/// @param top 每个cgroup保留的项数，为0时对全部项排序
+inline void selectTopCountsPerCgroup(std::vector<CountItem> &D, uint32_t top)
+{
+    std::sort(D.begin(), D.end(), [](const CountItem &a, const CountItem &b)
+              { return a.k.cgid != b.k.cgid ? a.k.cgid < b.k.cgid : a < b; });
+    if (!top)
+        return;
+    auto out = D.begin();
+    for (auto i = D.begin(); i != D.end();)
+    {
+        auto j = i;
+        while (j != D.end() && j->k.cgid == i->k.cgid)
+            j++;
+        // 每组保留末尾的top项，向前紧缩
+        out = std::move(j - i > top ? j - top : i, j, out);
+        i = j;
+    }
+    D.erase(out, D.end());
+}
+
+/// @brief 一个输出周期内采集器读取并解析好的数据，与输出格式无关
+struct Report
+{
+    std::string time;
+    const char *name;
+    const Scale *scales;
+    int scale_num;
+    std::vector<CountItem> counts;             // 按值升序排列，其中的值在下次读取前有效
+    std::map<int32_t, const Frames *> traces; // 栈id到调用栈
+    std::map<uint32_t, task_info> infos;       // pid到线程信息
+    std::map<uint32_t, std::string> cgroups;   // tgid到容器id
+    std::vector<WakeEdge> wakes;               // 按阻塞总时长升序排列的唤醒关系，仅流式采集时有
+    uint32_t rate = 0;                         // 本周期结束时的采样频率
+    uint64_t sample_seen = 0;                  // 经过频率限制的事件数
+    uint64_t sample_taken = 0;                 // 其中被采样的事件数，计数乘以seen/taken即还原的值
+    uint64_t stack_lookups = 0;                // 按哈希去重时累计采集的调用栈数
+    uint64_t stack_collisions = 0;             // 其中首选的栈id被其他调用栈占用的次数
+    std::map<uint32_t, std::string> funcs;     // 函数id到函数名，仅同时探测多个函数时有
+    // 函数id到延迟的log2直方图，第i个桶统计延迟在[2^i, 2^(i+1))纳秒内的次数
+    std::map<uint32_t, std::vector<uint64_t>> hists;
+    std::map<uint64_t, std::string> cgroup_paths; // cgroup id到路径，仅计数的键区分cgroup时有
+};
+
+// 可在采集器间共用的公共映射的数量
+#define SHARED_MAP_NUM 4
+
+/// @brief 多个采集器共用的栈表、线程信息表和容器表，由第一个加载的采集器创建，其余采集器复用
+/// @note 共用栈表时各采集器的栈id属于同一空间，记忆表也随之共用，只能在一个线程中解析
+struct SharedMaps
+{
+    static const char *const names[SHARED_MAP_NUM];
+    int fds[SHARED_MAP_NUM] = {-1, -1, -1, -1};
+    TraceMemo memo;
+
+    ~SharedMaps()
+    {
+        for (auto fd : fds)
+            if (fd >= 0)
+                close(fd);
+    }
+};
+
+// 自适应采样时频率的调整范围为初始频率的1/RATE_RANGE到RATE_RANGE倍
+#define RATE_RANGE 16
+// 计数表填充率超过该值时降低采样频率
+#define RATE_FILL_HIGH 0.8
+// 计数表填充率超过该值时不再提高采样频率
+#define RATE_FILL_LOW 0.5
+
 class StackCollector
 {
 protected:
@@ -52,33 +167,149 @@ protected:
     struct bpf_object *obj = NULL;
 
     // 默认显示计数的变化情况，即每次输出数据后清除计数
+    // 此时计数表为双缓冲，eBPF程序写入一张表的同时用户态读取另一张表，
+    // 读取后的表空闲一个周期再清空，其间迟到的写入计入下一周期
     bool showDelta = true;
     int scale_num;
+    // 指向eBPF程序中选择当前计数表的__count_idx
+    uint32_t *count_idx = NULL;
+    // eBPF程序对计数只做累加时可使用每CPU计数表，由采集器在构造时声明
+    bool percpu_capable = false;
+    // 指向eBPF程序中当前的采样频率__freq
+    uint32_t *cur_freq = NULL;
+    uint32_t init_freq = 0;
+    // 上个周期计数表的填充率
+    double fill_ratio = 0;
+    // 上次读取时频率限制的累计统计
+    sample_stat last_stat = {0, 0};
+    // 指向eBPF程序中按哈希去重调用栈的统计
+    uint64_t *stack_lookups = NULL;
+    uint64_t *stack_collisions = NULL;
+
+    // 读取计数表时复用的缓冲区，避免每次输出都重新分配
+    std::vector<psid> key_buf;
+    std::vector<char> val_buf;
+    std::vector<uint64_t> val_arena;
+    // 双缓冲时退下的表上次读出的各项的值，按键排序
+    std::vector<psid> snap_keys;
+    std::vector<uint64_t> snap_vals;
+    // 翻转前从空闲的表中取出的迟到的写入，并入本周期
+    std::vector<psid> late_keys;
+    std::vector<uint64_t> late_vals;
+
+    // 本采集器栈表的栈id到已解析调用栈的记忆，跨输出周期保留
+    TraceMemo memo;
+
+    // 流式采集时由drain填入的唤醒关系
+    std::vector<WakeEdge> wake_edges;
+
+    /// @brief 共用映射时，让尚未加载的eBPF对象复用已创建的公共映射
+    /// @return 成功为0，否则为负的错误码
+    int reuseSharedMaps(struct bpf_object *o);
+
+    /// @brief 记录第一个加载的采集器创建的公共映射
+    void recordSharedMaps(void);
 
 public:
     Scale *scales;
 
-    uint32_t top = 10;
+    uint32_t top = 10; // 输出的计数项数，0表示输出全部
     uint32_t freq = 49;
-    uint64_t cgroup = 0;
+    // 只跟踪其中的cgroup，cgroup id到路径，加载后由setCgroups修改
+    std::map<uint64_t, std::string> cgroups;
+    bool filter_cgroup = false; // 是否只跟踪cgroups中的cgroup，为真时集合为空则不采集
+    bool per_cgroup = false;    // 是否在计数的键中区分cgroup，并在每个cgroup内分别选出top项
     uint32_t tgid = 0;
     int err = 0; // 用于保存错误代码
 
     bool ustack = false; // 是否跟踪用户栈
     bool kstack = false; // 是否跟踪内核栈
+    // 是否使用每CPU计数表，消除多核间的计数竞争，内存占用随CPU数成倍增加
+    bool percpu_count = false;
+    // 调用栈的最大深度，不超过MAX_STACK_DEPTH，为0时使用深度为MAX_STACKS的栈表
+    uint32_t stack_depth = 0;
+    // 与其他采集器共用的公共映射，为NULL时使用自己的映射
+    SharedMaps *shared = NULL;
+
+private:
+    /// @brief 读取一张计数表到key_buf和val_buf
+    /// @param del 是否在读取的同时清空
+    /// @return 成功为真，否则为假
+    bool readMap(struct bpf_map *map, bool del, uint32_t &count, size_t val_size);
+
+    /// @brief 解析一项的值并累加各CPU上的值
+    void sumValues(char *data, size_t cpu_val_size, int nr_cpus, uint64_t *v);
+
+    /// @brief 读取计数表到key_buf和val_buf，双缓冲时先翻转，并把上次退下的表中迟到的写入取到late_keys和late_vals
+    /// @param count 读到的项数
+    /// @param cpu_val_size 每个CPU上值的大小
+    /// @param nr_cpus 每项的值由几个CPU的值组成
+    /// @return 成功为真，否则为假
+    bool readCountMap(uint32_t &count, size_t &cpu_val_size, int &nr_cpus);
 
 protected:
-    std::vector<CountItem> *sortedCountList(void);
+    /// @brief 读取计数表并选出值最大的top项
+    /// @param D 存放结果的列表，其中的值指向val_arena，下次调用前有效
+    /// @return 成功为真，否则为假
+    bool sortedCountList(std::vector<CountItem> &D);
 
     /// @brief 将缓冲区的数据解析为特定值
-    /// @param  无
-    /// @return 解析出的值
-    virtual uint64_t *count_values(void *data) = 0;
+    /// @param data 计数表中的原始值
+    /// @param vals 存放解析结果的数组，长度为scale_num
+    virtual void count_values(void *data, uint64_t *vals) = 0;
+
+    /// @brief 流式采集的采集器在此消费事件，将用户态聚合的计数填入key_buf和val_buf，
+    ///        唤醒关系填入wake_edges
+    /// @return 每项值的大小，为0表示没有流式采集，计数从计数表读取
+    virtual size_t drain(void) { return 0; }
+
+    /// @brief 采集器在读取计数后向报告补充特有的数据
+    virtual void annotate(Report &R) {}
+
+    /// @brief 在用户态回溯用户栈的采集器在此给出其本地栈表中的调用栈
+    /// @param ips 存放由栈顶到栈底排列的地址，长度至少为MAX_STACK_DEPTH
+    /// @return 栈深度，栈id不在本地栈表中时为-1，此时从eBPF栈表读取
+    virtual int localTrace(int32_t sid, uint64_t *ips) { return -1; }
 
 public:
     StackCollector();
+
+    /// @brief 读取计数表并解析调用栈和进程信息
+    /// @param R 存放结果的报告
+    /// @return 成功为真，否则为假
+    bool collect(Report &R);
+
+    /// @brief 读取计数表和统计信息，不解析调用栈
+    /// @param R 存放结果的报告
+    /// @return 成功为真，否则为假
+    bool gather(Report &R);
+
+    /// @brief 解析报告中计数项和唤醒关系的调用栈和进程信息
+    /// @note 共用映射时使用共用的记忆表，各采集器需在同一线程中依次调用
+    void symbolize(Report &R);
+
+    /// @brief 以彩色文本形式输出一个周期的数据
     operator std::string();
 
+    /// @brief 统计各eBPF程序的运行次数和平均耗时
+    /// @note 需要先通过bpf_enable_stats开启内核的运行时统计
+    std::string progStats(void);
+
+    /// @brief 各eBPF程序累计的运行时间，单位为纳秒
+    /// @note 未开启内核的运行时统计时为0
+    uint64_t progRunTime(void);
+
+    /// @brief 在运行时设置采样频率
+    /// @param f 新的频率，不为0
+    /// @note 默认修改eBPF程序中频率限制使用的__freq，由perf事件采样的采集器需要重写
+    virtual void setRate(uint32_t f);
+
+    /// @brief 根据开销和计数表的填充率调整采样频率
+    /// @param overhead 上个周期的开销，为占单个CPU时间的比例
+    /// @param budget 开销的预算
+    /// @note freq为0即未限制频率时不调整
+    void adaptRate(double overhead, double budget);
+
     virtual int ready(void) = 0;
     virtual void finish(void) = 0;
 
@@ -88,26 +319,72 @@ public:
 
     virtual const char *getName(void) = 0;
 
+    /// @brief 输出的计数是否为每个周期的变化量，否则为累计值
+    bool isDelta(void) const { return showDelta; };
+
+    /// @brief 设置要跟踪的cgroup，增删eBPF程序中的cgroup集合
+    /// @param ids cgroup id到路径
+    /// @return 成功为0，否则为负的错误码
+    /// @note 须在没有读取计数时调用，即不与collect、gather并发
+    int setCgroups(const std::map<uint64_t, std::string> &ids);
+
 // 声明eBPF骨架
 #define DECL_SKEL(func) struct func##_bpf *skel = NULL;
 
 /// @brief 加载、初始化参数并打开指定类型的ebpf程序
 /// @param ... 一些ebpf程序全局变量初始化语句
-/// @note 失败会使上层函数返回-1
-#define EBPF_LOAD_OPEN_INIT(...)                           \
-    {                                                      \
-        skel = skel->open(NULL);                           \
-        CHECK_ERR_RN1(!skel, "Fail to open BPF skeleton"); \
-        __VA_ARGS__;                                       \
-        skel->rodata->trace_user = ustack;                 \
-        skel->rodata->trace_kernel = kstack;               \
-        skel->rodata->self_tgid = self_tgid;               \
-        skel->rodata->target_tgid = tgid;                  \
-        skel->rodata->target_cgroupid = cgroup;            \
-        skel->rodata->freq = freq;                         \
-        err = skel->load(skel);                            \
-        CHECK_ERR_RN1(err, "Fail to load BPF skeleton");   \
-        obj = skel->obj;                                   \
+/// @note 失败会使上层函数返回-1；累计计数的采集器不翻转计数表，备用表只保留一项；
+///       设定栈深度时按哈希去重调用栈，不使用的栈表只保留一项；共用映射时复用已创建的公共映射
+#define EBPF_LOAD_OPEN_INIT(...)                                    \
+    {                                                               \
+        skel = skel->open(NULL);                                    \
+        CHECK_ERR_RN1(!skel, "Fail to open BPF skeleton");          \
+        __VA_ARGS__;                                                \
+        skel->rodata->trace_user = ustack;                          \
+        skel->rodata->trace_kernel = kstack;                        \
+        skel->rodata->self_tgid = self_tgid;                        \
+        skel->rodata->target_tgid = tgid;                           \
+        skel->rodata->filter_cgroup = filter_cgroup;                \
+        skel->rodata->cgroup_key = per_cgroup;                      \
+        if (!filter_cgroup)                                         \
+            bpf_map__set_max_entries(skel->maps.cgroup_set_map, 1); \
+        skel->rodata->freq = freq;                                  \
+        skel->bss->__freq = freq;                                   \
+        init_freq = freq;                                           \
+        if (!showDelta)                                             \
+            bpf_map__set_max_entries(                               \
+                skel->maps.psid_count_map_b, 1);                    \
+        percpu_count = percpu_count && percpu_capable;              \
+        if (percpu_count)                                           \
+        {                                                           \
+            bpf_map__set_type(skel->maps.psid_count_map,            \
+                              BPF_MAP_TYPE_PERCPU_HASH);            \
+            bpf_map__set_type(skel->maps.psid_count_map_b,          \
+                              BPF_MAP_TYPE_PERCPU_HASH);            \
+        }                                                           \
+        if (stack_depth > MAX_STACK_DEPTH)                          \
+            stack_depth = MAX_STACK_DEPTH;                          \
+        skel->rodata->stack_depth = stack_depth;                    \
+        if (stack_depth)                                            \
+        {                                                           \
+            bpf_map__set_value_size(skel->maps.sid_stack_map,       \
+                                    STACK_TRACE_SIZE(stack_depth)); \
+            bpf_map__set_max_entries(skel->maps.sid_trace_map, 1);  \
+        }                                                           \
+        else                                                        \
+            bpf_map__set_max_entries(skel->maps.sid_stack_map, 1);  \
+        err = reuseSharedMaps(skel->obj);                           \
+        CHECK_ERR_RN1(err, "Fail to reuse shared maps");            \
+        err = skel->load(skel);                                     \
+        CHECK_ERR_RN1(err, "Fail to load BPF skeleton");            \
+        obj = skel->obj;                                            \
+        recordSharedMaps();                                         \
+        err = setCgroups(std::map<uint64_t, std::string>(cgroups)); \
+        CHECK_ERR_RN1(err, "Fail to set cgroups");                  \
+        count_idx = &skel->bss->__count_idx;                        \
+        cur_freq = &skel->bss->__freq;                              \
+        stack_lookups = &skel->bss->__stack_lookups;                \
+        stack_collisions = &skel->bss->__stack_collisions;          \
     }
 
 #define ATTACH_PROTO                                         \
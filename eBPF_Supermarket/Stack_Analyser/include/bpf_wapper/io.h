@@ -20,12 +20,40 @@
 #define _SA_IO_H__
 
 #include <asm/types.h>
+#include "common.h"
 typedef struct
 {
     __u64 size;
     __u64 count;
+    __u64 lat; // 在io系统调用中花费的总时间，单位为纳秒
 } io_tuple;
 
+/// @brief io操作的fd类型，加1后作为psid的fid，从而按类型区分同一调用栈上的io
+enum io_fd_type
+{
+    IO_FD_OTHER,
+    IO_FD_FILE,
+    IO_FD_SOCK,
+    IO_FD_PIPE,
+    IO_FD_EVENTFD,
+    IO_FD_TYPES,
+};
+
+#define IO_HIST_SLOTS 40 // 延迟直方图的桶数，最后一个桶包含更长的延迟
+
+/// @brief 一种fd类型的io延迟直方图，第i个桶统计延迟在[2^i, 2^(i+1))纳秒内的次数
+typedef struct
+{
+    __u64 slots[IO_HIST_SLOTS];
+} io_hist;
+
+/// @brief 一次进行中的io，在进入系统调用或提交io_uring请求时记录开始时间和计数的键
+typedef struct
+{
+    __u64 ts;
+    psid id;
+} io_start;
+
 #ifdef __cplusplus
 #include "io.skel.h"
 #include "bpf_wapper/eBPFStackCollector.h"
@@ -34,9 +62,12 @@ class IOStackCollector : public StackCollector
 {
 private:
     DECL_SKEL(io);
+    // 上次读取时各fd类型的累计直方图
+    io_hist last_hists[IO_FD_TYPES] = {};
 
 protected:
-    virtual uint64_t *count_values(void *);
+    virtual void count_values(void *data, uint64_t *vals);
+    virtual void annotate(Report &R);
 
 public:
     IOStackCollector();
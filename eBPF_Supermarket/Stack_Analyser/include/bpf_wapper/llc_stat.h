@@ -47,7 +47,7 @@ private:
     struct bpf_link **rlinks = NULL;
 
 protected:
-    virtual uint64_t *count_values(void *);
+    virtual void count_values(void *data, uint64_t *vals);
 
 public:
     LlcStatStackCollector();
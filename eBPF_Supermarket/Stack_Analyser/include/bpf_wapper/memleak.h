@@ -36,6 +36,7 @@ typedef struct
     __u64 size;
     __s32 usid;
     __s32 ksid;
+    __u64 cgid; // 分配时计数的键中的cgroup id，释放时用于找回计数
 } mem_info;
 
 union combined_alloc_info
@@ -61,9 +62,11 @@ public:
     char *object = (char *)"libc.so.6";
     bool percpu = false;
     bool wa_missing_free = false;
+    // 平均每多少字节采样一次分配，为0时记录所有分配
+    uint64_t sample_bytes = 0;
 
 protected:
-    virtual uint64_t *count_values(void *d);
+    virtual void count_values(void *d, uint64_t *vals);
     int attach_uprobes(struct memleak_bpf *skel);
 
 public:
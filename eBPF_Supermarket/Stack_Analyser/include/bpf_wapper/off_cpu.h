@@ -22,13 +22,40 @@
 #include "bpf_wapper/eBPFStackCollector.h"
 #include "off_cpu.skel.h"
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// 流式采集时等待环形缓冲区数据的最长时间
+#define OFFCPU_STREAM_POLL_MS 100
+
 class OffCPUStackCollector : public StackCollector
 {
 private:
     struct off_cpu_bpf *skel = __null;
 
+    // 流式采集的环形缓冲区及其消费线程
+    struct ring_buffer *rb = NULL;
+    std::thread consumer;
+    std::atomic<bool> consuming{false};
+    // 消费线程与drain都会取出环形缓冲区中的事件，libbpf的消费接口不可并发调用
+    std::mutex rb_mutex;
+
+    // 消费线程聚合的阻塞时长和唤醒关系，由drain取走
+    std::mutex acc_mutex;
+    std::map<psid, uint64_t> acc_counts;
+    std::map<std::pair<psid, psid>, std::pair<uint64_t, uint64_t>> acc_wakes;
+    uint64_t reported_lost = 0;
+
+    static int handle_event(void *ctx, void *data, size_t size);
+
 protected:
-    virtual uint64_t *count_values(void *);
+    virtual void count_values(void *data, uint64_t *vals);
+    virtual size_t drain(void);
+
+public:
+    // 是否逐次提交纳秒级的阻塞事件并记录唤醒者，否则按毫秒在eBPF程序中累计
+    bool stream = false;
 
 public:
     OffCPUStackCollector();
@@ -21,6 +21,15 @@
 
 #include "bpf_wapper/eBPFStackCollector.h"
 #include "on_cpu.skel.h"
+#include "unwind.h"
+#include "worker.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// 在用户态回溯时等待环形缓冲区数据的最长时间
+#define ONCPU_UNWIND_POLL_MS 100
 
 #ifdef __cplusplus
 class OnCPUStackCollector : public StackCollector
@@ -32,11 +41,60 @@ private:
 	int num_cpus = 0;
 	struct bpf_link **links = NULL;
 
+	// 在用户态回溯用户栈时，采样的环形缓冲区及其消费线程
+	struct ring_buffer *rb = NULL;
+	std::thread consumer;
+	std::atomic<bool> consuming{false};
+	// 消费线程与drain都会取出环形缓冲区中的采样，libbpf的消费接口不可并发调用
+	std::mutex rb_mutex;
+	uint64_t reported_lost = 0;
+
+	// 一次取出的采样，栈的内容依次存放在arena中，由回溯线程池并行回溯
+	struct Sample
+	{
+		psid id;
+		uint32_t tgid, size;
+		uint64_t ip, sp, fp, lr;
+		size_t off;
+	};
+	std::vector<Sample> batch;
+	std::vector<uint8_t> arena;
+	WorkerPool *unwind_pool = NULL;
+	unsigned unwind_threads = 1;
+	DwarfUnwinder unwinder;
+
+	// 回溯得到的用户栈，栈id与eBPF程序中按哈希去重的栈id的计算方式相同；
+	// 记下用到该栈的进程，全部退出后才删除，仍存活的进程记忆的栈id不会被改作他用
+	struct UStack
+	{
+		std::vector<uint64_t> ips;
+		std::vector<uint32_t> tgids;
+	};
+	std::mutex ustack_mutex;
+	std::unordered_map<int32_t, UStack> ustacks;
+
+	// 回溯后聚合的计数，由drain取走
+	std::mutex acc_mutex;
+	std::map<psid, uint64_t> acc_counts;
+
+	static int handle_event(void *ctx, void *data, size_t size);
+	void unwindBatch(void);
+	void consumeSamples(void);
+	int32_t internStack(uint32_t tgid, const uint64_t *ips, int nr);
+	void pruneStacks(void);
+
 protected:
-	virtual uint64_t *count_values(void *);
+	virtual void count_values(void *data, uint64_t *vals);
+	virtual size_t drain(void);
+	virtual int localTrace(int32_t sid, uint64_t *ips);
+
+public:
+	// 每次采样复制的用户栈字节数，不为0时按调用帧信息在用户态回溯用户栈，用于不保留帧指针的程序
+	uint32_t ustack_bytes = 0;
 
 public:
 	void setScale(uint64_t freq);
+	virtual void setRate(uint32_t f);
 	OnCPUStackCollector();
     virtual int ready(void);
     virtual void finish(void);
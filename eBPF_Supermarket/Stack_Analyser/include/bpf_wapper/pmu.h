@@ -0,0 +1,76 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// pmu ebpf程序的包装类，声明接口和一些自定义方法
+
+#ifndef _SA_PMU_H__
+#define _SA_PMU_H__
+
+#include "bpf_wapper/eBPFStackCollector.h"
+#include "pmu.skel.h"
+
+/// @brief 一个PMU事件，由事件描述解析而来
+struct PmuEvent
+{
+    std::string name;
+    uint32_t type;
+    uint64_t config;
+};
+
+/// @brief 解析事件描述，支持硬件事件名（如instructions、branch-misses）、
+///        硬件缓存事件名（如dTLB-load-misses、L1-dcache-loads）和原始事件（r加十六进制编码，如r01a2）
+/// @return 成功为0，否则为-1
+int parse_pmu_event(const std::string &spec, PmuEvent &e);
+
+/// @brief 以perf事件组在每个CPU上采集多个PMU事件，按组长事件采样，组内各事件的增量归属到被采样的调用栈，
+///        同组事件同时被调度，比例是一致的；并给出每千条指令缺失数（MPKI）和IPC等派生比例
+class PmuStackCollector : public StackCollector
+{
+private:
+    DECL_SKEL(pmu);
+    std::vector<PmuEvent> events;
+    int *pefds = NULL; // 第i个事件在第cpu个CPU上的fd为pefds[i * num_cpus + cpu]
+    int num_cpus = 0;
+    struct bpf_link **links = NULL;
+    // 派生比例，由分子和分母在events中的下标及放大倍数给出，放大后的比例为1000倍的MPKI或IPC；
+    // 比例排在各事件数之后，只由每项的事件总数得出，不可跨项累加
+    struct Ratio
+    {
+        int num, den;
+        uint64_t scale;
+    };
+    std::vector<Ratio> ratios;
+
+protected:
+    virtual void count_values(void *data, uint64_t *vals);
+    virtual void annotate(Report &R);
+
+public:
+    // 逗号分隔的事件描述，第一个为采样的组长
+    std::string spec = "cycles,instructions";
+    // 组长事件的采样周期，为0时按采样频率
+    uint64_t period = 0;
+
+public:
+    PmuStackCollector();
+    virtual void setRate(uint32_t f);
+    virtual int ready(void);
+    virtual void finish(void);
+    virtual void activate(bool tf);
+    virtual const char *getName(void);
+};
+
+#endif
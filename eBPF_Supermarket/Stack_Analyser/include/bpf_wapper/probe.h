@@ -26,6 +26,14 @@ typedef struct
     __u64 lat;
     __u64 count;
 } time_tuple;
+
+#define PROBE_HIST_SLOTS 40 // 延迟直方图的桶数，最后一个桶包含更长的延迟
+
+/// @brief 一个被探测函数的延迟直方图，第i个桶统计延迟在[2^i, 2^(i+1))纳秒内的次数
+typedef struct
+{
+    __u64 slots[PROBE_HIST_SLOTS];
+} lat_hist;
 // ========== C code end ==========
 
 #ifdef __cplusplus
@@ -37,11 +45,20 @@ class ProbeStackCollector : public StackCollector
 {
 private:
     DECL_SKEL(probe);
+    // 同时探测多个函数时的函数名，下标加1为函数id
+    std::vector<std::string> funcs;
+    // 上次读取时各函数的累计直方图
+    std::vector<lat_hist> last_hists;
+
+    /// @brief 以kprobe.multi或uprobe.multi一次挂载所有匹配的函数，函数id作为cookie
+    int attach_multi(const std::string &lib);
+
 public:
     std::string probe;
 
 protected:
-    virtual uint64_t *count_values(void *);
+    virtual void count_values(void *data, uint64_t *vals);
+    virtual void annotate(Report &R);
 
 public:
     void setScale(std::string probe);
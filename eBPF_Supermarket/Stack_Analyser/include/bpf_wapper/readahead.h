@@ -20,12 +20,25 @@
 #define _SA_READAHEAD_H__
 
 #include <asm/types.h>
+#include "common.h"
 typedef struct
 {
     __u32 expect;
     __u32 truth;
 } ra_tuple;
 
+// 单个folio中按位记录访问情况的最大页数，更大的folio只记录前面的页
+#define RA_FOLIO_PAGES 512
+
+/// @brief 预读分配的一个folio，记录其归属的调用栈、页数及已访问的页
+typedef struct
+{
+    psid id;
+    __u32 nr;
+    __u32 used;
+    __u64 seen[RA_FOLIO_PAGES / 64];
+} ra_folio;
+
 #ifdef __cplusplus
 #include "readahead.skel.h"
 #include "bpf_wapper/eBPFStackCollector.h"
@@ -36,7 +49,13 @@ private:
     DECL_SKEL(readahead);
 
 protected:
-    virtual uint64_t *count_values(void *data);
+    virtual void count_values(void *data, uint64_t *vals);
+
+public:
+    // 是否按folio记录预读的页，默认在内核支持时开启，否则按4K页记录
+    bool folio = true;
+    // 按folio记录时，是否能从读路径得到实际访问的页，否则已使用的页数为上界
+    bool exact = true;
 
 public:
     ReadaheadStackCollector();
@@ -34,7 +34,7 @@ private:
     DECL_SKEL(template);
 
 protected:
-    virtual uint64_t *count_values(void *);
+    virtual void count_values(void *data, uint64_t *vals);
 
 public:
     TemplateClass();
@@ -0,0 +1,51 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// wall clock ebpf程序的包装类，声明接口和一些自定义方法
+
+#ifndef _SA_WALL_CLOCK_H__
+#define _SA_WALL_CLOCK_H__
+
+#include "bpf_wapper/eBPFStackCollector.h"
+#include "wall_clock.skel.h"
+
+/// @brief 以纳秒统计线程在每个调用栈上经过的时间，on-cpu采样按采样周期换算为时间，
+///        与off-cpu时间计入同一计数表，使两者在同一张火焰图中宽度可比
+class WallClockStackCollector : public StackCollector
+{
+private:
+    DECL_SKEL(wall_clock);
+    int *pefds = NULL;
+    int num_cpus = 0;
+    struct bpf_link **links = NULL;
+
+protected:
+    virtual void count_values(void *data, uint64_t *vals);
+
+public:
+    // 只跟踪其中的线程，为空时跟踪全部线程
+    std::vector<uint32_t> tids;
+
+public:
+    WallClockStackCollector();
+    virtual void setRate(uint32_t f);
+    virtual int ready(void);
+    virtual void finish(void);
+    virtual void activate(bool tf);
+    virtual const char *getName(void);
+};
+
+#endif
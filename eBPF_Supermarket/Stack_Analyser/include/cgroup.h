@@ -6,4 +6,6 @@ struct cgid_file_handle
     int handle_type;
     uint64_t cgid;
 };
+/// @brief 取得cgroup v2目录的cgroup id
+/// @return 失败时打印原因并返回0
 uint64_t get_cgroupid(const char *pathname);
\ No newline at end of file
@@ -23,16 +23,75 @@
 
 #define COMM_LEN 16        // 进程名最大长度
 #define MAX_STACKS 32      // 栈最大深度
+#define MAX_STACK_DEPTH 127 // 按哈希去重时栈的最大深度，为bpf_get_stack的上限
 #define MAX_ENTRIES 102400 // map容量
 #define CONTAINER_ID_LEN (128)
+#define MAX_CGROUPS 4096 // 可同时跟踪的cgroup数
 
 /// @brief 栈计数的键，可以唯一标识一个用户内核栈
 typedef struct
 {
     __u32 pid;
     __s32 ksid, usid;
+    __u32 fid; // 被探测函数的id或io的fd类型，只有同时探测多个函数或采集io时不为0
+    __u64 cgid; // 所属cgroup的id，只有按cgroup区分时不为0
 } psid;
 
+/// @brief 频率限制的统计，seen为经过频率限制的事件数，taken为其中被采样的事件数
+typedef struct
+{
+    __u64 seen;
+    __u64 taken;
+} sample_stat;
+
+/// @brief off_cpu流式采集的事件，记录一次阻塞的时长及结束阻塞的唤醒者
+/// @note 没有唤醒者（如被抢占）时waker全为0
+typedef struct
+{
+    psid wakee;  // 被唤醒者及其阻塞时的调用栈
+    psid waker;  // 唤醒者及其发起唤醒时的调用栈
+    __u64 delta; // 阻塞时长，单位为纳秒
+} offcpu_event;
+
+#define OFFCPU_RINGBUF_SIZE (1 << 24) // 流式采集的环形缓冲区大小
+
+#define USTACK_MAX_BYTES 16384 // 在用户态回溯时每次采样复制的用户栈的最大长度
+
+/// @brief on_cpu在用户态回溯时提交的采样，包含采样时的用户态寄存器和从栈指针开始复制的一段用户栈
+/// @note 提交时只包含stack的前size字节
+typedef struct
+{
+    psid id;              // 线程及其内核栈，用户栈id由用户态回溯后填入
+    __u32 tgid;
+    __u32 size;           // stack中有效的字节数
+    __u64 ip, sp, fp, lr; // lr只在arm64上有效
+    __u8 stack[USTACK_MAX_BYTES];
+} ustack_sample;
+
+#define USTACK_RINGBUF_SIZE (1 << 25) // 在用户态回溯时提交采样的环形缓冲区大小
+
+#define MAX_TID_FILTER 1024 // wall_clock最多跟踪的线程数
+
+#define MAX_PMU_EVENTS 8 // pmu同一组中最多的事件数
+
+/// @brief pmu在一个调用栈上归属的各事件计数，第0个为采样的组长事件
+typedef struct
+{
+    __u64 vals[MAX_PMU_EVENTS];
+} pmu_count;
+
+/// @brief 按哈希去重的调用栈，ips中只有前nr项有效
+/// @note 栈表的值只保存到设定深度为止，大小为STACK_TRACE_SIZE(depth)
+typedef struct
+{
+    __u64 hash;
+    __u32 nr;
+    __u32 pad;
+    __u64 ips[MAX_STACK_DEPTH];
+} stack_trace;
+
+#define STACK_TRACE_SIZE(depth) (2 * sizeof(__u64) + (depth) * sizeof(__u64))
+
 typedef struct
 {
     __u32 pid;
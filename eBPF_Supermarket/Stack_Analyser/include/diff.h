@@ -0,0 +1,81 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 差分剖析，以基线为参照输出各调用栈按总量归一化后的变化
+
+#ifndef _SA_DIFF_H__
+#define _SA_DIFF_H__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+// 判定调用栈的占比变化显著的z值下限，约对应双侧p < 0.003
+#define DIFF_MIN_Z 3.0
+// 汇总中列出的显著变化的调用栈数
+#define DIFF_SUMMARY_NUM 5
+
+/// @brief 以基线为参照的差分剖析，基线来自折叠栈文件或运行最初的若干周期
+/// @note 调用栈以折叠栈中除值以外的部分标识，第一层栈帧为采集器名，各采集器分别归一化；
+///       显著性检验把值视为样本数，对采样计数的采集器有效
+class DiffProfile
+{
+private:
+    /// @brief 一个采集器的聚合数据
+    struct Profile
+    {
+        std::map<std::string, uint64_t> stacks;
+        uint64_t total = 0;
+
+        void clear(void)
+        {
+            stacks.clear();
+            total = 0;
+        }
+
+        /// @brief 累加一行折叠栈
+        /// @return 格式正确为真，否则为假
+        bool add(const std::string &line);
+    };
+
+    std::map<std::string, Profile> base; // 采集器名到基线
+    std::map<std::string, Profile> cur;  // 采集器名到本周期的数据
+    uint32_t remaining = 0;              // 还需计入基线的周期数
+
+    /// @brief 输出一个采集器的差分折叠栈，并向标准错误输出显著变化的调用栈和各级调用路径的汇总
+    std::string render(const std::string &name);
+
+public:
+    /// @brief 从折叠栈文件读入基线，同一调用栈的值累加，可读取-O folded的输出
+    /// @return 成功为0，否则为-1
+    int loadBaseline(const char *path);
+
+    /// @brief 以运行最初的n个周期作为基线
+    void baselineIntervals(uint32_t n) { remaining = n; };
+
+    /// @brief 加入一个采集器一个周期的折叠栈，基线未就绪时计入基线
+    /// @param name 采集器名
+    /// @param folded 该周期的折叠栈
+    /// @param delta 数据是否为周期内的变化量，是则在基线中累加，否则为累计值，替换此前的数据
+    /// @return 基线就绪时为差分折叠栈，每行为"调用栈 基线值 当前值"，基线值按总量缩放到当前，
+    ///         变化不显著的调用栈两值相同；基线未就绪时为空
+    std::string update(const std::string &name, const std::string &folded, bool delta);
+
+    /// @brief 一个输出周期结束，更新基线的剩余周期数
+    void endInterval(void);
+};
+
+#endif
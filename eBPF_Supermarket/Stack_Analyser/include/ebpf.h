@@ -35,6 +35,55 @@
         __uint(max_entries, MAX_ENTRIES);               \
     } name SEC(".maps")
 
+/// @brief 创建一个按哈希去重的调用栈表
+/// @param name 新栈表的名字
+/// @note 值的大小在打开后按设定的栈深度调整，故不声明值的类型
+#define BPF_HASHED_STACK(name)                      \
+    struct                                          \
+    {                                               \
+        __uint(type, BPF_MAP_TYPE_HASH);            \
+        __uint(key_size, sizeof(__s32));            \
+        __uint(value_size, sizeof(stack_trace));    \
+        __uint(max_entries, MAX_ENTRIES);           \
+    } name SEC(".maps")
+
+/// @brief 创建一个每CPU的单项数组，用作采集调用栈的暂存区
+/// @param name 新数组的名字
+#define BPF_STACK_SCRATCH(name)                      \
+    struct                                           \
+    {                                                \
+        __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);     \
+        __uint(max_entries, 1);                      \
+        __type(key, __u32);                          \
+        __type(value, stack_trace);                  \
+    } name SEC(".maps")
+
+/// @brief 创建一个指定名字和值类型的每CPU数组
+/// @param name 新数组的名字
+/// @param _vt 值的类型
+/// @param _cap 数组的长度
+#define BPF_PERCPU_ARRAY(name, _vt, _cap)        \
+    struct                                       \
+    {                                            \
+        __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY); \
+        __type(key, __u32);                      \
+        __type(value, _vt);                      \
+        __uint(max_entries, _cap);               \
+    } name SEC(".maps")
+
+/// @brief 创建一个指定名字和值类型的数组
+/// @param name 新数组的名字
+/// @param _vt 值的类型
+/// @param _cap 数组的长度
+#define BPF_ARRAY(name, _vt, _cap)        \
+    struct                                \
+    {                                     \
+        __uint(type, BPF_MAP_TYPE_ARRAY); \
+        __type(key, __u32);               \
+        __type(value, _vt);               \
+        __uint(max_entries, _cap);        \
+    } name SEC(".maps")
+
 /// @brief 创建一个指定名字和键值类型的ebpf散列表
 /// @param name 新散列表的名字
 /// @param type1 键的类型
@@ -51,28 +100,48 @@
 /**
  * 用于在eBPF代码中声明通用的maps，其中
  * psid_count_map 存储 <psid, count> 键值对，记录了id（由pid、ksid和usid（内核、用户栈id））及相应的值
+ * psid_count_map_b 与 psid_count_map 组成双缓冲，由 __count_idx 选择当前写入的表，须通过 COUNT_MAP 访问
  * sid_trace_map 存储 <sid（ksid或usid）, trace> 键值对，记录了栈id（ksid或usid）及相应的栈
+ * sid_stack_map 设定了栈深度时代替 sid_trace_map，存储由栈哈希得到的栈id及相应的栈
+ * stack_scratch 每CPU的暂存区，bpf_get_stack 先将栈写入此处再计算哈希
+ * sample_stat_map 每CPU的频率限制统计，用于估计实际的采样比例
  * pid_tgid 存储 <pid, tgid> 键值对，记录pid以及对应的tgid
  * pid_comm 存储 <pid, comm> 键值对，记录pid以及对应的命令名
+ * cgroup_set_map 要跟踪的cgroup id集合，由用户态在运行时增删
  * type：指定count值的类型
  */
-#define COMMON_MAPS(count_type)                              \
-    BPF_HASH(psid_count_map, psid, count_type, MAX_ENTRIES); \
-    BPF_STACK_TRACE(sid_trace_map);                          \
-    BPF_HASH(tgid_cgroup_map, __u32,                         \
-             char[CONTAINER_ID_LEN], MAX_ENTRIES / 100);     \
-    BPF_HASH(pid_info_map, u32, task_info, MAX_ENTRIES / 10);
+#define COMMON_MAPS(count_type)                                \
+    BPF_HASH(psid_count_map, psid, count_type, MAX_ENTRIES);   \
+    BPF_HASH(psid_count_map_b, psid, count_type, MAX_ENTRIES); \
+    BPF_STACK_TRACE(sid_trace_map);                            \
+    BPF_HASHED_STACK(sid_stack_map);                           \
+    BPF_STACK_SCRATCH(stack_scratch);                          \
+    BPF_PERCPU_ARRAY(sample_stat_map, sample_stat, 1);         \
+    BPF_HASH(tgid_cgroup_map, __u32,                           \
+             char[CONTAINER_ID_LEN], MAX_ENTRIES / 100);       \
+    BPF_HASH(pid_info_map, u32, task_info, MAX_ENTRIES / 10); \
+    BPF_HASH(cgroup_set_map, __u64, __u8, MAX_CGROUPS);
 
 #define COMMON_VALS                           \
     const volatile bool trace_user = false;   \
     const volatile bool trace_kernel = false; \
-    const volatile __u64 target_cgroupid = 0; \
+    const volatile bool filter_cgroup = false; \
+    const volatile bool cgroup_key = false;    \
     const volatile __u32 target_tgid = 0;     \
     const volatile __u32 self_tgid = 0;       \
     const volatile __u32 freq = 0;            \
+    const volatile __u32 stack_depth = 0;     \
     bool __active = false;                    \
+    __u32 __freq = 0;                         \
+    __u32 __count_idx = 0;                    \
     __u64 __last_n = 0;                       \
-    __u64 __next_n = 0;
+    __u64 __next_n = 0;                       \
+    __u64 __stack_lookups = 0;                \
+    __u64 __stack_collisions = 0;
+
+/// @brief 当前写入的计数表，用户态翻转__count_idx后读取另一张表
+#define COUNT_MAP \
+    (__count_idx ? (void *)&psid_count_map_b : (void *)&psid_count_map)
 
 #define CHECK_ACTIVE \
     if (!__active)   \
@@ -108,14 +177,21 @@
  * 该内存顺序不能是__ATOMIC_RELEASE或__ATOMIC_ACQ_REL，
  * 并且不能比success_memorder更严格。
  */
-#define CHECK_FREQ(_ts)                               \
-    if (freq)                                         \
-    {                                                 \
-        __next_n = (_ts * freq) >> 30;                \
-        if (__atomic_compare_exchange_n(              \
-                &__next_n, &__last_n, __next_n, true, \
-                __ATOMIC_RELAXED, __ATOMIC_RELAXED))  \
-            return 0;                                 \
+// freq为0时不限制频率；否则限制为__freq，由用户态在运行时调整
+#define CHECK_FREQ(_ts)                                                           \
+    if (freq)                                                                     \
+    {                                                                             \
+        __u32 __zero = 0;                                                         \
+        sample_stat *__ss = bpf_map_lookup_elem(&sample_stat_map, &__zero);       \
+        if (__ss)                                                                 \
+            __ss->seen++;                                                         \
+        __next_n = (_ts * __freq) >> 30;                                          \
+        if (__atomic_compare_exchange_n(                                          \
+                &__next_n, &__last_n, __next_n, true,                             \
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))                              \
+            return 0;                                                             \
+        if (__ss)                                                                 \
+            __ss->taken++;                                                        \
     }
 #endif
 
@@ -135,15 +211,20 @@
     BPF_CORE_READ(_task, cgroups, dfl_cgrp, kn)
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 0)
-#define CHECK_CGID(_knode)                                                      \
-    if (target_cgroupid > 0 && BPF_CORE_READ(_knode, id.id) != target_cgroupid) \
-        return 0;
+#define GET_CGID(_knode) BPF_CORE_READ(_knode, id.id)
 #else
-#define CHECK_CGID(_knode)                                                   \
-    if (target_cgroupid > 0 && BPF_CORE_READ(_knode, id) != target_cgroupid) \
-        return 0;
+#define GET_CGID(_knode) BPF_CORE_READ(_knode, id)
 #endif
 
+// 设置了要跟踪的cgroup时，检查被采集进程的cgroup是否在集合中
+#define CHECK_CGID(_knode)                                        \
+    if (filter_cgroup)                                            \
+    {                                                             \
+        __u64 __cgid = GET_CGID(_knode);                          \
+        if (!bpf_map_lookup_elem(&cgroup_set_map, &__cgid))       \
+            return 0;                                             \
+    }
+
 #define TRY_SAVE_INFO(_task, _pid, _tgid, _knode)                                                  \
     if (!bpf_map_lookup_elem(&pid_info_map, &_pid))                                                \
     {                                                                                              \
@@ -159,11 +240,87 @@
         }                                                                                          \
     }
 
-#define TRACE_AND_GET_COUNT_KEY(_pid, _ctx)                                                                       \
-    {                                                                                                             \
-        .pid = _pid,                                                                                              \
-        .usid = trace_user ? bpf_get_stackid(_ctx, &sid_trace_map, BPF_F_FAST_STACK_CMP | BPF_F_USER_STACK) : -1, \
-        .ksid = trace_kernel ? bpf_get_stackid(_ctx, &sid_trace_map, BPF_F_FAST_STACK_CMP) : -1,                  \
+// 栈id冲突时向后探测的次数
+#define STACK_PROBES 4
+
+/**
+ * 用 bpf_get_stack 采集至多 stack_depth 层的调用栈，以FNV-1a计算64位哈希，
+ * 由哈希得到31位的栈id，先查找 sid_stack_map，未命中时才插入。
+ * 栈id已被哈希不同的栈占用时计一次冲突并向后探测，探测失败则返回 -EEXIST，
+ * 其余错误返回相应的负错误码，与 bpf_get_stackid 一致
+ */
+#define GET_HASHED_SID(_ctx, _flags)                                                    \
+    ({                                                                                  \
+        __s32 __sid = -12 /* -ENOMEM */;                                                \
+        __u32 __zero = 0;                                                               \
+        stack_trace *__st = bpf_map_lookup_elem(&stack_scratch, &__zero);               \
+        if (__st)                                                                       \
+        {                                                                               \
+            __u32 __size = stack_depth * sizeof(__u64);                                 \
+            if (__size > sizeof(__st->ips))                                             \
+                __size = sizeof(__st->ips);                                             \
+            long __len = bpf_get_stack(_ctx, __st->ips, __size, _flags);                \
+            if (__len <= 0)                                                             \
+                __sid = __len ? __len : -14 /* -EFAULT */;                              \
+            else                                                                        \
+            {                                                                           \
+                __sync_fetch_and_add(&__stack_lookups, 1);                              \
+                __st->nr = __len / sizeof(__u64);                                       \
+                __u64 __h = 0xcbf29ce484222325ULL ^ (_flags);                           \
+                for (int __i = 0; __i < MAX_STACK_DEPTH && __i < __st->nr; __i++)       \
+                    __h = (__h ^ __st->ips[__i]) * 0x100000001b3ULL;                    \
+                __st->hash = __h;                                                       \
+                __sid = -17 /* -EEXIST */;                                              \
+                for (__u32 __p = 0; __p < STACK_PROBES; __p++)                          \
+                {                                                                       \
+                    __s32 __k = (((__h >> 32) + __p) % 0x7fffffff) + 1;                 \
+                    /* 已存在的栈只查找，不在每次采样时都尝试插入 */                    \
+                    stack_trace *__old = bpf_map_lookup_elem(&sid_stack_map, &__k);     \
+                    if (!__old)                                                         \
+                    {                                                                   \
+                        long __ret = bpf_map_update_elem(&sid_stack_map, &__k,          \
+                                                         __st, BPF_NOEXIST);            \
+                        if (!__ret)                                                     \
+                        {                                                               \
+                            __sid = __k;                                                \
+                            break;                                                      \
+                        }                                                               \
+                        if (__ret != -17)                                               \
+                        {                                                               \
+                            __sid = __ret;                                              \
+                            break;                                                      \
+                        }                                                               \
+                        /* 其他CPU刚插入了该项，与之比较 */                             \
+                        __old = bpf_map_lookup_elem(&sid_stack_map, &__k);              \
+                    }                                                                   \
+                    if (__old && __old->hash == __h && __old->nr == __st->nr)           \
+                    {                                                                   \
+                        __sid = __k;                                                    \
+                        break;                                                          \
+                    }                                                                   \
+                    /* 每次查找至多计一次冲突，首选的栈id被占用即需探测 */              \
+                    if (!__p)                                                           \
+                        __sync_fetch_and_add(&__stack_collisions, 1);                   \
+                }                                                                       \
+            }                                                                           \
+        }                                                                               \
+        __sid;                                                                          \
+    })
+
+/// @brief 采集调用栈并生成计数的键，设定了栈深度时按哈希去重，否则使用栈表；按cgroup区分时记入当前cgroup的id
+#define TRACE_AND_GET_COUNT_KEY(_pid, _ctx)                                                    \
+    {                                                                                          \
+        .pid = _pid,                                                                           \
+        .usid = trace_user ? (stack_depth ? GET_HASHED_SID(_ctx, BPF_F_USER_STACK)             \
+                                          : bpf_get_stackid(_ctx, &sid_trace_map,              \
+                                                            BPF_F_FAST_STACK_CMP |             \
+                                                                BPF_F_USER_STACK))             \
+                           : -1,                                                               \
+        .ksid = trace_kernel ? (stack_depth ? GET_HASHED_SID(_ctx, 0)                          \
+                                            : bpf_get_stackid(_ctx, &sid_trace_map,            \
+                                                              BPF_F_FAST_STACK_CMP))           \
+                             : -1,                                                             \
+        .cgid = cgroup_key ? bpf_get_current_cgroup_id() : 0,                                  \
     }
 
 #endif
\ No newline at end of file
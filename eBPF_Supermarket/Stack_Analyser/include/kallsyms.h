@@ -0,0 +1,386 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 内核符号表的加载器，C和C++均可包含，供Stack_Analyser和net_watcher共用。
+// 一次读入/proc/kallsyms并手工解析，符号名存放在同一块内存中；
+// 排好序的索引按内核build-id、启动id和已加载模块持久化，之后的运行直接mmap
+
+#ifndef _SA_KALLSYMS_H__
+#define _SA_KALLSYMS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#define KALLSYMS_CACHE_DIR "/var/cache/lmp"
+#define KALLSYMS_CACHE_FILE "kallsyms.idx"
+#define KALLSYMS_MAGIC "KSYMIDX1"
+#define KALLSYMS_KEY_LEN 128
+
+/// @brief 索引中的一个符号，name为符号名在符号名区中的偏移
+struct kallsyms_entry
+{
+	uint64_t addr;
+	uint32_t name;
+	uint32_t _pad;
+};
+
+/// @brief 索引的头部，其后依次为按地址排序的符号和符号名区，内存与文件中的布局相同
+struct kallsyms_header
+{
+	char magic[8];
+	uint32_t nr;
+	uint32_t _pad;
+	uint64_t names_sz;
+	char key[KALLSYMS_KEY_LEN]; // 内核build-id、启动id和已加载模块的摘要
+};
+
+/// @brief 按地址排序的内核符号索引
+struct kallsyms_index
+{
+	const struct kallsyms_entry *entries;
+	const char *names;
+	size_t nr;
+	void *mem; // 头部、符号和符号名区所在的内存
+	size_t mem_sz;
+	int mapped; // mem是否为缓存文件的映射
+};
+
+/// @brief 读入整个文件，procfs的文件大小未知，缓冲区按需倍增
+/// @return 成功返回以'\0'结尾的缓冲区，需要free，否则返回NULL
+static inline char *kallsyms__read_file(const char *path, size_t *len)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	size_t cap = 1 << 16, sz = 0;
+	char *buf = (char *)malloc(cap);
+	while (buf)
+	{
+		if (sz + 1 >= cap)
+		{
+			char *tmp = (char *)realloc(buf, cap *= 2);
+			if (!tmp)
+			{
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf = tmp;
+		}
+		ssize_t n = read(fd, buf + sz, cap - sz - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			free(buf);
+			buf = NULL;
+			break;
+		}
+		if (!n)
+			break;
+		sz += n;
+	}
+	close(fd);
+	if (buf)
+	{
+		buf[sz] = '\0';
+		*len = sz;
+	}
+	return buf;
+}
+
+static inline uint64_t kallsyms__fnv(uint64_t h, const char *s, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/// @brief 生成标识当前内核符号表的键
+/// @note 启动id区分KASLR的不同偏移，模块名和加载地址的摘要区分模块的装卸
+static inline void kallsyms__key(char *key)
+{
+	char id[64] = "", boot[64] = "";
+	size_t len = 0, pos = 0;
+	// /sys/kernel/notes由ELF note组成，取其中的GNU build-id
+	char *notes = kallsyms__read_file("/sys/kernel/notes", &len);
+	while (notes && pos + 12 <= len)
+	{
+		uint32_t namesz, descsz, type;
+		memcpy(&namesz, notes + pos, 4);
+		memcpy(&descsz, notes + pos + 4, 4);
+		memcpy(&type, notes + pos + 8, 4);
+		size_t name_pos = pos + 12, desc_pos = name_pos + ((namesz + 3) & ~3u);
+		if (desc_pos + descsz > len)
+			break;
+		if (type == 3 && namesz == 4 && !memcmp(notes + name_pos, "GNU", 4))
+		{
+			for (uint32_t i = 0; i < descsz && i < 31; i++)
+				sprintf(id + 2 * i, "%02x", (unsigned char)notes[desc_pos + i]);
+			break;
+		}
+		pos = desc_pos + ((descsz + 3) & ~3u);
+	}
+	free(notes);
+	if (!id[0])
+	{
+		struct utsname u;
+		if (!uname(&u))
+			snprintf(id, sizeof(id), "%016llx",
+					 (unsigned long long)kallsyms__fnv(kallsyms__fnv(0xcbf29ce484222325ULL, u.release, strlen(u.release)),
+													   u.version, strlen(u.version)));
+	}
+	char *b = kallsyms__read_file("/proc/sys/kernel/random/boot_id", &len);
+	if (b)
+	{
+		snprintf(boot, sizeof(boot), "%.*s", (int)strcspn(b, "\n"), b);
+		free(b);
+	}
+	// 只取模块名和加载地址，引用计数的变化不影响符号表
+	uint64_t h = 0xcbf29ce484222325ULL;
+	char *mods = kallsyms__read_file("/proc/modules", &len);
+	for (char *line = mods; line && *line;)
+	{
+		char *end = strchr(line, '\n');
+		if (!end)
+			end = line + strlen(line);
+		char *p = line;
+		for (int col = 0; col < 6 && p < end; col++)
+		{
+			size_t n = strcspn(p, " \n");
+			if (p + n > end)
+				n = end - p;
+			if (col == 0 || col == 5)
+				h = kallsyms__fnv(h, p, n + 1);
+			p += n;
+			while (p < end && *p == ' ')
+				p++;
+		}
+		line = *end ? end + 1 : end;
+	}
+	free(mods);
+	// build-id至多63个字符，启动id为36个字符的UUID，限定宽度后不会截断
+	snprintf(key, KALLSYMS_KEY_LEN, "%.63s-%.36s-%016llx", id, boot, (unsigned long long)h);
+}
+
+/// @brief 尝试映射与键匹配的缓存索引
+/// @return 成功返回0，否则返回-1
+static inline int kallsyms__map_cache(struct kallsyms_index *idx, const char *path, const char *key)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	void *mem = MAP_FAILED;
+	// 只信任自己写入的缓存
+	if (!fstat(fd, &st) && st.st_uid == geteuid() && (size_t)st.st_size >= sizeof(struct kallsyms_header))
+		mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return -1;
+	const struct kallsyms_header *h = (const struct kallsyms_header *)mem;
+	size_t size = st.st_size, entries_sz = (size_t)h->nr * sizeof(struct kallsyms_entry);
+	const struct kallsyms_entry *entries = (const struct kallsyms_entry *)(h + 1);
+	const char *names = (const char *)(entries + h->nr);
+	int ok = !memcmp(h->magic, KALLSYMS_MAGIC, 8) &&
+			 !strncmp(h->key, key, KALLSYMS_KEY_LEN) &&
+			 h->names_sz && sizeof(*h) + entries_sz + h->names_sz == size &&
+			 !names[h->names_sz - 1];
+	// 符号名区以'\0'结尾，偏移不越界即可保证符号名不越界
+	for (uint32_t i = 0; ok && i < h->nr; i++)
+		ok = entries[i].name < h->names_sz;
+	if (!ok)
+	{
+		munmap(mem, size);
+		return -1;
+	}
+	idx->entries = entries;
+	idx->names = names;
+	idx->nr = h->nr;
+	idx->mem = mem;
+	idx->mem_sz = size;
+	idx->mapped = 1;
+	return 0;
+}
+
+// qsort没有上下文参数，排序期间由此指向符号名区；加载只在启动时进行
+static const char *kallsyms__sort_names;
+
+static inline int kallsyms__cmp(const void *p1, const void *p2)
+{
+	const struct kallsyms_entry *s1 = (const struct kallsyms_entry *)p1, *s2 = (const struct kallsyms_entry *)p2;
+	if (s1->addr == s2->addr)
+		return strcmp(kallsyms__sort_names + s1->name, kallsyms__sort_names + s2->name);
+	return s1->addr < s2->addr ? -1 : 1;
+}
+
+static inline int kallsyms__hex(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/// @brief 解析/proc/kallsyms并排序，结果放在与缓存文件布局相同的一块内存中
+/// @return 成功返回0，否则返回-1
+static inline int kallsyms__parse(struct kallsyms_index *idx, const char *key)
+{
+	size_t len, lines = 0;
+	char *buf = kallsyms__read_file("/proc/kallsyms", &len);
+	if (!buf)
+		return -1;
+	for (char *p = buf; (p = (char *)memchr(p, '\n', buf + len - p)); p++)
+		lines++;
+	lines++;
+	// 符号名总长不超过文件长度
+	size_t mem_sz = sizeof(struct kallsyms_header) + lines * sizeof(struct kallsyms_entry) + len + 1;
+	struct kallsyms_header *h = (struct kallsyms_header *)calloc(1, mem_sz);
+	if (!h)
+	{
+		free(buf);
+		return -1;
+	}
+	struct kallsyms_entry *entries = (struct kallsyms_entry *)(h + 1);
+	char *names = (char *)(entries + lines);
+	size_t nr = 0, names_sz = 0;
+	int sorted = 1;
+	// 每行形如"地址 类型 符号名[\t[模块名]]"
+	for (char *p = buf, *end = buf + len; p < end;)
+	{
+		uint64_t addr = 0;
+		int d;
+		while ((d = kallsyms__hex(*p)) >= 0)
+			addr = (addr << 4) | d, p++;
+		char *name = NULL;
+		if (*p == ' ' && p[1] && p[1] != '\n' && p[2] == ' ')
+			name = p + 3;
+		p = name ? name : p;
+		size_t n = name ? strcspn(name, " \t\n") : 0;
+		if (n)
+		{
+			memcpy(names + names_sz, name, n);
+			names[names_sz + n] = '\0';
+			entries[nr].addr = addr;
+			entries[nr].name = names_sz;
+			if (nr && (addr < entries[nr - 1].addr ||
+					   (addr == entries[nr - 1].addr && strcmp(names + names_sz, names + entries[nr - 1].name) < 0)))
+				sorted = 0;
+			nr++;
+			names_sz += n + 1;
+		}
+		p = (char *)memchr(p, '\n', end - p);
+		if (!p)
+			break;
+		p++;
+	}
+	free(buf);
+	if (!sorted)
+	{
+		// 地址相同的符号按名字排序，与原先的ksym_cmp一致
+		kallsyms__sort_names = names;
+		qsort(entries, nr, sizeof(*entries), kallsyms__cmp);
+		kallsyms__sort_names = NULL;
+	}
+	// 紧缩布局，使符号名区紧跟在符号之后
+	memmove(entries + nr, names, names_sz);
+	memcpy(h->magic, KALLSYMS_MAGIC, 8);
+	h->nr = nr;
+	h->names_sz = names_sz;
+	snprintf(h->key, KALLSYMS_KEY_LEN, "%s", key);
+	idx->entries = entries;
+	idx->names = (const char *)(entries + nr);
+	idx->nr = nr;
+	idx->mem = h;
+	idx->mem_sz = sizeof(*h) + nr * sizeof(*entries) + names_sz;
+	idx->mapped = 0;
+	return 0;
+}
+
+/// @brief 将索引写入缓存文件，先写临时文件再改名，并发的运行不会读到写了一半的缓存
+static inline void kallsyms__save_cache(const struct kallsyms_index *idx, const char *dir, const char *path)
+{
+	// 地址被kptr_restrict隐藏时不缓存
+	if (!idx->nr || (!idx->entries[0].addr && !idx->entries[idx->nr - 1].addr))
+		return;
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return;
+	char tmp[PATH_MAX + 16];
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	const char *p = (const char *)idx->mem;
+	size_t left = idx->mem_sz;
+	while (left)
+	{
+		ssize_t n = write(fd, p, left);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		p += n;
+		left -= n;
+	}
+	close(fd);
+	if (left || rename(tmp, path))
+		unlink(tmp);
+}
+
+/// @brief 加载内核符号索引
+/// @param idx 存放结果的索引
+/// @param cache_dir 缓存目录，为NULL时不使用缓存
+/// @return 成功返回0，否则返回-1
+static inline int kallsyms__load(struct kallsyms_index *idx, const char *cache_dir)
+{
+	char key[KALLSYMS_KEY_LEN], path[PATH_MAX];
+	kallsyms__key(key);
+	if (cache_dir)
+	{
+		snprintf(path, sizeof(path), "%s/" KALLSYMS_CACHE_FILE, cache_dir);
+		if (!kallsyms__map_cache(idx, path, key))
+			return 0;
+	}
+	if (kallsyms__parse(idx, key))
+		return -1;
+	if (cache_dir)
+		kallsyms__save_cache(idx, cache_dir, path);
+	return 0;
+}
+
+static inline void kallsyms__free(struct kallsyms_index *idx)
+{
+	if (!idx->mem)
+		return;
+	if (idx->mapped)
+		munmap(idx->mem, idx->mem_sz);
+	else
+		free(idx->mem);
+	memset(idx, 0, sizeof(*idx));
+}
+
+#endif
@@ -0,0 +1,56 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 离线符号解析，采集时只以build-id和文件内地址记录用户栈帧，之后在另一台机器上按调试文件解析
+
+#ifndef _SA_OFFLINE_H__
+#define _SA_OFFLINE_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/// @brief 离线解析所需的ELF文件标识，在采集的机器上按文件读取一次
+struct ElfIdent
+{
+    std::string build_id; // 十六进制的GNU build-id，没有时为空
+    struct Load
+    {
+        uint64_t offset, vaddr, filesz;
+    };
+    std::vector<Load> loads;
+
+    /// @brief 由文件内偏移得到ELF中的虚拟地址，与调试文件中的符号地址一致
+    bool toVaddr(uint64_t off, uint64_t &vaddr) const;
+};
+
+/// @brief 读取ELF文件的build-id和可加载段，只读取文件头和note
+/// @return 成功为真，否则为假
+bool read_elf_ident(const char *path, ElfIdent &ident);
+
+/// @brief 生成离线栈帧，形如"[<id>]+0x<vaddr>"
+/// @param id 文件的build-id，没有时为文件路径
+std::string offline_frame(const std::string &id, uint64_t vaddr);
+
+/// @brief 拆分离线栈帧
+/// @return 不是离线栈帧时为假
+bool parse_offline_frame(const std::string &frame, std::string &id, uint64_t &vaddr);
+
+/// @brief symbolize子命令，按调试文件目录解析-O raw输出的记录，再按指定格式输出
+/// @param argv argv[0]为子命令名
+int symbolize_main(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,84 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 采集数据的输出格式和输出目标
+
+#ifndef _SA_OUTPUT_H__
+#define _SA_OUTPUT_H__
+
+#include <stdio.h>
+#include <string>
+#include <zlib.h>
+
+#include "bpf_wapper/eBPFStackCollector.h"
+
+/// @brief 输出格式
+enum OutputFormat
+{
+    OUTPUT_TEXT,   // 彩色的表格文本
+    OUTPUT_FOLDED, // 火焰图使用的折叠栈
+    OUTPUT_PPROF,  // pprof的profile.proto
+    OUTPUT_RAW,    // 用户栈帧未解析的原始格式，由symbolize子命令离线解析
+    OUTPUT_DIFF,   // 与基线比较的差分折叠栈，每行为"调用栈 基线值 当前值"
+};
+
+/// @brief 以彩色表格文本输出
+std::string renderText(const Report &R);
+
+/// @brief 以折叠栈输出，每行为"采集器;进程名;栈底;...;栈顶 值"，值取第一个计量
+std::string renderFolded(const Report &R);
+
+/// @brief 以未压缩的pprof profile.proto输出，字符串、函数和位置均去重
+/// @note 线程信息作为样本标签
+std::string renderPprof(const Report &R);
+
+/// @brief 以紧凑的二进制格式输出，离线栈帧按文件去重，记为文件序号和地址
+/// @note 依次为"SAR1"、时间、名称、计量、文件表、栈帧表、调用栈、计数、线程信息、容器和函数名，
+///       整数为varint，栈id为zigzag编码的varint，字符串以varint长度为前缀
+std::string renderRaw(const Report &R);
+
+/// @brief 输出目标，可以是标准输出、文件或unix套接字，可选gzip压缩
+class OutputSink
+{
+private:
+    FILE *f = stdout;
+    bool gzip = false;
+    bool zinit = false;
+    z_stream zs;
+
+    int put(const void *data, size_t len);
+    int deflateTo(const std::string &data, int flush);
+
+public:
+    ~OutputSink();
+
+    /// @brief 打开输出目标
+    /// @param path 文件路径，以"unix:"开头时连接对应的unix流套接字，为空时使用标准输出
+    /// @param compress 是否进行gzip压缩
+    /// @return 成功返回0，否则返回-1
+    int open(const std::string &path, bool compress);
+
+    /// @brief 写入文本数据，压缩时所有文本组成一个gzip流，每次写入后刷新
+    int writeStream(const std::string &data);
+
+    /// @brief 写入一条二进制记录，压缩时每条记录单独压缩
+    /// @note 记录格式为：4字节大端的名称长度、名称、4字节大端的数据长度、数据
+    int writeRecord(const std::string &name, const std::string &data);
+
+    void close(void);
+};
+
+#endif
@@ -0,0 +1,82 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 飞行记录器，在内存中保留最近若干输出周期未解析的数据，触发事件后再解析输出
+
+#ifndef _SA_RECORDER_H__
+#define _SA_RECORDER_H__
+
+#include <stddef.h>
+#include <deque>
+#include <vector>
+
+#include "bpf_wapper/eBPFStackCollector.h"
+
+/// @brief 一个采集器在一个输出周期内未解析的数据，只保存计数键、值和统计
+/// @note 栈表和线程信息表中的项在运行期间保持不变，事后仍可按栈id解析
+struct Snapshot
+{
+    bool ok;
+    std::string time;
+    const char *name;
+    const Scale *scales;
+    int scale_num;
+    std::vector<psid> keys;
+    std::vector<uint64_t> vals; // 每个键有scale_num个值
+    std::vector<WakeEdge> wakes;
+    uint32_t rate;
+    uint64_t sample_seen, sample_taken, stack_lookups, stack_collisions;
+    std::map<uint32_t, std::string> funcs;
+    std::map<uint32_t, std::vector<uint64_t>> hists;
+    std::map<uint64_t, std::string> cgroup_paths;
+
+    /// @brief 从读取到但未解析的报告生成快照
+    /// @param ok 报告是否读取成功
+    Snapshot(const Report &R, bool ok);
+
+    /// @brief 还原为未解析的报告，其中的计数值指向快照，快照销毁前有效
+    void restore(Report &R) const;
+
+    /// @brief 快照占用的内存
+    size_t bytes(void) const;
+};
+
+/// @brief 一个输出周期内各采集器的快照，与采集器列表的顺序一致
+typedef std::vector<Snapshot> Window;
+
+/// @brief 按内存预算保留最近输出周期的环形缓冲区
+class FlightRecorder
+{
+private:
+    size_t budget;
+    size_t used = 0;
+    std::deque<Window> windows;
+
+    static size_t bytes(const Window &w);
+
+public:
+    /// @param budget 内存预算，单位为字节
+    explicit FlightRecorder(size_t budget) : budget(budget){};
+
+    /// @brief 记录一个输出周期，超出预算时丢弃最早的周期
+    /// @note 单个周期超出预算时也至少保留该周期
+    void push(Window &&w);
+
+    /// @brief 按时间顺序取出并清空所有周期
+    std::deque<Window> take(void);
+};
+
+#endif
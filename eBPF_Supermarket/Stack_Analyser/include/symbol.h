@@ -0,0 +1,156 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 跨输出周期的符号解析缓存，声明栈帧缓存和栈id记忆表
+
+#ifndef _SA_SYMBOL_H__
+#define _SA_SYMBOL_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+
+#include "offline.h"
+
+#ifdef USE_BLAZESYM
+#include "blazesym.h"
+#endif
+
+// 符号缓存每一代的项数上限，超过后在周期开始时换代，未再使用的上一代随之释放
+#define SYMBOL_CACHE_MAX (1 << 18)
+
+/// @brief 已解析的调用栈，由栈底到栈顶排列，元素指向符号缓存中驻留的字符串
+typedef std::vector<const std::string *> Frames;
+
+/// @brief 一张栈表的栈id到已解析调用栈的记忆表
+/// @note 栈表中的id与其栈帧在运行期间保持不变，因此只需在进程exec或映射变化时失效
+struct TraceMemo
+{
+    struct UserTraces
+    {
+        uint64_t epoch; // 记录时进程的映射版本
+        std::unordered_map<int32_t, Frames> traces;
+    };
+    std::unordered_map<int32_t, Frames> ktraces;
+    std::unordered_map<uint32_t, UserTraces> utraces;
+    uint64_t generation = 0; // 记录时符号缓存的代数，换代后其中的栈帧可能已被释放
+};
+
+/// @brief 符号解析器，可被多个采集器线程同时使用
+/// @note 用户栈解析依赖的syms_cache不是线程安全的，由umutex串行化；内核符号表只读，只需保护缓存。
+///       各缓存分为当前和上一代，命中上一代的项移入当前代，换代时丢弃上一代，近似LRU地限制内存
+class Symbolizer
+{
+private:
+    /// @brief 栈帧以文件和文件内偏移标识，映射同一文件的进程共享解析结果
+    struct FrameKey
+    {
+        uint64_t dev;
+        uint64_t inode;
+        uint64_t offset;
+        bool operator==(const FrameKey &b) const
+        {
+            return dev == b.dev && inode == b.inode && offset == b.offset;
+        }
+    };
+    struct FrameKeyHash
+    {
+        size_t operator()(const FrameKey &k) const
+        {
+            uint64_t h = k.offset * 0x9e3779b97f4a7c15ull;
+            h ^= (k.inode + (k.dev << 20)) * 0xc2b2ae3d27d4eb4full;
+            return h ^ (h >> 29);
+        }
+    };
+    struct ProcState
+    {
+        uint64_t exe_dev, exe_ino; // 可执行文件，exec后改变
+        uint64_t start_time;       // 进程启动时间，pid复用后改变
+        uint64_t maps_hash;        // /proc/<pid>/maps的指纹，映射变化后改变
+        uint64_t epoch;            // 映射版本，全局唯一，失效时重新分配
+        uint64_t checked;          // 上次检查所在的输出周期
+        uint64_t reloaded;         // 上次重新解析映射所在的输出周期
+    };
+
+    uint64_t interval = 1;
+    uint64_t last_epoch = 0;
+    uint64_t generation = 1;
+    std::mutex umutex; // 保护procs、uframes和syms_cache
+    std::mutex kmutex; // 保护kframes，换代时与umutex一同持有
+    std::mutex smutex; // 保护strings，总是最后获取
+    std::unordered_set<std::string> strings, old_strings;
+    std::unordered_map<FrameKey, const std::string *, FrameKeyHash> uframes, old_uframes;
+    std::unordered_map<uint64_t, const std::string *> kframes, old_kframes;
+    std::unordered_map<uint32_t, ProcState> procs;
+    // 离线模式下各文件的标识，键中的offset为0
+    std::unordered_map<FrameKey, std::pair<std::string, ElfIdent>, FrameKeyHash> idents;
+#ifdef USE_BLAZESYM
+    blaze_symbolizer *blazer = NULL;
+    // 展开内联函数后一个地址对应的多个栈帧，由外层函数到最内层的内联函数排列，
+    // 非栈顶的返回地址以其前一字节，即调用指令所在的地址为键
+    std::unordered_map<FrameKey, Frames, FrameKeyHash> uinlines, old_uinlines;
+
+    Frames *findInlines(const FrameKey &key);
+#endif
+
+    const std::string *intern(std::string &&s);
+    const std::string *keep(const std::string *s);
+    void rotate(void);
+    ProcState &checkProc(uint32_t tgid);
+    void invalidate(uint32_t tgid, ProcState &st);
+    const std::string *userFrame(uint32_t tgid, ProcState &st, uint64_t addr);
+    void userFrames(uint32_t tgid, ProcState &st, uint64_t addr, bool leaf, Frames &frames);
+    const std::string *kernelFrame(uint64_t addr);
+
+public:
+    // 离线模式，用户栈帧只记录所在文件的build-id和地址，不加载ELF符号表，由symbolize子命令事后解析
+    bool offline = false;
+    // 展开内联函数并附上源码文件和行号，需要以BLAZESYM=1编译
+    bool inlines = false;
+
+    ~Symbolizer();
+
+    /// @brief 开始新的输出周期，周期内每个进程最多检查一次是否exec或映射变化
+    /// @note 同时回收已退出进程的状态和映射缓存
+    void newInterval(void);
+
+    /// @brief 删除记忆表中已退出进程的用户栈，符号缓存换代后清空记忆表
+    void prune(TraceMemo &memo);
+
+    /// @brief 查找记忆表中已解析的用户栈
+    /// @return 未命中或进程映射已变化时为NULL
+    const Frames *findUser(TraceMemo &memo, uint32_t tgid, int32_t usid);
+
+    /// @brief 解析用户栈并记入记忆表
+    /// @param ips 由栈顶到栈底排列的地址
+    /// @param n 地址数
+    const Frames *addUser(TraceMemo &memo, uint32_t tgid, int32_t usid, const uint64_t *ips, int n);
+
+    /// @brief 展开内联函数时，将一个进程本周期待解析的全部地址一次性交给blazesym解析并缓存
+    /// @param stacks 该进程待解析的用户栈，各栈由栈顶到栈底排列
+    /// @note 随后的addUser直接使用缓存结果；未展开内联函数时不做任何事
+    void prefetch(uint32_t tgid, const std::vector<const std::vector<uint64_t> *> &stacks);
+
+    const Frames *findKernel(TraceMemo &memo, int32_t ksid);
+    const Frames *addKernel(TraceMemo &memo, int32_t ksid, const uint64_t *ips, int n);
+};
+
+extern Symbolizer symbolizer;
+
+#endif
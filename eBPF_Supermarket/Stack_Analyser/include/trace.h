@@ -26,7 +26,6 @@ struct sym
 	const char *name;
 	unsigned long start;
 	unsigned long size;
-	unsigned long offset;
 };
 
 struct syms;
@@ -34,14 +33,39 @@ struct syms;
 struct syms *syms__load_pid(int tgid);
 struct syms *syms__load_file(const char *fname, int tgid);
 void syms__free(struct syms *syms);
-struct sym *syms__map_addr(const struct syms *syms, unsigned long addr);
+/* *sym_off* receives the offset of *addr* in the symbol, it may be NULL */
+const struct sym *syms__map_addr(const struct syms *syms, unsigned long addr,
+								 unsigned long *sym_off);
 const struct sym *syms__map_addr_dso(const struct syms *syms, unsigned long addr,
 									 char **dso_name, unsigned long *dso_offset);
+/*
+ * Find the file backing *addr* and the offset of *addr* in it, without
+ * resolving the symbol. Returns -1 when no mapping of *syms* covers it.
+ */
+int syms__map_addr_file(const struct syms *syms, unsigned long addr,
+						unsigned long *dev, unsigned long *inode,
+						unsigned long *offset);
+/*
+ * Like syms__map_addr_file, but *file_off* is the offset in the file as
+ * mapped, not the address used for symbol lookup. Returns the path of the
+ * file seen from the host, or NULL when no mapping of *syms* covers *addr*.
+ */
+const char *syms__map_addr_mapping(const struct syms *syms, unsigned long addr,
+								   unsigned long *dev, unsigned long *inode,
+								   unsigned long *file_off);
 
 struct syms_cache;
 
+/*
+ * Create a cache of the maps of at most *nr* processes, 0 for the default
+ * size. The least recently used process is evicted when the cache is full.
+ */
 struct syms_cache *syms_cache__new(int nr);
 struct syms *syms_cache__get_syms(struct syms_cache *syms_cache, int tgid);
+/* Drop the cached maps of *tgid* and parse them again, e.g. after exec() */
+struct syms *syms_cache__reload_syms(struct syms_cache *syms_cache, int tgid);
+/* Evict processes that have exited, returns the number of evicted ones */
+int syms_cache__reclaim(struct syms_cache *syms_cache);
 void syms_cache__free(struct syms_cache *syms_cache);
 
 struct partition
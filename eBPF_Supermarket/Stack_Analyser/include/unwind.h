@@ -0,0 +1,89 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 基于.eh_frame和.debug_frame的用户栈回溯，用于不保留帧指针的程序
+
+#ifndef _SA_UNWIND_H__
+#define _SA_UNWIND_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// 回溯用到的DWARF寄存器编号
+#if defined(__x86_64__)
+#define UW_REG_FP 6  // rbp
+#define UW_REG_SP 7  // rsp
+#define UW_REG_RA 16 // 返回地址列，即rip
+#elif defined(__aarch64__)
+#define UW_REG_FP 29 // x29
+#define UW_REG_SP 31 // sp
+#define UW_REG_RA 30 // lr
+#endif
+#define UW_NREGS 33
+
+/// @brief 回溯起点的用户态寄存器，以及从栈指针开始复制的一段用户栈
+struct UnwindInput
+{
+    uint64_t ip, sp, fp, lr; // lr仅在arm64上有效
+    const uint8_t *stack;
+    size_t size;
+};
+
+class CfiTable;
+
+/// @brief 按调用帧信息回溯用户栈，各文件的调用帧信息解析后缓存，可被多个线程同时使用
+/// @note 没有调用帧信息的函数按帧指针回溯
+class DwarfUnwinder
+{
+private:
+    struct Mapping
+    {
+        uint64_t start, end, offset;
+        uint64_t dev, ino;
+    };
+    struct ProcMaps
+    {
+        std::vector<Mapping> maps; // 按起始地址排列的可执行文件映射
+        time_t loaded;
+    };
+
+    std::mutex mutex; // 保护procs和dsos
+    std::unordered_map<uint32_t, std::shared_ptr<ProcMaps>> procs;
+    // 以设备号和inode标识的文件到其调用帧信息，解析失败时为空
+    std::map<std::pair<uint64_t, uint64_t>, std::shared_ptr<CfiTable>> dsos;
+
+    std::shared_ptr<ProcMaps> loadMaps(uint32_t tgid);
+    const Mapping *findMapping(uint32_t tgid, uint64_t pc, std::shared_ptr<ProcMaps> &pm);
+    std::shared_ptr<CfiTable> getCfi(uint32_t tgid, const Mapping &m);
+
+public:
+    /// @brief 回溯一个进程的用户栈
+    /// @param ips 存放由栈顶到栈底排列的地址，除栈顶外均为返回地址
+    /// @param max 最多回溯的帧数
+    /// @return 回溯得到的地址数
+    int unwind(uint32_t tgid, const UnwindInput &in, uint64_t *ips, int max);
+
+    /// @brief 回收已退出进程的映射
+    void prune(void);
+};
+
+#endif
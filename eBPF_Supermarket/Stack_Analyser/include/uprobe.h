@@ -11,6 +11,8 @@ int get_pid_binary_path(pid_t pid, char *path, size_t path_sz);
 int get_pid_lib_path(pid_t pid, const char *lib, char *path, size_t path_sz);
 int resolve_binary_path(const char *binary, pid_t pid, char *path, size_t path_sz);
 off_t get_elf_func_offset(const char *path, const char *func);
+int for_each_elf_func(const char *path, const char *pattern,
+		      void (*cb)(const char *name, void *ctx), void *ctx);
 Elf *open_elf(const char *path, int *fd_close);
 Elf *open_elf_by_fd(int fd);
 void close_elf(Elf *e, int fd_close);
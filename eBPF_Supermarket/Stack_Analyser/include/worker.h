@@ -0,0 +1,133 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 固定大小的工作线程池，用于并行读取、解析和格式化各采集器的数据
+
+#ifndef _SA_WORKER_H__
+#define _SA_WORKER_H__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <queue>
+#include <vector>
+#include <memory>
+#include <signal.h>
+#include <pthread.h>
+
+/// @brief 在作用域内阻塞当前线程的全部信号，其间创建的线程继承该掩码，
+///        使SIGINT等信号只由主线程处理，信号处理中的退出流程不会在工作线程上等待自己
+class SignalBlocker
+{
+private:
+    sigset_t old;
+
+public:
+    SignalBlocker()
+    {
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+    }
+
+    ~SignalBlocker()
+    {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+};
+
+class WorkerPool
+{
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void(void)>> tasks;
+    std::mutex m;
+    std::condition_variable cv;      // 有新任务或线程池停止
+    std::condition_variable idle_cv; // 任务全部完成
+    unsigned busy = 0;
+    bool stop = false;
+
+    void run(void)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        while (true)
+        {
+            cv.wait(lock, [this]
+                    { return stop || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+            auto task = std::move(tasks.front());
+            tasks.pop();
+            busy++;
+            lock.unlock();
+            task();
+            lock.lock();
+            busy--;
+            if (!busy && tasks.empty())
+                idle_cv.notify_all();
+        }
+    }
+
+public:
+    /// @param n 线程数，至少为1
+    explicit WorkerPool(unsigned n)
+    {
+        if (!n)
+            n = 1;
+        SignalBlocker blocker;
+        for (unsigned i = 0; i < n; i++)
+            workers.emplace_back(&WorkerPool::run, this);
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto &w : workers)
+            w.join();
+    }
+
+    /// @brief 提交一个任务
+    /// @return 任务结果的future，按提交顺序取结果即可保证输出顺序
+    template <typename F>
+    auto submit(F f) -> std::future<decltype(f())>
+    {
+        auto task = std::make_shared<std::packaged_task<decltype(f())(void)>>(std::move(f));
+        auto res = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(m);
+            tasks.emplace([task]
+                          { (*task)(); });
+        }
+        cv.notify_one();
+        return res;
+    }
+
+    /// @brief 等待已提交的任务全部完成
+    void wait(void)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        idle_cv.wait(lock, [this]
+                     { return !busy && tasks.empty(); });
+    }
+};
+
+#endif
@@ -19,55 +19,90 @@
 #include "bpf_wapper/eBPFStackCollector.h"
 #include "user.h"
 #include "trace.h"
+#include "output.h"
 
 #include <sstream>
 #include <map>
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include <linux/version.h>
-#include <cxxabi.h>
+#include <math.h>
 
 std::string getLocalDateTime(void)
 {
     auto t = time(NULL);
-    auto localTm = localtime(&t);
+    struct tm localTm;
+    // 多个采集器在不同线程中同时调用，使用可重入版本
+    localtime_r(&t, &localTm);
     char buff[32];
-    strftime(buff, 32, "%Y%m%d_%H_%M_%S", localTm);
+    strftime(buff, 32, "%Y%m%d_%H_%M_%S", &localTm);
     return std::string(buff);
 };
 
-bool operator<(const CountItem a, const CountItem b)
-{
-    if (a.v[0] < b.v[0] || (a.v[0] == b.v[0] && a.k.pid < b.k.pid))
-        return true;
-    else
-        return false;
-}
+const char *const SharedMaps::names[SHARED_MAP_NUM] = {
+    "sid_trace_map",
+    "sid_stack_map",
+    "pid_info_map",
+    "tgid_cgroup_map",
+};
 
 StackCollector::StackCollector()
 {
     self_tgid = getpid();
 };
 
-std::vector<CountItem> *StackCollector::sortedCountList(void)
+int StackCollector::reuseSharedMaps(struct bpf_object *o)
 {
-    auto psid_count_map = bpf_object__find_map_by_name(obj, "psid_count_map");
-    auto val_size = bpf_map__value_size(psid_count_map);
-    auto value_fd = bpf_object__find_map_fd_by_name(obj, "psid_count_map");
+    if (!shared)
+        return 0;
+    for (int i = 0; i < SHARED_MAP_NUM; i++)
+    {
+        if (shared->fds[i] < 0)
+            continue;
+        auto map = bpf_object__find_map_by_name(o, SharedMaps::names[i]);
+        if (!map)
+            return -ENOENT;
+        int ret = bpf_map__reuse_fd(map, shared->fds[i]);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+void StackCollector::recordSharedMaps(void)
+{
+    if (!shared)
+        return;
+    for (int i = 0; i < SHARED_MAP_NUM; i++)
+    {
+        if (shared->fds[i] >= 0)
+            continue;
+        // 复制一份fd，创建映射的采集器卸载后映射仍然存在
+        int fd = bpf_object__find_map_fd_by_name(obj, SharedMaps::names[i]);
+        if (fd >= 0)
+            shared->fds[i] = dup(fd);
+    }
+}
 
-    auto D = new std::vector<CountItem>();
+bool StackCollector::readMap(struct bpf_map *map, bool del, uint32_t &count, size_t val_size)
+{
+    auto value_fd = bpf_map__fd(map);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 0)
+    key_buf.clear();
+    val_buf.clear();
+    char val[val_size];
     for (psid prev_key = {0}, curr_key = {0};; prev_key = curr_key)
     {
         if (bpf_map_get_next_key(value_fd, &prev_key, &curr_key))
         {
             if (errno != ENOENT)
                 perror("map get next key error");
+            else if (del)
+                bpf_map_delete_elem(value_fd, &prev_key);
             break; // no more keys, done
         }
-        if (showDelta)
+        if (del)
             bpf_map_delete_elem(value_fd, &prev_key);
-        char val[val_size];
         memset(val, 0, val_size);
         if (bpf_map_lookup_elem(value_fd, &curr_key, &val))
         {
@@ -78,152 +113,416 @@ std::vector<CountItem> *StackCollector::sortedCountList(void)
             }
             continue;
         }
-        CountItem d(curr_key, count_values(val));
-        D->insert(std::lower_bound(D->begin(), D->end(), d), d);
+        key_buf.push_back(curr_key);
+        val_buf.insert(val_buf.end(), val, val + val_size);
     }
+    count = key_buf.size();
 #else
-    auto keys = new psid[MAX_ENTRIES];
-    auto vals = new char[MAX_ENTRIES * val_size];
-    uint32_t count = MAX_ENTRIES;
+    key_buf.resize(MAX_ENTRIES);
+    val_buf.resize(MAX_ENTRIES * val_size);
+    count = MAX_ENTRIES;
     psid next_key;
     int err;
-    if (showDelta)
-        err = bpf_map_lookup_and_delete_batch(value_fd, NULL, &next_key, keys, vals, &count, NULL);
+    if (del)
+        err = bpf_map_lookup_and_delete_batch(value_fd, NULL, &next_key, key_buf.data(), val_buf.data(), &count, NULL);
     else
-        err = bpf_map_lookup_batch(value_fd, NULL, &next_key, keys, vals, &count, NULL);
+        err = bpf_map_lookup_batch(value_fd, NULL, &next_key, key_buf.data(), val_buf.data(), &count, NULL);
     if (err == EFAULT)
-        return NULL;
-    for (uint32_t i = 0; i < count; i++)
+        return false;
+#endif
+    return true;
+}
+
+void StackCollector::sumValues(char *data, size_t cpu_val_size, int nr_cpus, uint64_t *v)
+{
+    uint64_t cpu_vals[scale_num];
+    count_values(data, v);
+    // 累加其余CPU上的计数
+    for (int cpu = 1; cpu < nr_cpus; cpu++)
     {
-        CountItem d(keys[i], count_values(vals + val_size * i));
-        D->insert(std::lower_bound(D->begin(), D->end(), d), d);
+        count_values(data + cpu_val_size * cpu, cpu_vals);
+        for (int j = 0; j < scale_num; j++)
+            v[j] += cpu_vals[j];
     }
-    delete[] keys;
-    delete[] vals;
-#endif
-    return D;
-};
+}
 
-StackCollector::operator std::string()
+bool StackCollector::readCountMap(uint32_t &count, size_t &cpu_val_size, int &nr_cpus)
 {
-    std::ostringstream oss;
-    oss << _RED "time:" << getLocalDateTime() << _RE "\n";
-    std::map<int32_t, std::vector<std::string>> traces;
-    std::map<uint32_t, task_info> infos;
+    auto psid_count_map = bpf_object__find_map_by_name(obj, "psid_count_map");
+    // 每CPU表的值由各CPU的值组成，每个值按8字节对齐
+    cpu_val_size = bpf_map__value_size(psid_count_map);
+    nr_cpus = 1;
+    if (percpu_count)
+    {
+        cpu_val_size = (cpu_val_size + 7) & ~(size_t)7;
+        nr_cpus = libbpf_num_possible_cpus();
+    }
+    size_t val_size = cpu_val_size * nr_cpus;
+    late_keys.clear();
+    late_vals.clear();
+    if (!showDelta || !count_idx)
+    {
+        if (!readMap(psid_count_map, showDelta, count, val_size))
+            return false;
+        fill_ratio = (double)count / bpf_map__max_entries(psid_count_map);
+        return true;
+    }
 
-    oss << _BLUE "counts:" _RE "\n";
+    auto psid_count_map_b = bpf_object__find_map_by_name(obj, "psid_count_map_b");
+    uint32_t idx = __atomic_load_n(count_idx, __ATOMIC_RELAXED);
+    auto retiring = idx ? psid_count_map_b : psid_count_map;
+    auto idle = idx ? psid_count_map : psid_count_map_b;
+    // 空闲的表上次翻转时只读取未清空，此后已空闲一个周期，翻转时仍在执行的eBPF程序早已结束。
+    // 清空前再读一次，与上次读出的值之差即迟到的写入，计入本周期
+    if (!readMap(idle, true, count, val_size))
+        return false;
+    uint64_t v[scale_num];
+    for (uint32_t i = 0; i < count; i++)
     {
-        auto D = sortedCountList();
-        if (!D)
-            return oss.str();
-        if ((*D).size() > top)
+        sumValues(val_buf.data() + val_size * i, cpu_val_size, nr_cpus, v);
+        auto it = std::lower_bound(snap_keys.begin(), snap_keys.end(), key_buf[i]);
+        if (it != snap_keys.end() && !(key_buf[i] < *it))
         {
-            auto end = (*D).end();
-            auto begin = end - top;
-            for (auto i = (*D).begin(); i < begin; i++)
-                delete i->v;
-            (*D).assign(begin, end);
+            const uint64_t *old = snap_vals.data() + (it - snap_keys.begin()) * scale_num;
+            for (int j = 0; j < scale_num; j++)
+                v[j] -= old[j];
         }
-        oss << _GREEN "pid\tusid\tksid";
-        for (int i = 0; i < scale_num; i++)
-            oss << '\t' << scales[i].Type << "/" << scales[i].Period << scales[i].Unit;
-        oss << _RE "\n";
-        uint64_t trace[MAX_STACKS], *p;
-        for (auto &i : *D)
+        if (std::any_of(v, v + scale_num, [](uint64_t x)
+                        { return x != 0; }))
         {
-            auto &id = i.k;
-            oss << id.pid << '\t' << id.usid << '\t' << id.ksid;
+            late_keys.push_back(key_buf[i]);
+            late_vals.insert(late_vals.end(), v, v + scale_num);
+        }
+    }
+    // 翻转双缓冲，eBPF程序此后写入刚清空的表，而用户态读取退下的表，
+    // 退下的表只读取不清空，其后的写入留到下次翻转时取出
+    __atomic_store_n(count_idx, !idx, __ATOMIC_RELEASE);
+    if (!readMap(retiring, false, count, val_size))
+        return false;
+    fill_ratio = (double)count / bpf_map__max_entries(retiring);
+    return true;
+}
+
+bool StackCollector::sortedCountList(std::vector<CountItem> &D)
+{
+    uint32_t count = 0;
+    int nr_cpus = 1;
+    size_t cpu_val_size = drain();
+    bool flipped = !cpu_val_size && showDelta && count_idx;
+    if (cpu_val_size)
+        count = key_buf.size();
+    else if (!readCountMap(count, cpu_val_size, nr_cpus))
+        return false;
+    size_t val_size = cpu_val_size * nr_cpus;
+    size_t late = flipped ? late_keys.size() : 0;
+    val_arena.resize(((size_t)count + late) * scale_num);
+    D.clear();
+    D.reserve(count + late);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t *v = val_arena.data() + (size_t)i * scale_num;
+        sumValues(val_buf.data() + val_size * i, cpu_val_size, nr_cpus, v);
+        D.emplace_back(key_buf[i], v);
+    }
+    if (flipped)
+    {
+        // 记下退下的表本次读出的值，按键排序，供下次翻转时求迟到的写入
+        std::vector<uint32_t> order(count);
+        for (uint32_t i = 0; i < count; i++)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b)
+                  { return key_buf[a] < key_buf[b]; });
+        snap_keys.resize(count);
+        snap_vals.resize((size_t)count * scale_num);
+        for (uint32_t k = 0; k < count; k++)
+        {
+            snap_keys[k] = key_buf[order[k]];
+            std::copy(D[order[k]].v, D[order[k]].v + scale_num, snap_vals.begin() + (size_t)k * scale_num);
+        }
+        // 上个周期迟到的写入并入本周期的计数
+        for (size_t m = 0; m < late; m++)
+        {
+            const uint64_t *add = late_vals.data() + m * scale_num;
+            auto it = std::lower_bound(snap_keys.begin(), snap_keys.end(), late_keys[m]);
+            uint64_t *v;
+            if (it != snap_keys.end() && !(late_keys[m] < *it))
+                v = D[order[it - snap_keys.begin()]].v;
+            else
             {
-                auto &v = i.v;
-                for (int i = 0; i < scale_num; i++)
-                    oss << '\t' << v[i];
-                delete v;
+                v = val_arena.data() + (size_t)D.size() * scale_num;
+                std::fill(v, v + scale_num, 0);
+                D.emplace_back(late_keys[m], v);
             }
-            oss << '\n';
-            auto trace_fd = bpf_object__find_map_fd_by_name(obj, "sid_trace_map");
-            if (id.usid > 0 && traces.find(id.usid) == traces.end())
+            for (int j = 0; j < scale_num; j++)
+                v[j] += add[j];
+        }
+    }
+    if (per_cgroup)
+        selectTopCountsPerCgroup(D, top);
+    else
+        selectTopCounts(D, top);
+    return true;
+};
+
+bool StackCollector::collect(Report &R)
+{
+    if (!gather(R))
+        return false;
+    symbolize(R);
+    return true;
+}
+
+bool StackCollector::gather(Report &R)
+{
+    R.time = getLocalDateTime();
+    R.name = getName();
+    R.scales = scales;
+    R.scale_num = scale_num;
+    R.counts.clear();
+    R.traces.clear();
+    R.infos.clear();
+    R.cgroups.clear();
+    R.wakes.clear();
+    R.funcs.clear();
+    R.hists.clear();
+    R.cgroup_paths.clear();
+    if (!sortedCountList(R.counts))
+        return false;
+    if (!wake_edges.empty())
+    {
+        // 唤醒关系同样只保留阻塞总时长最大的top项
+        auto less = [](const WakeEdge &a, const WakeEdge &b)
+        { return a.time < b.time; };
+        if (top && wake_edges.size() > top)
+        {
+            auto begin = wake_edges.end() - top;
+            std::nth_element(wake_edges.begin(), begin, wake_edges.end(), less);
+            wake_edges.erase(wake_edges.begin(), begin);
+        }
+        std::sort(wake_edges.begin(), wake_edges.end(), less);
+        R.wakes.swap(wake_edges);
+    }
+
+    R.rate = freq;
+    {
+        // 汇总各CPU上频率限制的统计，显示变化量时给出本周期的值
+        int nr_cpus = libbpf_num_possible_cpus();
+        std::vector<sample_stat> stats(std::max(nr_cpus, 1));
+        uint32_t zero = 0;
+        auto stat_fd = bpf_object__find_map_fd_by_name(obj, "sample_stat_map");
+        if (nr_cpus > 0 && !bpf_map_lookup_elem(stat_fd, &zero, stats.data()))
+        {
+            sample_stat sum = {0, 0};
+            for (int cpu = 0; cpu < nr_cpus; cpu++)
             {
-                syms = syms_cache__get_syms(syms_cache, id.pid);
-                if (!syms)
-                    fprintf(stderr, "failed to get syms\n");
-                else
-                {
-                    bpf_map_lookup_elem(trace_fd, &id.usid, trace);
-                    for (p = trace + MAX_STACKS - 1; !*p; p--)
-                        ;
-                    std::vector<std::string> sym_trace(p - trace + 1);
-                    for (int i = 0; p >= trace; p--)
-                    {
-                        struct sym *sym = syms__map_addr(syms, *p);
-                        if (sym)
-                        {
-                            if (sym->name[0] == '_' && sym->name[1] == 'Z')
-                            {
-                                char *demangled = abi::__cxa_demangle(sym->name, NULL, NULL, NULL);
-                                if (demangled)
-                                {
-                                    clearSpace(demangled);
-                                    sym->name = demangled;
-                                }
-                            }
-                            sym_trace[i++] = std::string(sym->name) + "+" + std::to_string(sym->offset);
-                        }
-                        else
-                            sym_trace[i++] = "[unknown]";
-                    }
-                    traces[id.usid] = sym_trace;
-                }
+                sum.seen += stats[cpu].seen;
+                sum.taken += stats[cpu].taken;
             }
-            if (id.ksid > 0 && traces.find(id.ksid) == traces.end())
+            R.sample_seen = sum.seen;
+            R.sample_taken = sum.taken;
+            if (showDelta)
             {
-                bpf_map_lookup_elem(trace_fd, &id.ksid, trace);
-                for (p = trace + MAX_STACKS - 1; !*p; p--)
-                    ;
-                std::vector<std::string> sym_trace(p - trace + 1);
-                for (int i = 0; p >= trace; p--)
-                {
-                    const struct ksym *ksym = ksyms__map_addr(ksyms, *p);
-                    sym_trace[i++] = ksym ? std::string(ksym->name) + "+" + std::to_string(*p - ksym->addr)
-                                          : "[unknown]";
-                }
-                traces[id.ksid] = sym_trace;
+                R.sample_seen -= last_stat.seen;
+                R.sample_taken -= last_stat.taken;
+                last_stat = sum;
             }
-            auto info_fd = bpf_object__find_map_fd_by_name(obj, "pid_info_map");
-            task_info info;
-            bpf_map_lookup_elem(info_fd, &id.pid, &info);
-            infos[id.pid] = info;
         }
-        delete D;
     }
+    if (stack_depth && stack_lookups)
+    {
+        R.stack_lookups = __atomic_load_n(stack_lookups, __ATOMIC_RELAXED);
+        R.stack_collisions = __atomic_load_n(stack_collisions, __ATOMIC_RELAXED);
+    }
+    annotate(R);
+    if (per_cgroup)
+        for (auto &i : R.counts)
+        {
+            auto path = cgroups.find(i.k.cgid);
+            if (path != cgroups.end())
+                R.cgroup_paths.insert(*path);
+        }
+    return true;
+}
 
-    oss << _BLUE "traces:" _RE "\n";
+void StackCollector::symbolize(Report &R)
+{
+    // 共用栈表时栈id在各采集器间一致，已解析的调用栈可直接复用
+    TraceMemo &memo = shared ? shared->memo : this->memo;
+    symbolizer.prune(memo);
+    stack_trace st;
+    uint64_t *trace = st.ips;
+    auto trace_fd = bpf_object__find_map_fd_by_name(obj, stack_depth ? "sid_stack_map" : "sid_trace_map");
+    auto info_fd = bpf_object__find_map_fd_by_name(obj, "pid_info_map");
+    auto cgroup_fd = bpf_object__find_map_fd_by_name(obj, "tgid_cgroup_map");
+    /// 读取栈表中的一条调用栈，返回其深度
+    auto read_trace = [&](int32_t sid) -> int
     {
-        oss << _GREEN "sid\ttrace" _RE "\n";
-        for (auto i : traces)
+        if (stack_depth)
+        {
+            // 按哈希去重的栈表中，值的大小随栈深度而定，其后的部分不会被写入
+            if (bpf_map_lookup_elem(trace_fd, &sid, &st))
+                return 0;
+            return (int)std::min(st.nr, stack_depth);
+        }
+        if (bpf_map_lookup_elem(trace_fd, &sid, trace))
+            return 0;
+        int n = MAX_STACKS;
+        while (n > 0 && !trace[n - 1])
+            n--;
+        return n;
+    };
+    struct PendingUser
+    {
+        int32_t usid;
+        std::vector<uint64_t> ips;
+    };
+    std::unordered_map<uint32_t, std::vector<PendingUser>> pending;
+    /// 读取一个计数键对应的线程信息和调用栈
+    auto resolve = [&](const psid &id)
+    {
+        auto res = R.infos.emplace(id.pid, task_info{0});
+        auto &info = res.first->second;
+        if (res.second)
+        {
+            bpf_map_lookup_elem(info_fd, &id.pid, &info);
+            if (R.cgroups.find(info.tgid) == R.cgroups.end())
+            {
+                char group[CONTAINER_ID_LEN] = {0};
+                bpf_map_lookup_elem(cgroup_fd, &info.tgid, &group);
+                R.cgroups[info.tgid] = group;
+            }
+        }
+        if (id.usid > 0 && R.traces.find(id.usid) == R.traces.end())
+        {
+            // 用户栈的符号取决于进程的地址空间，按tgid解析
+            uint32_t tgid = info.tgid ? info.tgid : id.pid;
+            auto t = symbolizer.findUser(memo, tgid, id.usid);
+            if (!t)
+            {
+                int n = localTrace(id.usid, trace);
+                if (n < 0)
+                    n = read_trace(id.usid);
+                pending[tgid].push_back({id.usid, std::vector<uint64_t>(trace, trace + n)});
+            }
+            // 未命中的用户栈先占位，收集完后按进程统一解析
+            R.traces[id.usid] = t;
+        }
+        if (id.ksid > 0 && R.traces.find(id.ksid) == R.traces.end())
         {
-            oss << i.first << "\t";
-            for (auto s : i.second)
-                oss << s << ';';
-            oss << "\n";
+            auto t = symbolizer.findKernel(memo, id.ksid);
+            if (!t)
+                t = symbolizer.addKernel(memo, id.ksid, trace, read_trace(id.ksid));
+            R.traces[id.ksid] = t;
         }
+    };
+    for (auto &i : R.counts)
+        resolve(i.k);
+    for (auto &i : R.wakes)
+    {
+        resolve(i.wakee);
+        if (i.waker.pid || i.waker.ksid || i.waker.usid)
+            resolve(i.waker);
     }
-
-    oss << _BLUE "info:" _RE "\n";
+    for (auto &p : pending)
     {
-        oss << _GREEN "pid\tNSpid\tcomm\ttgid\tcgroup\t" _RE "\n";
-        for (auto i : infos)
+        if (symbolizer.inlines)
         {
-            auto cgroup_fd = bpf_object__find_map_fd_by_name(obj, "tgid_cgroup_map");
-            char group[CONTAINER_ID_LEN];
-            bpf_map_lookup_elem(cgroup_fd, &(i.second.tgid), &group);
-            oss << i.first << '\t'
-                << i.second.pid << '\t'
-                << i.second.comm << '\t'
-                << i.second.tgid << '\t'
-                << group << '\n';
+            // 展开内联函数的解析开销较大，同一进程本周期的全部地址合并为一次调用
+            std::vector<const std::vector<uint64_t> *> stacks;
+            for (auto &u : p.second)
+                stacks.push_back(&u.ips);
+            symbolizer.prefetch(p.first, stacks);
         }
+        for (auto &u : p.second)
+            R.traces[u.usid] = symbolizer.addUser(memo, p.first, u.usid, u.ips.data(), u.ips.size());
     }
+}
+
+StackCollector::operator std::string()
+{
+    Report R;
+    // 读取失败时报告中只有时间，各部分为空
+    collect(R);
+    return renderText(R);
+}
 
-    oss << _BLUE "OK" _RE "\n";
+uint64_t StackCollector::progRunTime(void)
+{
+    uint64_t total = 0;
+    struct bpf_program *prog;
+    bpf_object__for_each_program(prog, obj)
+    {
+        int fd = bpf_program__fd(prog);
+        if (fd < 0)
+            continue;
+        struct bpf_prog_info info = {};
+        uint32_t len = sizeof(info);
+        if (!bpf_prog_get_info_by_fd(fd, &info, &len))
+            total += info.run_time_ns;
+    }
+    return total;
+}
+
+void StackCollector::setRate(uint32_t f)
+{
+    freq = f;
+    if (cur_freq)
+        __atomic_store_n(cur_freq, f, __ATOMIC_RELAXED);
+}
+
+int StackCollector::setCgroups(const std::map<uint64_t, std::string> &ids)
+{
+    int fd = bpf_object__find_map_fd_by_name(obj, "cgroup_set_map");
+    if (fd < 0)
+        return fd;
+    for (auto &i : cgroups)
+        if (!ids.count(i.first))
+            bpf_map_delete_elem(fd, &i.first);
+    __u8 one = 1;
+    for (auto &i : ids)
+        if (bpf_map_update_elem(fd, &i.first, &one, BPF_ANY))
+            return -errno;
+    cgroups = ids;
+    return 0;
+}
+
+void StackCollector::adaptRate(double overhead, double budget)
+{
+    if (!freq || !init_freq)
+        return;
+    double scale = 1;
+    if (overhead > budget)
+        // 按超出预算的比例降低，单次至多降为1/4
+        scale = std::max(budget / overhead, 0.25);
+    else if (overhead < budget / 2)
+        scale = 1.25;
+    // 计数表将满时新的调用栈会被丢弃，优先降低频率
+    if (fill_ratio > RATE_FILL_HIGH)
+        scale = std::min(scale, 0.5);
+    else if (fill_ratio > RATE_FILL_LOW)
+        scale = std::min(scale, 1.0);
+    double f = scale > 1 ? ceil(freq * scale) : floor(freq * scale);
+    f = std::min(std::max(f, std::max(1.0, (double)init_freq / RATE_RANGE)),
+                 (double)init_freq * RATE_RANGE);
+    if ((uint32_t)f != freq)
+        setRate((uint32_t)f);
+}
+
+std::string StackCollector::progStats(void)
+{
+    std::ostringstream oss;
+    struct bpf_program *prog;
+    bpf_object__for_each_program(prog, obj)
+    {
+        int fd = bpf_program__fd(prog);
+        if (fd < 0)
+            continue;
+        struct bpf_prog_info info = {};
+        uint32_t len = sizeof(info);
+        if (bpf_prog_get_info_by_fd(fd, &info, &len) || !info.run_cnt)
+            continue;
+        oss << getName() << '\t' << bpf_program__name(prog) << '\t'
+            << info.run_cnt << '\t' << info.run_time_ns / info.run_cnt << '\n';
+    }
     return oss.str();
 }
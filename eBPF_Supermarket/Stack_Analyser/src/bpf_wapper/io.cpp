@@ -17,20 +17,55 @@
 // io ebpf程序的包装类，实现接口和一些自定义方法
 
 #include "bpf_wapper/io.h"
+#include "trace.h"
 
-uint64_t *IOStackCollector::count_values(void *data)
+#include <bpf/bpf.h>
+
+// fd类型的名称，作为最上层的栈帧输出
+static const char *const type_names[IO_FD_TYPES] = {
+    "[other]", "[file]", "[socket]", "[pipe]", "[eventfd]"};
+// 判断fd类型时比较的file_operations符号，为NULL的类型按inode类型判断
+static const char *const type_fops[IO_FD_TYPES] = {
+    NULL, NULL, "socket_file_ops", "pipefifo_fops", "eventfd_fops"};
+
+void IOStackCollector::count_values(void *data, uint64_t *vals)
 {
     io_tuple *p = (io_tuple *)data;
-    return new uint64_t[scale_num]{
-        p->size,
-        p->count,
-    };
+    vals[0] = p->lat;
+    vals[1] = p->size;
+    vals[2] = p->count;
+};
+
+void IOStackCollector::annotate(Report &R)
+{
+    auto hist_fd = bpf_map__fd(skel->maps.type_hist_map);
+    io_hist h;
+    for (uint32_t fid = 1; fid <= IO_FD_TYPES; fid++)
+    {
+        R.funcs[fid] = type_names[fid - 1];
+        if (bpf_map_lookup_elem(hist_fd, &fid, &h))
+            continue;
+        // 直方图在eBPF程序中只累加，显示变化量时减去上次读取的值
+        auto &last = last_hists[fid - 1];
+        std::vector<uint64_t> slots(IO_HIST_SLOTS);
+        bool empty = true;
+        for (int i = 0; i < IO_HIST_SLOTS; i++)
+        {
+            slots[i] = showDelta ? h.slots[i] - last.slots[i] : h.slots[i];
+            empty = empty && !slots[i];
+        }
+        last = h;
+        if (!empty)
+            R.hists[fid].swap(slots);
+    }
 };
 
 IOStackCollector::IOStackCollector()
 {
-    scale_num = 2;
+    percpu_capable = true;
+    scale_num = 3;
     scales = new Scale[scale_num]{
+        {"IOTime", 1, "nanoseconds"},
         {"IOSize", 1, "bytes"},
         {"IOCount", 1, "counts"},
     };
@@ -38,7 +73,19 @@ IOStackCollector::IOStackCollector()
 
 int IOStackCollector::ready(void)
 {
-    EBPF_LOAD_OPEN_INIT();
+    // io_uring跟踪点在5.19后才带有请求的地址，用于配对提交和完成
+    bool uring = tracepoint_exists("io_uring", "io_uring_submit_req") &&
+                 tracepoint_exists("io_uring", "io_uring_complete");
+    EBPF_LOAD_OPEN_INIT(
+        for (int i = 0; i < IO_FD_TYPES; i++) {
+            const struct ksym *ksym = type_fops[i] ? ksyms__get_symbol(ksyms, type_fops[i]) : NULL;
+            skel->rodata->type_fops[i] = ksym ? ksym->addr : 0;
+        }
+        bpf_program__set_autoload(skel->progs.uring_submit, uring);
+        bpf_program__set_autoload(skel->progs.uring_complete, uring);
+        if (!uring) {
+            bpf_map__set_max_entries(skel->maps.uring_starts, 1);
+        });
     ATTACH_PROTO;
     return 0;
 }
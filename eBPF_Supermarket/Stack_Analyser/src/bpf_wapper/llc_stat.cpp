@@ -27,14 +27,12 @@ extern "C"
 
 // ========== implement virtual func ==========
 
-uint64_t *LlcStatStackCollector::count_values(void *data)
+void LlcStatStackCollector::count_values(void *data, uint64_t *vals)
 {
 	auto p = (llc_stat *)data;
-	return new uint64_t[scale_num]{
-		p->miss,
-		p->ref,
-		p->ref * 100 / (p->miss + p->ref),
-	};
+	vals[0] = p->miss;
+	vals[1] = p->ref;
+	vals[2] = p->ref * 100 / (p->miss + p->ref);
 };
 
 int LlcStatStackCollector::ready(void)
@@ -20,13 +20,23 @@
 #include "trace.h"
 #include <cmath>
 
-uint64_t *MemleakStackCollector::count_values(void *d)
+void MemleakStackCollector::count_values(void *d, uint64_t *vals)
 {
     auto data = (combined_alloc_info *)d;
-    return new uint64_t[scale_num]{
-        data->total_size,
-        data->number_of_allocs,
-    };
+    vals[0] = data->total_size;
+    vals[1] = data->number_of_allocs;
+    if (sample_bytes && vals[1])
+    {
+        // 大小为s的分配被采样的概率为1-exp(-s/N)，以该调用栈的平均大小近似每次分配的大小，
+        // 按概率的倒数还原泄漏的字节数和次数
+        double mean = (double)vals[0] / vals[1];
+        if (mean > 0)
+        {
+            double w = 1 / -expm1(-mean / sample_bytes);
+            vals[0] = vals[0] * w;
+            vals[1] = vals[1] * w;
+        }
+    }
 }
 
 MemleakStackCollector::MemleakStackCollector()
@@ -121,6 +131,7 @@ int MemleakStackCollector::ready(void)
                 disable_kernel_percpu_tracepoints(skel);
         } else disable_kernel_tracepoints(skel);
         skel->rodata->wa_missing_free = wa_missing_free;
+        skel->rodata->sample_bytes = sample_bytes;
         skel->rodata->page_size = sysconf(_SC_PAGE_SIZE););
     if (!kstack)
         CHECK_ERR_RN1(attach_uprobes(skel), "failed to attach uprobes");
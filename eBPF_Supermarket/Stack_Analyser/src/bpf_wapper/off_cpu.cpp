@@ -18,6 +18,8 @@
 
 #include "bpf_wapper/off_cpu.h"
 #include "trace.h"
+#include "worker.h"
+#include <sys/epoll.h>
 
 OffCPUStackCollector::OffCPUStackCollector()
 {
@@ -27,26 +29,111 @@ OffCPUStackCollector::OffCPUStackCollector()
     };
 };
 
-uint64_t *OffCPUStackCollector::count_values(void *data)
+void OffCPUStackCollector::count_values(void *data, uint64_t *vals)
 {
-    return new uint64_t[scale_num]{
-        *(uint32_t *)data,
-    };
+    // 流式采集的计数由用户态以纳秒聚合
+    vals[0] = stream ? *(uint64_t *)data : *(uint32_t *)data;
 };
 
+int OffCPUStackCollector::handle_event(void *ctx, void *data, size_t size)
+{
+    auto self = (OffCPUStackCollector *)ctx;
+    auto e = (offcpu_event *)data;
+    std::lock_guard<std::mutex> lock(self->acc_mutex);
+    self->acc_counts[e->wakee] += e->delta;
+    auto &w = self->acc_wakes[std::make_pair(e->waker, e->wakee)];
+    w.first++;
+    w.second += e->delta;
+    return 0;
+}
+
+size_t OffCPUStackCollector::drain(void)
+{
+    if (!rb)
+        return 0;
+    // 未达到唤醒阈值的事件仍留在缓冲区中，读取计数前先全部取出
+    {
+        std::lock_guard<std::mutex> lock(rb_mutex);
+        ring_buffer__consume(rb);
+    }
+    uint64_t lost = __atomic_load_n(&skel->bss->__stream_lost, __ATOMIC_RELAXED);
+    if (lost > reported_lost)
+    {
+        fprintf(stderr, _ERED "%s lost %lu events for full ring buffer.\n" _RE,
+                getName(), lost - reported_lost);
+        reported_lost = lost;
+    }
+    std::lock_guard<std::mutex> lock(acc_mutex);
+    key_buf.clear();
+    val_buf.clear();
+    wake_edges.clear();
+    for (auto &i : acc_counts)
+    {
+        key_buf.push_back(i.first);
+        auto v = (const char *)&i.second;
+        val_buf.insert(val_buf.end(), v, v + sizeof(uint64_t));
+    }
+    for (auto &i : acc_wakes)
+        wake_edges.push_back({i.first.first, i.first.second, i.second.first, i.second.second});
+    if (showDelta)
+    {
+        acc_counts.clear();
+        acc_wakes.clear();
+    }
+    return sizeof(uint64_t);
+}
+
 int OffCPUStackCollector::ready(void)
 {
-    EBPF_LOAD_OPEN_INIT();
+    EBPF_LOAD_OPEN_INIT(
+        skel->rodata->stream = stream;
+        if (stream)
+            scales[0].Period = 1;
+        else {
+            bpf_program__set_autoload(skel->progs.do_wakeup, false);
+            bpf_map__set_max_entries(skel->maps.offcpu_events, getpagesize());
+        });
     const char *name = "finish_task_switch";
     const struct ksym *ksym = ksyms__find_symbol(ksyms, name);
     if (!ksym)
         return -1;
     skel->links.do_stack = bpf_program__attach_kprobe(skel->progs.do_stack, false, ksym->name);
+    if (stream)
+    {
+        skel->links.do_wakeup = bpf_program__attach(skel->progs.do_wakeup);
+        CHECK_ERR_RN1(!skel->links.do_wakeup, "Failed to attach sched_waking");
+        rb = ring_buffer__new(bpf_map__fd(skel->maps.offcpu_events), handle_event, this, NULL);
+        CHECK_ERR_RN1(!rb, "Failed to create ring buffer");
+        // eBPF程序只在缓冲区积累较多数据时唤醒，不唤醒时poll超时也不会取出事件，
+        // 因此每次等待结束后都主动取出缓冲区中的全部事件
+        consuming = true;
+        SignalBlocker blocker;
+        consumer = std::thread([this]
+                               {
+            int efd = ring_buffer__epoll_fd(rb);
+            struct epoll_event ev;
+            while (consuming)
+            {
+                epoll_wait(efd, &ev, 1, OFFCPU_STREAM_POLL_MS);
+                std::lock_guard<std::mutex> lock(rb_mutex);
+                ring_buffer__consume(rb);
+            } });
+    }
     return 0;
 }
 
 void OffCPUStackCollector::finish(void)
 {
+    if (consumer.joinable())
+    {
+        consuming = false;
+        consumer.join();
+    }
+    if (rb)
+    {
+        ring_buffer__free(rb);
+        rb = NULL;
+    }
     DETACH_PROTO;
     UNLOAD_PROTO;
 }
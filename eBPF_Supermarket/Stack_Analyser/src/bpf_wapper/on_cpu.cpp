@@ -19,6 +19,15 @@
 #include "bpf_wapper/on_cpu.h"
 #include <sys/syscall.h>
 #include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unordered_set>
+
+// 本地栈表中的探测次数，与eBPF程序中的STACK_PROBES相同
+#define USTACK_PROBES 4
 
 /// @brief staring perf event
 /// @param hw_event attribution of the perf event
@@ -40,6 +49,7 @@ extern "C"
 
 OnCPUStackCollector::OnCPUStackCollector()
 {
+    percpu_capable = true;
     scale_num = 1;
     scales = new Scale[scale_num]{
         {"OnCPUTime", (uint64_t)(1e9 / freq), "nanoseconds"},
@@ -52,16 +62,201 @@ void OnCPUStackCollector::setScale(uint64_t freq)
     scales->Period = 1e9 / freq;
 }
 
-uint64_t *OnCPUStackCollector::count_values(void *data)
+void OnCPUStackCollector::setRate(uint32_t f)
 {
-    return new uint64_t[scale_num]{
-        *(uint32_t *)data,
-    };
+    // 采样由perf事件按频率触发，频率模式下PERF_EVENT_IOC_PERIOD设置的是采样频率
+    uint64_t sample_freq = f;
+    for (int i = 0; pefds && i < num_cpus; i++)
+        if (pefds[i] >= 0)
+            ioctl(pefds[i], PERF_EVENT_IOC_PERIOD, &sample_freq);
+    setScale(f);
+}
+
+void OnCPUStackCollector::count_values(void *data, uint64_t *vals)
+{
+    // 在用户态回溯时计数由用户态聚合
+    vals[0] = ustack_bytes ? *(uint64_t *)data : *(uint32_t *)data;
 };
 
+int OnCPUStackCollector::handle_event(void *ctx, void *data, size_t size)
+{
+    auto self = (OnCPUStackCollector *)ctx;
+    auto s = (ustack_sample *)data;
+    if (size < offsetof(ustack_sample, stack))
+        return 0;
+    size_t len = std::min((size_t)s->size, size - offsetof(ustack_sample, stack));
+    // 回调返回后数据即被释放，先复制出来，整批取完后再回溯
+    self->batch.push_back({s->id, s->tgid, (uint32_t)len, s->ip, s->sp, s->fp, s->lr, self->arena.size()});
+    self->arena.insert(self->arena.end(), s->stack, s->stack + len);
+    return 0;
+}
+
+int32_t OnCPUStackCollector::internStack(uint32_t tgid, const uint64_t *ips, int nr)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ BPF_F_USER_STACK;
+    for (int i = 0; i < nr; i++)
+        h = (h ^ ips[i]) * 0x100000001b3ULL;
+    std::lock_guard<std::mutex> lock(ustack_mutex);
+    for (uint32_t p = 0; p < USTACK_PROBES; p++)
+    {
+        int32_t k = (((h >> 32) + p) % 0x7fffffff) + 1;
+        auto it = ustacks.find(k);
+        if (it == ustacks.end())
+        {
+            if (ustacks.size() >= MAX_ENTRIES)
+                return -12 /* -ENOMEM */;
+            ustacks.emplace(k, UStack{std::vector<uint64_t>(ips, ips + nr), {tgid}});
+            return k;
+        }
+        auto &u = it->second;
+        if (u.ips.size() == (size_t)nr && std::equal(ips, ips + nr, u.ips.begin()))
+        {
+            if (std::find(u.tgids.begin(), u.tgids.end(), tgid) == u.tgids.end())
+                u.tgids.push_back(tgid);
+            return k;
+        }
+    }
+    return -17 /* -EEXIST */;
+}
+
+void OnCPUStackCollector::pruneStacks(void)
+{
+    // 本次取走的计数仍要按栈id解析，其中的栈保留到下次
+    std::unordered_set<int32_t> used;
+    for (auto &k : key_buf)
+        used.insert(k.usid);
+    std::unordered_map<uint32_t, bool> exited;
+    std::lock_guard<std::mutex> lock(ustack_mutex);
+    for (auto it = ustacks.begin(); it != ustacks.end();)
+    {
+        auto &t = it->second.tgids;
+        t.erase(std::remove_if(t.begin(), t.end(), [&exited](uint32_t tgid)
+                               {
+            auto res = exited.emplace(tgid, false);
+            if (res.second)
+                res.first->second = kill(tgid, 0) && errno == ESRCH;
+            return res.first->second; }),
+                t.end());
+        if (t.empty() && !used.count(it->first))
+            it = ustacks.erase(it);
+        else
+            ++it;
+    }
+}
+
+int OnCPUStackCollector::localTrace(int32_t sid, uint64_t *ips)
+{
+    if (!ustack_bytes)
+        return -1;
+    std::lock_guard<std::mutex> lock(ustack_mutex);
+    auto it = ustacks.find(sid);
+    if (it == ustacks.end())
+        return -1;
+    auto &u = it->second.ips;
+    size_t n = std::min(u.size(), (size_t)MAX_STACK_DEPTH);
+    std::copy(u.begin(), u.begin() + n, ips);
+    return n;
+}
+
+void OnCPUStackCollector::unwindBatch(void)
+{
+    size_t n = batch.size();
+    size_t chunk = (n + unwind_threads - 1) / unwind_threads;
+    int depth = stack_depth ? stack_depth : MAX_STACKS;
+    for (size_t b = 0; b < n; b += chunk)
+    {
+        size_t e = std::min(n, b + chunk);
+        unwind_pool->submit([this, b, e, depth]
+                            {
+            std::map<psid, uint64_t> local;
+            uint64_t ips[MAX_STACK_DEPTH];
+            for (size_t i = b; i < e; i++)
+            {
+                auto &s = batch[i];
+                UnwindInput in = {s.ip, s.sp, s.fp, s.lr, arena.data() + s.off, s.size};
+                int nr = unwinder.unwind(s.tgid, in, ips, depth);
+                psid id = s.id;
+                id.usid = nr > 0 ? internStack(s.tgid, ips, nr) : -14 /* -EFAULT */;
+                local[id]++;
+            }
+            std::lock_guard<std::mutex> lock(acc_mutex);
+            for (auto &i : local)
+                acc_counts[i.first] += i.second; });
+    }
+    // 等待本批回溯完成再取下一批，回溯跟不上时由环形缓冲区丢弃采样
+    unwind_pool->wait();
+    batch.clear();
+    arena.clear();
+}
+
+void OnCPUStackCollector::consumeSamples(void)
+{
+    std::lock_guard<std::mutex> lock(rb_mutex);
+    ring_buffer__consume(rb);
+    if (!batch.empty())
+        unwindBatch();
+}
+
+size_t OnCPUStackCollector::drain(void)
+{
+    if (!rb)
+        return 0;
+    // 未达到唤醒阈值的采样仍留在缓冲区中，读取计数前先全部取出
+    consumeSamples();
+    uint64_t lost = __atomic_load_n(&skel->bss->__ustack_lost, __ATOMIC_RELAXED);
+    if (lost > reported_lost)
+    {
+        fprintf(stderr, _ERED "%s lost %lu samples for full ring buffer.\n" _RE,
+                getName(), lost - reported_lost);
+        reported_lost = lost;
+    }
+    unwinder.prune();
+    std::lock_guard<std::mutex> lock(acc_mutex);
+    key_buf.clear();
+    val_buf.clear();
+    for (auto &i : acc_counts)
+    {
+        key_buf.push_back(i.first);
+        auto v = (const char *)&i.second;
+        val_buf.insert(val_buf.end(), v, v + sizeof(uint64_t));
+    }
+    if (showDelta)
+        acc_counts.clear();
+    pruneStacks();
+    return sizeof(uint64_t);
+}
+
 int OnCPUStackCollector::ready(void)
 {
-    EBPF_LOAD_OPEN_INIT();
+    if (ustack_bytes > USTACK_MAX_BYTES)
+        ustack_bytes = USTACK_MAX_BYTES;
+    ustack_bytes &= ~7u;
+    if (!ustack)
+        ustack_bytes = 0;
+    EBPF_LOAD_OPEN_INIT(
+        skel->rodata->ustack_bytes = ustack_bytes;
+        if (!ustack_bytes)
+            bpf_map__set_max_entries(skel->maps.ustack_samples, getpagesize()););
+    if (ustack_bytes)
+    {
+        rb = ring_buffer__new(bpf_map__fd(skel->maps.ustack_samples), handle_event, this, NULL);
+        CHECK_ERR_RN1(!rb, "Failed to create ring buffer");
+        unwind_threads = std::max(1u, std::thread::hardware_concurrency() / 4);
+        unwind_pool = new WorkerPool(unwind_threads);
+        // eBPF程序只在缓冲区积累较多数据时唤醒，取出的采样整批交给线程池回溯；
+        // 唤醒不会到来时由等待超时兜底，超时后同样取出缓冲区中的全部采样
+        consuming = true;
+        SignalBlocker blocker;
+        consumer = std::thread([this]
+                               {
+            int efd = ring_buffer__epoll_fd(rb);
+            struct epoll_event ev;
+            while (consuming)
+            {
+                epoll_wait(efd, &ev, 1, ONCPU_UNWIND_POLL_MS);
+                consumeSamples();
+            } });
+    }
     bool *online_mask;
     int num_online_cpus;
     err = parse_cpu_mask_file("/sys/devices/system/cpu/online", &online_mask, &num_online_cpus);
@@ -116,6 +311,18 @@ int OnCPUStackCollector::ready(void)
 
 void OnCPUStackCollector::finish(void)
 {
+    if (consumer.joinable())
+    {
+        consuming = false;
+        consumer.join();
+    }
+    if (rb)
+    {
+        ring_buffer__free(rb);
+        rb = NULL;
+    }
+    delete unwind_pool;
+    unwind_pool = NULL;
     for (int i = 0; i < num_cpus; i++)
     {
         bpf_link__destroy(links[i]);
@@ -0,0 +1,272 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// pmu ebpf程序的包装类，实现接口和一些自定义方法
+
+#include "bpf_wapper/pmu.h"
+
+#include <sstream>
+#include <string.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <bpf/bpf.h>
+
+extern "C"
+{
+    extern int parse_cpu_mask_file(const char *fcpu, bool **mask, int *mask_sz);
+}
+
+static const struct
+{
+    const char *name;
+    uint64_t config;
+} hw_events[] = {
+    {"cycles", PERF_COUNT_HW_CPU_CYCLES},
+    {"cpu-cycles", PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-references", PERF_COUNT_HW_CACHE_REFERENCES},
+    {"cache-misses", PERF_COUNT_HW_CACHE_MISSES},
+    {"branches", PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-instructions", PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses", PERF_COUNT_HW_BRANCH_MISSES},
+    {"bus-cycles", PERF_COUNT_HW_BUS_CYCLES},
+    {"stalled-cycles-frontend", PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+    {"stalled-cycles-backend", PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+    {"ref-cycles", PERF_COUNT_HW_REF_CPU_CYCLES},
+};
+
+static const struct
+{
+    const char *name;
+    uint64_t id;
+} hw_caches[] = {
+    {"L1-dcache", PERF_COUNT_HW_CACHE_L1D},
+    {"L1-icache", PERF_COUNT_HW_CACHE_L1I},
+    {"LLC", PERF_COUNT_HW_CACHE_LL},
+    {"dTLB", PERF_COUNT_HW_CACHE_DTLB},
+    {"iTLB", PERF_COUNT_HW_CACHE_ITLB},
+    {"branch", PERF_COUNT_HW_CACHE_BPU},
+    {"node", PERF_COUNT_HW_CACHE_NODE},
+};
+
+static const struct
+{
+    const char *name;
+    uint64_t op, result;
+} hw_cache_ops[] = {
+    {"-loads", PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_ACCESS},
+    {"-load-misses", PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS},
+    {"-stores", PERF_COUNT_HW_CACHE_OP_WRITE, PERF_COUNT_HW_CACHE_RESULT_ACCESS},
+    {"-store-misses", PERF_COUNT_HW_CACHE_OP_WRITE, PERF_COUNT_HW_CACHE_RESULT_MISS},
+    {"-prefetches", PERF_COUNT_HW_CACHE_OP_PREFETCH, PERF_COUNT_HW_CACHE_RESULT_ACCESS},
+    {"-prefetch-misses", PERF_COUNT_HW_CACHE_OP_PREFETCH, PERF_COUNT_HW_CACHE_RESULT_MISS},
+};
+
+int parse_pmu_event(const std::string &spec, PmuEvent &e)
+{
+    e.name = spec;
+    for (auto &h : hw_events)
+        if (spec == h.name)
+        {
+            e.type = PERF_TYPE_HARDWARE;
+            e.config = h.config;
+            return 0;
+        }
+    for (auto &c : hw_caches)
+    {
+        size_t len = strlen(c.name);
+        if (spec.compare(0, len, c.name))
+            continue;
+        for (auto &op : hw_cache_ops)
+            if (spec.substr(len) == op.name)
+            {
+                e.type = PERF_TYPE_HW_CACHE;
+                e.config = c.id | (op.op << 8) | (op.result << 16);
+                return 0;
+            }
+    }
+    if (spec.size() > 1 && spec[0] == 'r' &&
+        spec.find_first_not_of("0123456789abcdefABCDEF", 1) == std::string::npos)
+    {
+        e.type = PERF_TYPE_RAW;
+        e.config = strtoull(spec.c_str() + 1, NULL, 16);
+        return 0;
+    }
+    return -1;
+}
+
+PmuStackCollector::PmuStackCollector()
+{
+    scale_num = 0;
+    scales = NULL;
+};
+
+void PmuStackCollector::count_values(void *data, uint64_t *vals)
+{
+    // 计数表不是每CPU的；值中只放可累加的事件数，比例留空，
+    // 以免迟到的写入相减时下溢，待合并完成后再由annotate计算
+    auto p = (pmu_count *)data;
+    size_t n = events.size();
+    for (size_t i = 0; i < n; i++)
+        vals[i] = p->vals[i];
+    std::fill(vals + n, vals + n + ratios.size(), 0);
+};
+
+void PmuStackCollector::annotate(Report &R)
+{
+    // 比例由合并了迟到写入后的各事件总数计算
+    size_t n = events.size();
+    for (auto &i : R.counts)
+        for (size_t j = 0; j < ratios.size(); j++)
+        {
+            auto &r = ratios[j];
+            uint64_t den = i.v[r.den];
+            i.v[n + j] = den ? i.v[r.num] * r.scale / den : 0;
+        }
+};
+
+void PmuStackCollector::setRate(uint32_t f)
+{
+    // 只有按频率采样时才调整，指定周期时采样数由事件的多少决定
+    if (period)
+        return;
+    uint64_t sample_freq = f;
+    for (int i = 0; pefds && i < num_cpus; i++)
+        if (pefds[i] >= 0)
+            ioctl(pefds[i], PERF_EVENT_IOC_PERIOD, &sample_freq);
+    StackCollector::setRate(f);
+}
+
+int PmuStackCollector::ready(void)
+{
+    events.clear();
+    ratios.clear();
+    std::istringstream ss(spec);
+    for (std::string s; std::getline(ss, s, ',');)
+    {
+        PmuEvent e;
+        CHECK_ERR_RN1(parse_pmu_event(s, e), "Unknown PMU event %s", s.c_str());
+        events.push_back(e);
+    }
+    CHECK_ERR_RN1(events.empty() || events.size() > MAX_PMU_EVENTS,
+                  "Need 1 to %d PMU events", MAX_PMU_EVENTS);
+    CHECK_ERR_RN1(!period && !freq, "PMU sampling needs a period or a frequency");
+
+    // 有指令数时给出各缺失事件的MPKI，有周期数时给出IPC
+    int ins = -1, cyc = -1;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        if (events[i].name == "instructions")
+            ins = i;
+        else if (events[i].name == "cycles" || events[i].name == "cpu-cycles")
+            cyc = i;
+    }
+    std::vector<Scale> sc;
+    for (auto &e : events)
+        sc.push_back({e.name, 1, "events"});
+    for (size_t i = 0; ins >= 0 && i < events.size(); i++)
+        if (events[i].name.find("miss") != std::string::npos)
+        {
+            // 放大1000倍存放，即每百万条指令的缺失数
+            ratios.push_back({(int)i, ins, 1000000});
+            sc.push_back({events[i].name + "-MPKI", 1, "thousandths"});
+        }
+    if (ins >= 0 && cyc >= 0)
+    {
+        ratios.push_back({ins, cyc, 1000});
+        sc.push_back({"IPC", 1, "thousandths"});
+    }
+    delete[] scales;
+    scale_num = sc.size();
+    scales = new Scale[scale_num];
+    std::copy(sc.begin(), sc.end(), scales);
+
+    bool *online_mask;
+    int num_online_cpus;
+    err = parse_cpu_mask_file("/sys/devices/system/cpu/online", &online_mask, &num_online_cpus);
+    CHECK_ERR_RN1(err, "Fail to get online CPU numbers");
+    num_cpus = libbpf_num_possible_cpus();
+    CHECK_ERR_RN1(num_cpus <= 0, "Fail to get the number of processors");
+
+    EBPF_LOAD_OPEN_INIT(
+        skel->rodata->nr_events = events.size();
+        skel->rodata->nr_cpus = num_cpus;
+        bpf_map__set_max_entries(skel->maps.pmu_events, events.size() * num_cpus));
+
+    // 组长按周期或频率采样，其余事件只计数，与组长同时被调度；
+    // 跟踪全部进程，由eBPF程序按tgid过滤，组内事件才能在采样时于当前CPU上读取
+    struct perf_event_attr attr;
+    pefds = (int *)malloc(events.size() * num_cpus * sizeof(int));
+    for (size_t i = 0; i < events.size() * num_cpus; i++)
+        pefds[i] = -1;
+    links = (struct bpf_link **)calloc(num_cpus, sizeof(struct bpf_link *));
+    int map_fd = bpf_map__fd(skel->maps.pmu_events);
+    for (int cpu = 0; cpu < num_cpus; cpu++)
+    {
+        if (cpu >= num_online_cpus || !online_mask[cpu])
+            continue;
+        int leader = -1;
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            memset(&attr, 0, sizeof(attr));
+            attr.type = events[i].type;
+            attr.size = sizeof(attr);
+            attr.config = events[i].config;
+            if (!i)
+            {
+                attr.freq = !period;
+                attr.sample_period = period ? period : freq;
+            }
+            int pefd = syscall(SYS_perf_event_open, &attr, -1, cpu, leader, 0);
+            CHECK_ERR_RN1(pefd < 0, "Fail to open PMU event %s on CPU %d", events[i].name.c_str(), cpu);
+            pefds[i * num_cpus + cpu] = pefd;
+            if (!i)
+                leader = pefd;
+            uint32_t key = i * num_cpus + cpu;
+            CHECK_ERR_RN1(bpf_map_update_elem(map_fd, &key, &pefd, BPF_ANY), "Fail to record PMU event");
+        }
+        links[cpu] = bpf_program__attach_perf_event(skel->progs.do_sample, leader);
+        CHECK_ERR_RN1(!links[cpu], "Fail to attach bpf program");
+    }
+    free(online_mask);
+    return 0;
+}
+
+void PmuStackCollector::finish(void)
+{
+    for (int cpu = 0; links && cpu < num_cpus; cpu++)
+        bpf_link__destroy(links[cpu]);
+    // 先关闭组员再关闭组长
+    for (int i = (int)events.size() * num_cpus - 1; pefds && i >= 0; i--)
+        if (pefds[i] >= 0)
+            close(pefds[i]);
+    free(links);
+    free(pefds);
+    links = NULL;
+    pefds = NULL;
+    UNLOAD_PROTO;
+}
+
+void PmuStackCollector::activate(bool tf)
+{
+    ACTIVE_SET(tf);
+}
+
+const char *PmuStackCollector::getName(void)
+{
+    return "PmuStackCollector";
+}
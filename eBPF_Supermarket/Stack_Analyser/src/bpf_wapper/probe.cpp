@@ -20,6 +20,11 @@
 #include "trace.h"
 #include "uprobe.h"
 
+#include <fnmatch.h>
+#include <limits.h>
+#include <unordered_set>
+#include <bpf/bpf.h>
+
 void splitStr(const std::string &symbol, const char split, std::vector<std::string> &res)
 {
     if (symbol == "")
@@ -153,15 +158,136 @@ static int attach_usdt(struct probe_bpf *skel, const std::string &func, int pid)
     return 0;
 };
 
+/// @brief 函数名中是否含有通配符或以逗号分隔的多个函数，是则同时探测多个函数
+static bool is_multi(const std::string &func)
+{
+    return func.find_first_of("*?[,") != func.npos;
+}
+
+/// @brief 从ftrace可探测的内核函数中找出与任一模式匹配的函数，按出现的顺序去重
+static int match_kernel_funcs(const std::vector<std::string> &patterns, std::vector<std::string> &funcs)
+{
+    FILE *f = fopen("/sys/kernel/tracing/available_filter_functions", "r");
+    if (!f)
+        f = fopen("/sys/kernel/debug/tracing/available_filter_functions", "r");
+    if (!f)
+        return -1;
+    std::unordered_set<std::string> seen;
+    char line[512];
+    while (fgets(line, sizeof(line), f))
+    {
+        // 行形如"name"或"name [module]"
+        line[strcspn(line, " \t\n")] = '\0';
+        for (auto &p : patterns)
+            if (!fnmatch(p.c_str(), line, 0))
+            {
+                if (seen.insert(line).second)
+                    funcs.push_back(line);
+                break;
+            }
+    }
+    fclose(f);
+    return 0;
+}
+
+struct FuncMatch
+{
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> *funcs;
+};
+
+/// @brief 从用户态程序或库的符号表中找出与任一模式匹配的函数，按出现的顺序去重
+static int match_user_funcs(const char *path, const std::vector<std::string> &patterns, std::vector<std::string> &funcs)
+{
+    FuncMatch m;
+    m.funcs = &funcs;
+    for (auto &p : patterns)
+        if (for_each_elf_func(path, p.c_str(), [](const char *name, void *ctx)
+                              {
+                auto m = (FuncMatch *)ctx;
+                if (m->seen.insert(name).second)
+                    m->funcs->push_back(name); },
+                              &m))
+            return -1;
+    return 0;
+}
+
+int ProbeStackCollector::attach_multi(const std::string &lib)
+{
+    std::vector<const char *> syms;
+    std::vector<__u64> cookies;
+    for (size_t i = 0; i < funcs.size(); i++)
+    {
+        syms.push_back(funcs[i].c_str());
+        cookies.push_back(i + 1);
+    }
+    if (lib.empty())
+    {
+        LIBBPF_OPTS(bpf_kprobe_multi_opts, opts,
+                    .syms = syms.data(),
+                    .cookies = cookies.data(),
+                    .cnt = syms.size());
+        skel->links.multi_kprobe =
+            bpf_program__attach_kprobe_multi_opts(skel->progs.multi_kprobe, NULL, &opts);
+        CHECK_ERR_RN1(!skel->links.multi_kprobe, "Fail to attach kprobe.multi");
+        opts.retprobe = true;
+        skel->links.multi_kretprobe =
+            bpf_program__attach_kprobe_multi_opts(skel->progs.multi_kretprobe, NULL, &opts);
+        CHECK_ERR_RN1(!skel->links.multi_kretprobe, "Fail to attach kretprobe.multi");
+    }
+    else
+    {
+        // 未指定进程时探测所有进程
+        int pid = tgid ? (int)tgid : -1;
+        LIBBPF_OPTS(bpf_uprobe_multi_opts, opts,
+                    .syms = syms.data(),
+                    .cookies = cookies.data(),
+                    .cnt = syms.size());
+        skel->links.multi_uprobe =
+            bpf_program__attach_uprobe_multi(skel->progs.multi_uprobe, pid, lib.c_str(), NULL, &opts);
+        CHECK_ERR_RN1(!skel->links.multi_uprobe, "Fail to attach uprobe.multi");
+        opts.retprobe = true;
+        skel->links.multi_uretprobe =
+            bpf_program__attach_uprobe_multi(skel->progs.multi_uretprobe, pid, lib.c_str(), NULL, &opts);
+        CHECK_ERR_RN1(!skel->links.multi_uretprobe, "Fail to attach uretprobe.multi");
+    }
+    return 0;
+};
+
 // ========== implement virtual func ==========
 
-uint64_t *ProbeStackCollector::count_values(void *data)
+void ProbeStackCollector::count_values(void *data, uint64_t *vals)
 {
     time_tuple *p = (time_tuple *)data;
-    return new uint64_t[scale_num]{
-        p->lat,
-        p->count,
-    };
+    vals[0] = p->lat;
+    vals[1] = p->count;
+};
+
+void ProbeStackCollector::annotate(Report &R)
+{
+    if (funcs.empty())
+        return;
+    auto hist_fd = bpf_map__fd(skel->maps.fid_hist_map);
+    last_hists.resize(funcs.size());
+    lat_hist h;
+    for (uint32_t fid = 1; fid <= funcs.size(); fid++)
+    {
+        R.funcs[fid] = funcs[fid - 1];
+        if (bpf_map_lookup_elem(hist_fd, &fid, &h))
+            continue;
+        // 直方图在eBPF程序中只累加，显示变化量时减去上次读取的值
+        auto &last = last_hists[fid - 1];
+        std::vector<uint64_t> slots(PROBE_HIST_SLOTS);
+        bool empty = true;
+        for (int i = 0; i < PROBE_HIST_SLOTS; i++)
+        {
+            slots[i] = showDelta ? h.slots[i] - last.slots[i] : h.slots[i];
+            empty = empty && !slots[i];
+        }
+        last = h;
+        if (!empty)
+            R.hists[fid].swap(slots);
+    }
 };
 
 void ProbeStackCollector::setScale(std::string probe)
@@ -176,30 +302,65 @@ int ProbeStackCollector::ready(void)
     bool can_ftrace = true;
     std::vector<std::string> strList;
     splitStr(probe, ':', strList);
+    // 内核函数形如<func>或p::<func>，用户函数形如<lib>:<func>或p:<lib>:<func>
+    bool kfunc = (strList.size() == 3 && strList[0] == "p" && strList[1] == "") ||
+                 strList.size() == 1;
+    bool ufunc = strList.size() == 2 ||
+                 (strList.size() == 3 && strList[0] == "p" && strList[1] != "");
+    std::string lib;
+    funcs.clear();
+    if ((kfunc || ufunc) && is_multi(strList.back()))
+    {
+        std::vector<std::string> patterns;
+        splitStr(strList.back(), ',', patterns);
+        if (kfunc)
+            err = match_kernel_funcs(patterns, funcs);
+        else
+        {
+            char bin_path[PATH_MAX];
+            err = resolve_binary_path(strList[strList.size() - 2].c_str(), tgid, bin_path, sizeof(bin_path));
+            CHECK_ERR_RN1(err, "Fail to resolve %s", strList[strList.size() - 2].c_str());
+            lib = bin_path;
+            err = match_user_funcs(bin_path, patterns, funcs);
+        }
+        CHECK_ERR_RN1(err, "Fail to list functions");
+        CHECK_ERR_RN1(funcs.empty(), "No function matches %s", strList.back().c_str());
+        fprintf(stderr, "Probe %zu functions\n", funcs.size());
+    }
+    bool multi = !funcs.empty();
     EBPF_LOAD_OPEN_INIT(
-        if ((strList.size() == 3 && strList[0] == "p" && strList[1] == "") ||
-            strList.size() == 1)
-            can_ftrace = try_fentry(skel, (strList.size() == 1
-                                               ? probe
-                                               : strList[2])
-                                              .c_str());
-        else {
+        if (multi) {
             bpf_program__set_autoload(skel->progs.dummy_fentry, false);
             bpf_program__set_autoload(skel->progs.dummy_fexit, false);
+            bpf_program__set_autoload(skel->progs.dummy_kprobe, false);
+            bpf_program__set_autoload(skel->progs.dummy_kretprobe, false);
+            // 只加载所需的一对，uprobe.multi需要较新的内核
+            bpf_program__set_autoload(kfunc ? skel->progs.multi_uprobe : skel->progs.multi_kprobe, false);
+            bpf_program__set_autoload(kfunc ? skel->progs.multi_uretprobe : skel->progs.multi_kretprobe, false);
+            bpf_map__set_max_entries(skel->maps.fid_hist_map, funcs.size() + 1);
+        } else {
+            bpf_program__set_autoload(skel->progs.multi_kprobe, false);
+            bpf_program__set_autoload(skel->progs.multi_kretprobe, false);
+            bpf_program__set_autoload(skel->progs.multi_uprobe, false);
+            bpf_program__set_autoload(skel->progs.multi_uretprobe, false);
+            if (kfunc)
+                can_ftrace = try_fentry(skel, strList.back().c_str());
+            else {
+                bpf_program__set_autoload(skel->progs.dummy_fentry, false);
+                bpf_program__set_autoload(skel->progs.dummy_fexit, false);
+            }
         });
 
-    if ((strList.size() == 3 && strList[0] == "p" && strList[1] == "") ||
-        strList.size() == 1)
+    if (multi)
+        err = attach_multi(lib);
+    else if (kfunc)
         if (can_ftrace)
             err = attach_fentry(skel);
         else
-            err = attach_kprobes(skel, (strList.size() == 1
-                                            ? probe
-                                            : strList[2]));
+            err = attach_kprobes(skel, strList.back());
     else if (strList.size() == 3 && strList[0] == "t")
         err = attach_tp(skel, strList[1], strList[2]);
-    else if (strList.size() == 2 ||
-             (strList.size() == 3 && strList[0] == "p" && strList[1] != ""))
+    else if (ufunc)
         err = attach_uprobes(skel,
                              strList.size() == 3
                                  ? strList[1] + ":" + strList[2]
@@ -233,6 +394,7 @@ const char *ProbeStackCollector::getName(void)
 
 ProbeStackCollector::ProbeStackCollector()
 {
+    percpu_capable = true;
     scale_num = 2;
     scales = new Scale[scale_num]{
         {"Time", 1, "nanoseconds"},
@@ -17,14 +17,13 @@
 // readahead ebpf程序的包装类，实现接口和一些自定义方法
 
 #include "bpf_wapper/readahead.h"
+#include "trace.h"
 
-uint64_t *ReadaheadStackCollector::count_values(void *data)
+void ReadaheadStackCollector::count_values(void *data, uint64_t *vals)
 {
     ra_tuple *p = (ra_tuple *)data;
-    return new uint64_t[scale_num]{
-        p->expect - p->truth,
-        p->truth,
-    };
+    vals[0] = p->expect - p->truth;
+    vals[1] = p->truth;
 };
 
 ReadaheadStackCollector::ReadaheadStackCollector()
@@ -39,7 +38,32 @@ ReadaheadStackCollector::ReadaheadStackCollector()
 
 int ReadaheadStackCollector::ready(void)
 {
-    EBPF_LOAD_OPEN_INIT();
+    // 内核可挂载folio相关函数时按folio记录，每个folio只更新一次表，否则退回按4K页记录
+    bool noprof = fentry_can_attach("filemap_alloc_folio_noprof", NULL);
+    exact = fentry_can_attach("copy_page_to_iter", NULL);
+    folio = folio &&
+            (noprof || fentry_can_attach("filemap_alloc_folio", NULL)) &&
+            (exact || fentry_can_attach("folio_mark_accessed", NULL));
+    exact = exact || !folio;
+    if (!exact)
+    {
+        // 只能按folio的访问标记计数时，已使用的页数是上界
+        scales[0].Type = "UnusedReadaheadPagesLowerBound";
+        scales[1].Type = "UsedReadaheadPagesUpperBound";
+        fprintf(stderr, "%s: copy_page_to_iter is not traceable, used pages are an upper bound.\n",
+                getName());
+    }
+    bool ra_order = folio && fentry_can_attach("page_cache_ra_order", NULL);
+    EBPF_LOAD_OPEN_INIT(
+        bpf_program__set_autoload(skel->progs.filemap_alloc_folio_ret, folio && !noprof);
+        bpf_program__set_autoload(skel->progs.filemap_alloc_folio_noprof_ret, folio && noprof);
+        bpf_program__set_autoload(skel->progs.copy_page_to_iter, folio && exact);
+        bpf_program__set_autoload(skel->progs.folio_mark_accessed, folio && !exact);
+        bpf_program__set_autoload(skel->progs.page_cache_ra_order, ra_order);
+        bpf_program__set_autoload(skel->progs.page_cache_ra_order_ret, ra_order);
+        bpf_program__set_autoload(skel->progs.alloc_pages_ret, !folio);
+        bpf_program__set_autoload(skel->progs.mark_page_accessed, !folio);
+        bpf_map__set_max_entries(folio ? skel->maps.page_psid_map : skel->maps.folio_psid_map, 1));
     ATTACH_PROTO;
     return 0;
 }
@@ -20,11 +20,9 @@
 
 // ========== implement virtual func ==========
 
-uint64_t *TemplateClass::count_values(void *data)
+void TemplateClass::count_values(void *data, uint64_t *vals)
 {
-    return new uint64_t[scale_num]{
-        *(uint32_t *)data,
-    };
+    vals[0] = *(uint32_t *)data;
 };
 
 int TemplateClass::ready(void)
@@ -0,0 +1,128 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// wall clock ebpf程序的包装类，实现接口和一些自定义方法
+
+#include "bpf_wapper/wall_clock.h"
+#include "trace.h"
+
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <bpf/bpf.h>
+
+extern "C"
+{
+    extern int parse_cpu_mask_file(const char *fcpu, bool **mask, int *mask_sz);
+}
+
+WallClockStackCollector::WallClockStackCollector()
+{
+    percpu_capable = true;
+    scale_num = 1;
+    scales = new Scale[scale_num]{
+        {"WallTime", 1, "nanoseconds"},
+    };
+};
+
+void WallClockStackCollector::count_values(void *data, uint64_t *vals)
+{
+    vals[0] = *(uint64_t *)data;
+};
+
+void WallClockStackCollector::setRate(uint32_t f)
+{
+    // 采样事件为cpu-clock的周期模式，eBPF程序按实际的采样周期计时，调整周期不影响计数的单位
+    uint64_t period = 1000000000ull / f;
+    for (int i = 0; pefds && i < num_cpus; i++)
+        if (pefds[i] >= 0)
+            ioctl(pefds[i], PERF_EVENT_IOC_PERIOD, &period);
+    StackCollector::setRate(f);
+}
+
+int WallClockStackCollector::ready(void)
+{
+    CHECK_ERR_RN1(!freq, "Wall clock profiling needs a sampling frequency");
+    CHECK_ERR_RN1(tids.size() > MAX_TID_FILTER, "Trace at most %d threads", MAX_TID_FILTER);
+    EBPF_LOAD_OPEN_INIT(skel->rodata->filter_tids = !tids.empty());
+    uint8_t one = 1;
+    int filter_fd = bpf_map__fd(skel->maps.tid_filter_map);
+    for (auto tid : tids)
+        CHECK_ERR_RN1(bpf_map_update_elem(filter_fd, &tid, &one, BPF_ANY), "Fail to trace thread %u", tid);
+
+    const struct ksym *ksym = ksyms__find_symbol(ksyms, "finish_task_switch");
+    CHECK_ERR_RN1(!ksym, "Fail to find finish_task_switch");
+    skel->links.do_offcpu = bpf_program__attach_kprobe(skel->progs.do_offcpu, false, ksym->name);
+    CHECK_ERR_RN1(!skel->links.do_offcpu, "Fail to attach finish_task_switch");
+
+    bool *online_mask;
+    int num_online_cpus;
+    err = parse_cpu_mask_file("/sys/devices/system/cpu/online", &online_mask, &num_online_cpus);
+    CHECK_ERR_RN1(err, "Fail to get online CPU numbers");
+    num_cpus = libbpf_num_possible_cpus();
+    CHECK_ERR_RN1(num_cpus <= 0, "Fail to get the number of processors");
+
+    // cpu-clock按纳秒计数，周期模式下每次采样恰好代表一个周期的运行时间；
+    // 跟踪全部进程，由eBPF程序按tgid过滤，使目标进程已有的线程也被采样
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_SOFTWARE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_SW_CPU_CLOCK,
+        .sample_period = 1000000000ull / freq,
+    };
+    pefds = (int *)malloc(num_cpus * sizeof(int));
+    for (int i = 0; i < num_cpus; i++)
+        pefds[i] = -1;
+    links = (struct bpf_link **)calloc(num_cpus, sizeof(struct bpf_link *));
+    for (int cpu = 0; cpu < num_cpus; cpu++)
+    {
+        if (cpu >= num_online_cpus || !online_mask[cpu])
+            continue;
+        int pefd = syscall(SYS_perf_event_open, &attr, -1, cpu, -1, 0);
+        CHECK_ERR_RN1(pefd < 0, "Fail to set up performance monitor on a CPU/Core");
+        pefds[cpu] = pefd;
+        links[cpu] = bpf_program__attach_perf_event(skel->progs.do_oncpu, pefd);
+        CHECK_ERR_RN1(!links[cpu], "Fail to attach bpf program");
+    }
+    free(online_mask);
+    return 0;
+}
+
+void WallClockStackCollector::finish(void)
+{
+    for (int i = 0; links && i < num_cpus; i++)
+    {
+        bpf_link__destroy(links[i]);
+        if (pefds[i] >= 0)
+            close(pefds[i]);
+    }
+    free(links);
+    free(pefds);
+    links = NULL;
+    pefds = NULL;
+    DETACH_PROTO;
+    UNLOAD_PROTO;
+}
+
+void WallClockStackCollector::activate(bool tf)
+{
+    ACTIVE_SET(tf);
+}
+
+const char *WallClockStackCollector::getName(void)
+{
+    return "WallClockStackCollector";
+}
@@ -19,20 +19,20 @@ uint64_t get_cgroupid(const char *pathname)
     if (err != 0)
     {
         fprintf(stderr, "statfs on %s failed: %s\n", pathname, strerror(errno));
-        exit(1);
+        return 0;
     }
 
     if ((fs.f_type != (typeof(fs.f_type))CGROUP2_SUPER_MAGIC))
     {
         fprintf(stderr, "File %s is not on a cgroup2 mount.\n", pathname);
-        exit(1);
+        return 0;
     }
 
     h = (cgid_file_handle *)malloc(sizeof(struct cgid_file_handle));
     if (!h)
     {
         fprintf(stderr, "Cannot allocate memory.\n");
-        exit(1);
+        return 0;
     }
 
     h->handle_bytes = 8;
@@ -40,13 +40,15 @@ uint64_t get_cgroupid(const char *pathname)
     if (err != 0)
     {
         fprintf(stderr, "name_to_handle_at failed: %s\n", strerror(errno));
-        exit(1);
+        free(h);
+        return 0;
     }
 
     if (h->handle_bytes != 8)
     {
         fprintf(stderr, "Unexpected handle size: %d. \n", h->handle_bytes);
-        exit(1);
+        free(h);
+        return 0;
     }
 
     ret = h->cgid;
@@ -0,0 +1,180 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 差分剖析的实现
+
+#include "diff.h"
+#include "user.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+bool DiffProfile::Profile::add(const std::string &line)
+{
+    auto sp = line.rfind(' ');
+    if (sp == std::string::npos || !sp)
+        return false;
+    char *end;
+    uint64_t v = strtoull(line.c_str() + sp + 1, &end, 10);
+    if (*end || end == line.c_str() + sp + 1)
+        return false;
+    stacks[line.substr(0, sp)] += v;
+    total += v;
+    return true;
+}
+
+int DiffProfile::loadBaseline(const char *path)
+{
+    std::ifstream in(path);
+    CHECK_ERR_RN1(!in, "Failed to open baseline %s", path);
+    std::string line;
+    size_t n = 0;
+    while (std::getline(in, line))
+    {
+        if (line.empty())
+            continue;
+        // 第一层栈帧为采集器名
+        auto &P = base[line.substr(0, std::min(line.find(';'), line.rfind(' ')))];
+        CHECK_ERR_RN1(!P.add(line), "Bad folded stack in %s: %s", path, line.c_str());
+        n++;
+    }
+    fprintf(stderr, _RED "Load baseline of %zu stacks from %s.\n" _RE, n, path);
+    remaining = 0;
+    return 0;
+}
+
+std::string DiffProfile::update(const std::string &name, const std::string &folded, bool delta)
+{
+    auto &P = remaining ? base[name] : cur[name];
+    // 基线累加各周期的变化量；当前只保留本周期的数据，使各周期的输出可直接拼接
+    if (!remaining || !delta)
+        P.clear();
+    for (size_t begin = 0, end; begin < folded.size(); begin = end + 1)
+    {
+        end = folded.find('\n', begin);
+        if (end == std::string::npos)
+            end = folded.size();
+        if (end > begin)
+            P.add(folded.substr(begin, end - begin));
+    }
+    return remaining ? "" : render(name);
+}
+
+void DiffProfile::endInterval(void)
+{
+    if (remaining && !--remaining)
+        fprintf(stderr, _RED "Baseline is ready, diff the following intervals against it.\n" _RE);
+}
+
+/// @brief 两比例的z检验，两者的占比相同时使用合并的占比估计标准误
+/// @return 占比变化显著为真，否则为假
+static bool significant(uint64_t vb, uint64_t vc, double nb, double nc)
+{
+    double pb = vb / nb, pc = vc / nc, p = (vb + vc) / (nb + nc);
+    double se = sqrt(p * (1 - p) * (1 / nb + 1 / nc));
+    return se > 0 && fabs(pc - pb) / se >= DIFF_MIN_Z;
+}
+
+/// @brief 按有序表的键归并两张表，对每个键以两边的值调用f，缺失的一边为0
+template <typename F>
+static void merge(const std::map<std::string, uint64_t> &B, const std::map<std::string, uint64_t> &C, F f)
+{
+    auto i = B.begin(), j = C.begin();
+    while (i != B.end() || j != C.end())
+    {
+        if (j == C.end() || (i != B.end() && i->first < j->first))
+            f(i->first, i->second, 0), i++;
+        else if (i == B.end() || j->first < i->first)
+            f(j->first, 0, j->second), j++;
+        else
+            f(i->first, i->second, j->second), i++, j++;
+    }
+}
+
+/// @brief 把各调用栈的值累加到其各级前缀上，得到各调用路径的包含值，不含只有采集器名的一级
+static std::map<std::string, uint64_t> inclusive(const std::map<std::string, uint64_t> &stacks)
+{
+    std::map<std::string, uint64_t> paths;
+    for (auto &i : stacks)
+    {
+        auto &s = i.first;
+        // 从第二级开始的各级前缀，最后一级为调用栈本身
+        for (size_t k = s.find(';'); k != std::string::npos;)
+        {
+            size_t e = s.find(';', k + 1);
+            paths[s.substr(0, e)] += i.second;
+            k = e;
+        }
+    }
+    return paths;
+}
+
+/// @brief 按占比变化的绝对值从大到小向标准错误输出前若干项
+static void summarize(const char *name, const char *what,
+                      std::vector<std::pair<double, const std::string *>> &changes)
+{
+    // 变化相同时较长的调用路径更能指出变化的来源
+    std::sort(changes.begin(), changes.end(), [](const std::pair<double, const std::string *> &a,
+                                                 const std::pair<double, const std::string *> &b)
+              { return fabs(a.first) != fabs(b.first) ? fabs(a.first) > fabs(b.first)
+                                                      : a.second->size() > b.second->size(); });
+    fprintf(stderr, _BLUE "%s: %zu %s changed significantly" _RE "\n", name, changes.size(), what);
+    for (size_t k = 0; k < changes.size() && k < DIFF_SUMMARY_NUM; k++)
+        fprintf(stderr, "%+.2f%%\t%s\n", changes[k].first * 100, changes[k].second->c_str());
+}
+
+std::string DiffProfile::render(const std::string &name)
+{
+    auto b = base.find(name);
+    auto &C = cur[name];
+    if (b == base.end() || !b->second.total || !C.total)
+        return "";
+    auto &B = b->second;
+    double nb = B.total, nc = C.total;
+    std::string out;
+    // 显著变化的调用栈及其占比的变化
+    std::vector<std::pair<double, const std::string *>> changes;
+    merge(B.stacks, C.stacks, [&](const std::string &stack, uint64_t vb, uint64_t vc)
+          {
+        bool sig = significant(vb, vc, nb, nc);
+        // 基线值按总量缩放到当前，不显著的变化不着色
+        uint64_t before = sig ? llround(vb / nb * nc) : vc;
+        if (!before && !vc)
+            return;
+        if (sig)
+            changes.emplace_back(vc / nc - vb / nb, &stack);
+        out += stack;
+        out += ' ';
+        out += std::to_string(before);
+        out += ' ';
+        out += std::to_string(vc);
+        out += '\n'; });
+    summarize(name.c_str(), "stacks", changes);
+
+    // 单个调用栈的变化可能分散在许多调用栈中而都不显著，对各级调用路径的包含值再做检验
+    auto pb = inclusive(B.stacks), pc = inclusive(C.stacks);
+    std::vector<std::pair<double, const std::string *>> paths;
+    merge(pb, pc, [&](const std::string &path, uint64_t vb, uint64_t vc)
+          {
+        if (significant(vb, vc, nb, nc))
+            paths.emplace_back(vc / nc - vb / nb, &path); });
+    summarize(name.c_str(), "call paths", paths);
+    return out;
+}
@@ -21,6 +21,10 @@
 #include <poll.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <bpf/bpf.h>
 
 #include "bpf_wapper/on_cpu.h"
 #include "bpf_wapper/llc_stat.h"
@@ -29,14 +33,34 @@
 #include "bpf_wapper/io.h"
 #include "bpf_wapper/readahead.h"
 #include "bpf_wapper/probe.h"
+#include "bpf_wapper/wall_clock.h"
+#include "bpf_wapper/pmu.h"
 #include "user.h"
 #include "clipp.h"
 #include "cgroup.h"
 #include "trace.h"
+#include "symbol.h"
+#include "output.h"
+#include "worker.h"
+#include "recorder.h"
+#include "offline.h"
+#include "diff.h"
 
 bool timeout = false;
 std::vector<StackCollector *> StackCollectorList;
+OutputSink sink;
+SharedMaps shared_maps;
+WorkerPool *pool = NULL;
+FlightRecorder *recorder = NULL;
+DiffProfile *diff = NULL;
+int pending = -1; // 触发后还需记录的周期数，-1表示未触发
 void end_handle(void);
+void report(void);
+void record(void);
+void dump(void);
+void adapt(void);
+bool loadCgroups(std::map<uint64_t, std::string> &ids);
+void reloadCgroups(void);
 
 namespace MainConfig
 {
@@ -44,17 +68,32 @@ namespace MainConfig
     unsigned delay = 5;     // 设置输出间隔
     std::string command = "";
     uint32_t target_tgid = 0;
-    uint64_t target_cgroup = 0;
+    std::string cgroups = "";    // 要跟踪的cgroup路径，以逗号分隔，或为@加每行一个路径的列表文件
+    bool per_cgroup = false;     // 是否在每个cgroup内分别选出top项
     std::string trigger = "";    // 触发器
     std::string trig_event = ""; // 触发事件
     uint32_t top = 10;
     uint32_t freq = 49;
     bool trace_user = false;
     bool trace_kernel = false;
+    uint32_t stack_depth = 0; // 按哈希去重调用栈时的栈深度，0表示使用栈表
+    OutputFormat format = OUTPUT_TEXT; // 输出格式
+    std::string output = "";           // 输出目标，为空时输出到标准输出
+    bool gzip = false;                 // 是否压缩输出
+    bool percpu = false;               // 是否使用每CPU计数表
+    bool prog_stats = false;           // 是否统计eBPF程序的运行耗时
+    double budget = 0;                 // 自适应采样的开销预算，为占单个CPU时间的百分比，0表示固定频率
+    bool shared = false;               // 是否在采集器间共用栈表、线程信息表和容器表
+    uint64_t recorder = 0;             // 飞行记录器的内存预算，单位为MB，0表示不开启
+    uint32_t after = 1;                // 触发后继续记录的周期数
+    std::string baseline = "";         // 差分剖析的基线，为折叠栈文件或作为基线的最初周期数
 }
 
 int main(int argc, char *argv[])
 {
+    // 离线解析不加载eBPF程序，作为独立的子命令
+    if (argc > 1 && !strcmp(argv[1], "symbolize"))
+        return symbolize_main(argc - 1, argv + 1);
     uint64_t stop_time = -1;
     clipp::man_page man_page;
     clipp::group cli;
@@ -64,12 +103,54 @@ int main(int argc, char *argv[])
         auto OnCpuOption = (clipp::option("on_cpu")
                                 .call([]
                                       { StackCollectorList.push_back(new OnCPUStackCollector()); }) %
-                            COLLECTOR_INFO("on-cpu"));
+                            COLLECTOR_INFO("on-cpu")) &
+                           ((clipp::option("-U") &
+                             clipp::value("bytes", IntTmp)
+                                 .call([&IntTmp]
+                                       { static_cast<OnCPUStackCollector *>(StackCollectorList.back())
+                                             ->ustack_bytes = IntTmp; })) %
+                            "Copy <bytes> of user stack per sample and unwind it with .eh_frame/.debug_frame in user space, "
+                            "for programs built without frame pointers");
 
-        auto OffCpuOption = clipp::option("off_cpu")
-                                .call([]
-                                      { StackCollectorList.push_back(new OffCPUStackCollector()); }) %
-                            COLLECTOR_INFO("off-cpu");
+        auto OffCpuOption = (clipp::option("off_cpu")
+                                 .call([]
+                                       { StackCollectorList.push_back(new OffCPUStackCollector()); }) %
+                             COLLECTOR_INFO("off-cpu")) &
+                            (clipp::option("-S")
+                                 .call([]
+                                       { static_cast<OffCPUStackCollector *>(StackCollectorList.back())
+                                             ->stream = true; }) %
+                             "Stream every blocking in nanoseconds with its waker through a ring buffer");
+
+        auto WallClockOption = (clipp::option("wall_clock")
+                                    .call([]
+                                          { StackCollectorList.push_back(new WallClockStackCollector()); }) %
+                                COLLECTOR_INFO("wall-clock")) &
+                               ((clipp::option("-t") &
+                                 // 只接受以逗号分隔的十进制数，其余输入使解析失败而不是当作tid 0
+                                 clipp::value([](const std::string &s)
+                                              {
+                                                  bool digit = false;
+                                                  for (char c : s)
+                                                  {
+                                                      if (c == ',' && digit)
+                                                          digit = false;
+                                                      else if (isdigit((unsigned char)c))
+                                                          digit = true;
+                                                      else
+                                                          return false;
+                                                  }
+                                                  return digit; },
+                                              "tids", StrTmp)
+                                     .call([&StrTmp]
+                                           { auto &tids = static_cast<WallClockStackCollector *>(StackCollectorList.back())->tids;
+                                             for (char *p = (char *)StrTmp.c_str(); *p; p++)
+                                             {
+                                                 tids.push_back(strtoul(p, &p, 10));
+                                                 if (*p != ',')
+                                                     break;
+                                             } })) %
+                                "Only trace the threads in the comma-separated list of tids");
 
         auto MemleakOption = (clipp::option("memleak")
                                   .call([]
@@ -79,7 +160,13 @@ int main(int argc, char *argv[])
                                   .call([]
                                         { static_cast<MemleakStackCollector *>(StackCollectorList.back())
                                               ->wa_missing_free = true; }) %
-                              "Free when missing in kernel to alleviate misjudgments");
+                              "Free when missing in kernel to alleviate misjudgments") &
+                             ((clipp::option("-R") &
+                               clipp::value("bytes", IntTmp)
+                                   .call([&IntTmp]
+                                         { static_cast<MemleakStackCollector *>(StackCollectorList.back())
+                                               ->sample_bytes = IntTmp; })) %
+                              "Sample on average one allocation per <bytes> bytes and scale results to estimates");
 
         auto IOOption = clipp::option("io")
                             .call([]
@@ -101,6 +188,25 @@ int main(int argc, char *argv[])
                                                ->setScale(IntTmp); })) %
                               "Set sampling period; default is 100");
 
+        auto PmuOption = (clipp::option("pmu")
+                              .call([]
+                                    { StackCollectorList.push_back(new PmuStackCollector()); }) %
+                          COLLECTOR_INFO("pmu")) &
+                         ((clipp::option("-e") &
+                           clipp::value("events", StrTmp)
+                               .call([&StrTmp]
+                                     { static_cast<PmuStackCollector *>(StackCollectorList.back())
+                                           ->spec = StrTmp; })) %
+                          "Set the comma-separated PMU events opened as a group, the first one is sampled. "
+                          "Accept hardware events like instructions, hardware cache events like dTLB-load-misses "
+                          "and raw events like r01a2; default is cycles,instructions") &
+                         ((clipp::option("-N") &
+                           clipp::value("period", IntTmp)
+                               .call([&IntTmp]
+                                     { static_cast<PmuStackCollector *>(StackCollectorList.back())
+                                           ->period = IntTmp; })) %
+                          "Sample every <period> events of the first one; default is 0 for the sampling frequency");
+
         auto ProbeOption = clipp::option("probe")
                                    .call([]
                                          { StackCollectorList.push_back(new ProbeStackCollector()); }) %
@@ -118,10 +224,10 @@ int main(int argc, char *argv[])
         auto MainOption = _GREEN "Some overall options" _RE %
                           ((
                                ((clipp::option("-g") &
-                                 clipp::value("cgroup path", StrTmp)
-                                     .call([&StrTmp]
-                                           { MainConfig::target_cgroup = get_cgroupid(StrTmp.c_str()); printf("Trace cgroup %ld\n", MainConfig::target_cgroup); })) %
-                                "Set the cgroup of the process to be tracked; default is -1, which keeps track of all cgroups") |
+                                 clipp::value("cgroup paths", MainConfig::cgroups)) %
+                                "Set the cgroups of the processes to be tracked, separated by commas, "
+                                "or " _ERED "@<file>" _RE " listing one cgroup path per line, which is re-read "
+                                "every interval after it changes; default keeps track of all cgroups") |
                                ((clipp::option("-p") &
                                  clipp::value("pid", MainConfig::target_tgid)) %
                                 "Set the pid of the process to be tracked; default is -1, which keeps track of all processes") |
@@ -130,7 +236,10 @@ int main(int argc, char *argv[])
                                 "Set the command to be run and sampled; defaults is none")),
                            (clipp::option("-o") &
                             clipp::value("top", MainConfig::top)) %
-                               "Set the top number; default is 10",
+                               "Set the top number, 0 for all; default is 10",
+                           clipp::option("-G")
+                                   .set(MainConfig::per_cgroup) %
+                               "Tell cgroups apart in the counts and select the top stacks within each cgroup",
                            (clipp::option("-f") &
                             clipp::value("freq", MainConfig::freq)) %
                                "Set sampling frequency, 0 for close; default is 49",
@@ -150,6 +259,10 @@ int main(int argc, char *argv[])
                                     .call([]
                                           { MainConfig::trace_kernel = true; }) %
                                 "Sample kernel stacks"),
+                           (clipp::option("-D") &
+                            clipp::value("depth", MainConfig::stack_depth)) %
+                               "Collect stacks up to the depth (at most 127) and deduplicate them by hash, "
+                               "reporting the collision rate; default is 0 for the stack trace map of depth 32",
                            (clipp::option("-T") &
                             ((clipp::required("cpu").set(MainConfig::trigger) |
                               clipp::required("memory").set(MainConfig::trigger) |
@@ -157,7 +270,50 @@ int main(int argc, char *argv[])
                              clipp::value("event", MainConfig::trig_event))) %
                                "Set a trigger for monitoring. For example, " _ERED "-T cpu \"some 150000 100000\" " _RE
                                "means triggers when cpu partial stall "
-                               "with 1s tracking window size * and 150ms threshold.");
+                               "with 1s tracking window size * and 150ms threshold.",
+                           (clipp::option("-O") &
+                            (clipp::required("text").set(MainConfig::format, OUTPUT_TEXT) |
+                             clipp::required("folded").set(MainConfig::format, OUTPUT_FOLDED) |
+                             clipp::required("pprof").set(MainConfig::format, OUTPUT_PPROF) |
+                             clipp::required("raw").set(MainConfig::format, OUTPUT_RAW))) %
+                               "Set the output format; default is text. raw records user frames as build-id and address "
+                               "without loading symbol tables, resolve it later with " _ERED "symbolize" _RE,
+                           (clipp::option("-w") &
+                            clipp::value("output", MainConfig::output)) %
+                               "Set the output file, or unix socket as " _ERED "unix:<path>" _RE "; default is stdout",
+                           clipp::option("-z")
+                                   .set(MainConfig::gzip) %
+                               "Compress the output with gzip",
+                           clipp::option("-I")
+                                   .set(symbolizer.inlines) %
+                               "Expand inlined functions in user stacks and append source files and lines, "
+                               "needs building with " _ERED "BLAZESYM=1" _RE,
+                           clipp::option("-C")
+                                   .set(MainConfig::percpu) %
+                               "Use per-CPU count maps for the on_cpu, wall_clock, io and probe collectors",
+                           clipp::option("-s")
+                                   .set(MainConfig::prog_stats) %
+                               "Show the run count and average run time (ns) of eBPF programs at exit",
+                           clipp::option("-M")
+                                   .set(MainConfig::shared) %
+                               "Share the stack, thread info and container maps among collectors "
+                               "and symbolize their stacks in one pass",
+                           (clipp::option("-F") &
+                            clipp::value("size", MainConfig::recorder)) %
+                               "Keep collecting with a trigger, hold unsymbolized intervals in a ring of <size> MB "
+                               "and dump the intervals around each event; default is 0 for off",
+                           (clipp::option("-A") &
+                            clipp::value("after", MainConfig::after)) %
+                               "Set the number of intervals recorded after an event before dumping; default is 1",
+                           (clipp::option("-b") &
+                            clipp::value("baseline", MainConfig::baseline)) %
+                               "Diff against a baseline, either a file of folded stacks (e.g. saved with " _ERED "-O folded" _RE ") "
+                               "or the number of first intervals to aggregate, and output differential folded stacks "
+                               "\"stack before after\" with insignificant changes flattened, for flamegraph.pl",
+                           (clipp::option("-B") &
+                            clipp::value("budget", MainConfig::budget)) %
+                               "Adapt sampling rates every interval to keep the overhead under the budget, "
+                               "in percent of one CPU; default is 0 for fixed rates");
 
         auto Info = _GREEN "Information of the application" _RE %
                     ((clipp::option("-v", "--version")
@@ -171,10 +327,12 @@ int main(int argc, char *argv[])
 
         cli = (OnCpuOption,
                OffCpuOption,
+               WallClockOption,
                MemleakOption,
                IOOption,
                ReadaheadOption,
                LlcStatOption,
+               PmuOption,
                clipp::repeatable(ProbeOption),
                MainOption,
                Info);
@@ -198,6 +356,31 @@ int main(int argc, char *argv[])
         printf(_ERED "At least one collector needs to be added.\n" _RE);
         return -1;
     }
+    CHECK_ERR_RN1(MainConfig::recorder && MainConfig::trig_event == "", "Flight recorder needs a trigger");
+    if (MainConfig::baseline.size())
+    {
+        CHECK_ERR_RN1(MainConfig::format != OUTPUT_TEXT, "Diff mode outputs differential folded stacks, do not set -O");
+        // 飞行记录器转储时会重放历史周期，不能当作新的周期计入基线或与基线比较
+        CHECK_ERR_RN1(MainConfig::recorder, "Diff mode cannot be used with the flight recorder (-F)");
+        MainConfig::format = OUTPUT_DIFF;
+        // 按总量归一化需要全部调用栈
+        MainConfig::top = 0;
+        diff = new DiffProfile();
+        char *end;
+        unsigned long n = strtoul(MainConfig::baseline.c_str(), &end, 10);
+        if (!*end && n)
+            diff->baselineIntervals(n);
+        else
+            CHECK_ERR_RN1(diff->loadBaseline(MainConfig::baseline.c_str()), "Failed to load baseline");
+    }
+    symbolizer.offline = MainConfig::format == OUTPUT_RAW;
+#ifndef USE_BLAZESYM
+    CHECK_ERR_RN1(symbolizer.inlines, "Inline expansion needs blazesym, rebuild with BLAZESYM=1");
+#endif
+    CHECK_ERR_RN1(symbolizer.inlines && symbolizer.offline, "Inline expansion does not work with raw output");
+
+    std::map<uint64_t, std::string> cgroup_ids;
+    CHECK_ERR_RN1(!loadCgroups(cgroup_ids), "Failed to load cgroups %s", MainConfig::cgroups.c_str());
 
     fprintf(stderr, BANNER "\n");
 
@@ -230,6 +413,14 @@ int main(int argc, char *argv[])
         }
     }
 
+    CHECK_ERR_RN1(sink.open(MainConfig::output, MainConfig::gzip), "Failed to open output");
+    if (MainConfig::prog_stats)
+    {
+        // 统计在该fd关闭前一直开启，随进程退出关闭
+        int stats_fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+        CHECK_ERR(MainConfig::prog_stats = false, stats_fd < 0, "Failed to enable eBPF program stats");
+    }
+
     ksyms = ksyms__load();
     if (!ksyms)
     {
@@ -248,11 +439,16 @@ int main(int argc, char *argv[])
         fprintf(stderr, _RED "Attach collecotor%d %s.\n" _RE,
                 (int)(Item - StackCollectorList.begin()) + 1, (*Item)->getName());
         (*Item)->tgid = MainConfig::target_tgid;
-        (*Item)->cgroup = MainConfig::target_cgroup;
+        (*Item)->cgroups = cgroup_ids;
+        (*Item)->filter_cgroup = MainConfig::cgroups.size();
+        (*Item)->per_cgroup = MainConfig::per_cgroup;
         (*Item)->top = MainConfig::top;
         (*Item)->freq = MainConfig::freq;
         (*Item)->kstack = MainConfig::trace_kernel;
         (*Item)->ustack = MainConfig::trace_user;
+        (*Item)->percpu_count = MainConfig::percpu;
+        (*Item)->stack_depth = MainConfig::stack_depth;
+        (*Item)->shared = MainConfig::shared ? &shared_maps : NULL;
         if ((*Item)->ready())
             goto err;
         Item++;
@@ -269,6 +465,9 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    // 各采集器的数据读取、符号解析和格式化在线程池中并行进行
+    pool = new WorkerPool(std::min((unsigned)StackCollectorList.size(), std::thread::hardware_concurrency()));
+
     if (MainConfig::command.length())
     {
         fprintf(stderr, _GREEN "Wake up child.\n" _RE);
@@ -292,8 +491,38 @@ int main(int argc, char *argv[])
         fprintf(stderr, _RED "Waiting for events...\n" _RE);
     }
     fprintf(stderr, _RED "Running for %lus or Hit Ctrl-C to end.\n" _RE, MainConfig::run_time);
+    if (MainConfig::recorder)
+        recorder = new FlightRecorder(MainConfig::recorder << 20);
+    // 计数表为双缓冲，输出期间无需暂停采集；仅在触发模式下按事件开关采集，飞行记录时持续采集
+    if (fds.fd < 0 || recorder)
+        for (auto Item : StackCollectorList)
+            Item->activate(true);
     for (; (uint64_t)time(NULL) < stop_time && (MainConfig::target_tgid < 0 || !kill(MainConfig::target_tgid, 0));)
     {
+        if (recorder)
+        {
+            sleep(MainConfig::delay);
+            reloadCgroups();
+            symbolizer.newInterval();
+            record();
+            if (MainConfig::budget > 0)
+                adapt();
+            // 周期内发生的事件在此时可读，包含事件的周期及之前的周期均已记录
+            if (pending < 0 && poll(&fds, 1, 0) > 0)
+            {
+                CHECK_ERR_RN1(fds.revents & POLLERR, "Got POLLERR, event source is gone");
+                if (fds.revents & POLLPRI)
+                {
+                    fprintf(stderr, _RED "Event triggered!\n" _RE);
+                    pending = MainConfig::after;
+                }
+            }
+            if (!pending)
+                dump();
+            if (pending > 0)
+                pending--;
+            continue;
+        }
         if (fds.fd >= 0)
         {
             while (true)
@@ -307,14 +536,18 @@ int main(int argc, char *argv[])
                     break;
                 }
             }
+            for (auto Item : StackCollectorList)
+                Item->activate(true);
         }
-        for (auto Item : StackCollectorList)
-            Item->activate(true);
         sleep(MainConfig::delay);
-        for (auto Item : StackCollectorList)
-            Item->activate(false);
-        for (auto Item : StackCollectorList)
-            std::cout << std::string(*Item);
+        if (fds.fd >= 0)
+            for (auto Item : StackCollectorList)
+                Item->activate(false);
+        reloadCgroups();
+        symbolizer.newInterval();
+        report();
+        if (MainConfig::budget > 0)
+            adapt();
     }
     timeout = true;
     return 0;
@@ -323,17 +556,233 @@ int main(int argc, char *argv[])
 void end_handle(void)
 {
     signal(SIGINT, SIG_IGN);
+    // 主循环可能在等待输出时被中断，先等待进行中的任务结束
+    if (pool)
+        pool->wait();
     for (auto Item : StackCollectorList)
-    {
         Item->activate(false);
-        if (!timeout)
-        {
-            std::cout << std::string(*Item) << std::endl;
-        }
+    if (recorder)
+    {
+        // 事件后的周期尚未记录完时输出已记录的部分
+        if (pending >= 0)
+            dump();
+    }
+    else if (!timeout && pool)
+    {
+        symbolizer.newInterval();
+        report();
+    }
+    for (auto Item : StackCollectorList)
+    {
+        if (MainConfig::prog_stats)
+            std::cerr << _GREEN "collector\tprogram\truns\tns/run" _RE "\n"
+                      << Item->progStats();
         Item->finish();
     }
+    sink.close();
     if (MainConfig::command.length())
     {
         kill(MainConfig::target_tgid, SIGTERM);
     }
-};
\ No newline at end of file
+};
+
+/// @brief 按输出格式格式化一个采集器的数据，在工作线程中执行
+/// @param ok 数据是否读取成功，失败时文本格式只输出空的各部分，其余格式不输出
+static std::string render(const Report &R, bool ok)
+{
+    if (MainConfig::format == OUTPUT_TEXT)
+        return renderText(R);
+    if (!ok)
+        return "";
+    if (MainConfig::format == OUTPUT_FOLDED || MainConfig::format == OUTPUT_DIFF)
+        return renderFolded(R);
+    if (MainConfig::format == OUTPUT_RAW)
+        return renderRaw(R);
+    return renderPprof(R);
+}
+
+/// @brief 并行读取各采集器的数据
+/// @param resolve 是否同时解析调用栈，共用映射时不在工作线程中解析
+static void gatherAll(std::vector<Report> &reports, std::vector<char> &ok, bool resolve)
+{
+    std::vector<std::future<bool>> done;
+    for (size_t i = 0; i < reports.size(); i++)
+        done.push_back(pool->submit([i, &reports, resolve]
+                                    { return resolve ? StackCollectorList[i]->collect(reports[i])
+                                                     : StackCollectorList[i]->gather(reports[i]); }));
+    for (size_t i = 0; i < done.size(); i++)
+        ok[i] = done[i].get();
+}
+
+/// @brief 并行格式化各采集器已解析的数据，并按采集器顺序写出，输出与串行执行时一致
+static void emit(const std::vector<Report> &reports, const std::vector<char> &ok)
+{
+    std::vector<std::future<std::string>> outs;
+    for (size_t i = 0; i < reports.size(); i++)
+        outs.push_back(pool->submit([i, &reports, &ok]
+                                    { return render(reports[i], ok[i]); }));
+    for (size_t i = 0; i < outs.size(); i++)
+    {
+        auto out = outs[i].get();
+        // 差分剖析的数据在主线程中依次更新
+        if (diff && ok[i])
+            out = diff->update(reports[i].name, out, StackCollectorList[i]->isDelta());
+        if (MainConfig::format == OUTPUT_PPROF || MainConfig::format == OUTPUT_RAW)
+        {
+            if (out.size())
+                sink.writeRecord(StackCollectorList[i]->getName(), out);
+        }
+        else
+            sink.writeStream(out);
+    }
+    if (diff)
+        diff->endInterval();
+}
+
+void report(void)
+{
+    size_t n = StackCollectorList.size();
+    std::vector<Report> reports(n);
+    std::vector<char> ok(n);
+    gatherAll(reports, ok, !MainConfig::shared);
+    if (MainConfig::shared)
+        // 共用的栈表只有一套栈id，在当前线程中对各采集器栈id的并集做一次符号解析
+        for (size_t i = 0; i < n; i++)
+            if (ok[i])
+                StackCollectorList[i]->symbolize(reports[i]);
+    emit(reports, ok);
+};
+
+/// @brief 读取各采集器本周期的数据，不解析调用栈，存入飞行记录器
+void record(void)
+{
+    size_t n = StackCollectorList.size();
+    std::vector<Report> reports(n);
+    std::vector<char> ok(n);
+    gatherAll(reports, ok, false);
+    Window w;
+    w.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        w.emplace_back(reports[i], ok[i]);
+    recorder->push(std::move(w));
+}
+
+/// @brief 按时间顺序解析并输出飞行记录器中的所有周期
+/// @note 解析在当前线程中依次进行，共用映射时也是安全的
+void dump(void)
+{
+    auto windows = recorder->take();
+    pending = -1;
+    fprintf(stderr, _RED "Dump %zu intervals around the event.\n" _RE, windows.size());
+    for (auto &w : windows)
+    {
+        std::vector<Report> reports(w.size());
+        std::vector<char> ok(w.size());
+        for (size_t i = 0; i < w.size(); i++)
+        {
+            w[i].restore(reports[i]);
+            if ((ok[i] = w[i].ok))
+                StackCollectorList[i]->symbolize(reports[i]);
+        }
+        emit(reports, ok);
+    }
+}
+
+/// @brief 根据上个周期的开销调整各采集器的采样频率
+/// @note 开销为本进程的CPU时间与各eBPF程序运行时间之和，后者需要-s开启运行时统计
+void adapt(void)
+{
+    static uint64_t last_wall = 0, last_cost = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t wall = ts.tv_sec * 1000000000ul + ts.tv_nsec;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    uint64_t cost = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ul +
+                    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ul;
+    for (auto Item : StackCollectorList)
+        cost += Item->progRunTime();
+    // 第一个周期只记录基准
+    if (last_wall)
+    {
+        double overhead = (double)(cost - last_cost) / (wall - last_wall);
+        for (auto Item : StackCollectorList)
+            Item->adaptRate(overhead, MainConfig::budget / 100);
+    }
+    last_wall = wall;
+    last_cost = cost;
+}
+
+// cgroup列表文件上次读取时的修改时间
+static struct timespec cgroup_mtime = {0, 0};
+
+/// @brief 解析-g给出的cgroup路径，路径无效时跳过
+/// @param ids 存放cgroup id到路径
+/// @return 没有设置cgroup或读取成功为真，读取列表文件失败或逗号分隔的路径中有无效路径时为假
+bool loadCgroups(std::map<uint64_t, std::string> &ids)
+{
+    auto &arg = MainConfig::cgroups;
+    ids.clear();
+    if (arg.empty())
+        return true;
+    bool list = arg[0] == '@';
+    std::string paths;
+    if (list)
+    {
+        struct stat st;
+        FILE *f = fopen(arg.c_str() + 1, "r");
+        if (!f || fstat(fileno(f), &st))
+        {
+            if (f)
+                fclose(f);
+            return false;
+        }
+        cgroup_mtime = st.st_mtim;
+        char line[PATH_MAX];
+        while (fgets(line, sizeof(line), f))
+        {
+            line[strcspn(line, "\r\n")] = '\0';
+            // 跳过空行和注释
+            if (line[0] && line[0] != '#')
+                paths += std::string(line) + '\n';
+        }
+        fclose(f);
+    }
+    else
+        paths = arg;
+    const char sep = list ? '\n' : ',';
+    bool ok = true;
+    for (size_t begin = 0, end; begin < paths.size(); begin = end + 1)
+    {
+        end = paths.find(sep, begin);
+        if (end == std::string::npos)
+            end = paths.size();
+        std::string path = paths.substr(begin, end - begin);
+        if (path.empty())
+            continue;
+        uint64_t id = get_cgroupid(path.c_str());
+        if (id)
+            ids[id] = path;
+        else
+            ok = false;
+    }
+    // 列表文件中的路径可能随容器的创建和销毁失效，只跳过无效的路径
+    return ok || list;
+}
+
+/// @brief cgroup列表文件变化时重新读取，并更新各采集器跟踪的cgroup
+/// @note 在主线程中两次读取计数之间调用，不与采集器读取计数并发
+void reloadCgroups(void)
+{
+    auto &arg = MainConfig::cgroups;
+    struct stat st;
+    if (arg.empty() || arg[0] != '@' || stat(arg.c_str() + 1, &st) ||
+        (st.st_mtim.tv_sec == cgroup_mtime.tv_sec && st.st_mtim.tv_nsec == cgroup_mtime.tv_nsec))
+        return;
+    std::map<uint64_t, std::string> ids;
+    if (!loadCgroups(ids))
+        return;
+    fprintf(stderr, _RED "Trace %zu cgroups from %s.\n" _RE, ids.size(), arg.c_str() + 1);
+    for (auto Item : StackCollectorList)
+        CHECK_ERR(continue, Item->setCgroups(ids), "Failed to set cgroups of %s", Item->getName());
+}
@@ -0,0 +1,713 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 离线符号解析：原始格式的编解码、调试文件的查找和按文件并行的符号解析
+
+#include "offline.h"
+#include "output.h"
+#include "worker.h"
+#include "clipp.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cxxabi.h>
+#include <zlib.h>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+
+// 第2版在计数的键中加入cgroup id，并在末尾加入cgroup路径表，仍可读取第1版
+#define RAW_MAGIC "SAR2"
+#define RAW_MAGIC_V1 "SAR1"
+
+/// @brief 映射整个只读文件，析构时解除映射
+class MappedFile
+{
+public:
+    const uint8_t *data = NULL;
+    size_t size = 0;
+
+    explicit MappedFile(const char *path)
+    {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (!fstat(fd, &st) && st.st_size > 0)
+        {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                data = (const uint8_t *)p;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+    ~MappedFile()
+    {
+        if (data)
+            munmap((void *)data, size);
+    }
+
+    /// @brief 检查是否为本机字节序的64位ELF文件，并返回其文件头
+    const Elf64_Ehdr *elf(void) const
+    {
+        auto eh = (const Elf64_Ehdr *)data;
+        if (size < sizeof(Elf64_Ehdr) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+            eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_ident[EI_DATA] != ELFDATA2LSB ||
+            eh->e_phoff + (uint64_t)eh->e_phnum * sizeof(Elf64_Phdr) > size ||
+            eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) > size)
+            return NULL;
+        return eh;
+    }
+};
+
+bool ElfIdent::toVaddr(uint64_t off, uint64_t &vaddr) const
+{
+    for (auto &l : loads)
+    {
+        if (off >= l.offset && off < l.offset + l.filesz)
+        {
+            vaddr = off - l.offset + l.vaddr;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool read_elf_ident(const char *path, ElfIdent &ident)
+{
+    MappedFile f(path);
+    auto eh = f.elf();
+    if (!eh)
+        return false;
+    auto ph = (const Elf64_Phdr *)(f.data + eh->e_phoff);
+    ident.build_id.clear();
+    ident.loads.clear();
+    for (int i = 0; i < eh->e_phnum; i++)
+    {
+        if (ph[i].p_type == PT_LOAD)
+            ident.loads.push_back({ph[i].p_offset, ph[i].p_vaddr, ph[i].p_filesz});
+        if (ph[i].p_type != PT_NOTE || ph[i].p_offset + ph[i].p_filesz > f.size)
+            continue;
+        // note的名称和描述均按4字节对齐
+        size_t pos = ph[i].p_offset, end = pos + ph[i].p_filesz;
+        while (ident.build_id.empty() && pos + sizeof(Elf64_Nhdr) <= end)
+        {
+            auto nh = (const Elf64_Nhdr *)(f.data + pos);
+            size_t name = pos + sizeof(Elf64_Nhdr), desc = name + ((nh->n_namesz + 3) & ~3u);
+            if (desc + nh->n_descsz > end)
+                break;
+            if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 && !memcmp(f.data + name, "GNU", 4))
+            {
+                char hex[3];
+                for (uint32_t j = 0; j < nh->n_descsz; j++)
+                {
+                    snprintf(hex, sizeof(hex), "%02x", f.data[desc + j]);
+                    ident.build_id += hex;
+                }
+            }
+            pos = desc + ((nh->n_descsz + 3) & ~3u);
+        }
+    }
+    return true;
+}
+
+std::string offline_frame(const std::string &id, uint64_t vaddr)
+{
+    char off[24];
+    snprintf(off, sizeof(off), "]+0x%lx", vaddr);
+    return "[" + id + off;
+}
+
+bool parse_offline_frame(const std::string &frame, std::string &id, uint64_t &vaddr)
+{
+    if (frame.size() < 5 || frame[0] != '[')
+        return false;
+    auto pos = frame.rfind("]+0x");
+    if (pos == std::string::npos || pos < 2)
+        return false;
+    id = frame.substr(1, pos - 1);
+    vaddr = strtoull(frame.c_str() + pos + 4, NULL, 16);
+    return true;
+}
+
+/// @brief 原始格式的编码缓冲区
+class RawWriter
+{
+public:
+    std::string buf;
+
+    void u(uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            buf.push_back((char)(v | 0x80));
+            v >>= 7;
+        }
+        buf.push_back((char)v);
+    }
+    void s(int64_t v) { u((uint64_t)v << 1 ^ (uint64_t)(v >> 63)); }
+    void str(const std::string &v)
+    {
+        u(v.size());
+        buf += v;
+    }
+};
+
+/// @brief 原始格式的解码器，越界后ok为假，之后读到的值均为0
+class RawReader
+{
+private:
+    const uint8_t *p, *end;
+
+public:
+    bool ok = true;
+    int version = 0;
+
+    RawReader(const std::string &data) : p((const uint8_t *)data.data()), end(p + data.size()) {}
+
+    bool magic(void)
+    {
+        ok = end - p >= 4;
+        version = !ok                             ? 0
+                  : !memcmp(p, RAW_MAGIC, 4)    ? 2
+                  : !memcmp(p, RAW_MAGIC_V1, 4) ? 1
+                                                : 0;
+        ok = version;
+        p += ok ? 4 : 0;
+        return ok;
+    }
+    uint64_t u(void)
+    {
+        uint64_t v = 0;
+        for (int shift = 0; ok; shift += 7)
+        {
+            if (p >= end || shift > 63)
+            {
+                ok = false;
+                return 0;
+            }
+            uint8_t b = *p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                break;
+        }
+        return v;
+    }
+    int64_t s(void)
+    {
+        uint64_t v = u();
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+    std::string str(void)
+    {
+        uint64_t n = u();
+        if (!ok || n > (uint64_t)(end - p))
+        {
+            ok = false;
+            return "";
+        }
+        std::string v((const char *)p, n);
+        p += n;
+        return v;
+    }
+    /// @brief 读取元素个数，个数不可能超过剩余字节数
+    uint64_t count(void)
+    {
+        uint64_t n = u();
+        if (n > (uint64_t)(end - p))
+            ok = false;
+        return ok ? n : 0;
+    }
+};
+
+std::string renderRaw(const Report &R)
+{
+    RawWriter W, M, F, T;
+    W.buf = RAW_MAGIC;
+    W.str(R.time);
+    W.str(R.name);
+    W.u(R.scale_num);
+    for (int i = 0; i < R.scale_num; i++)
+    {
+        W.str(R.scales[i].Type);
+        W.u(R.scales[i].Period);
+        W.str(R.scales[i].Unit);
+    }
+
+    // 栈帧是驻留的字符串，按指针去重
+    std::unordered_map<const std::string *, uint64_t> frames;
+    std::unordered_map<std::string, uint64_t> mods;
+    std::string id;
+    uint64_t vaddr;
+    for (auto &t : R.traces)
+    {
+        if (!t.second)
+            continue;
+        T.s(t.first);
+        T.u(t.second->size());
+        for (auto f : *t.second)
+        {
+            auto res = frames.emplace(f, frames.size());
+            T.u(res.first->second);
+            if (!res.second)
+                continue;
+            if (parse_offline_frame(*f, id, vaddr))
+            {
+                auto mod = mods.emplace(id, mods.size());
+                if (mod.second)
+                    M.str(id);
+                F.u(1);
+                F.u(mod.first->second);
+                F.u(vaddr);
+            }
+            else
+            {
+                F.u(0);
+                F.str(*f);
+            }
+        }
+    }
+    W.u(mods.size());
+    W.buf += M.buf;
+    W.u(frames.size());
+    W.buf += F.buf;
+    W.u(std::count_if(R.traces.begin(), R.traces.end(), [](const std::pair<const int32_t, const Frames *> &t)
+                      { return t.second != NULL; }));
+    W.buf += T.buf;
+
+    W.u(R.counts.size());
+    for (auto &i : R.counts)
+    {
+        W.u(i.k.pid);
+        W.s(i.k.usid);
+        W.s(i.k.ksid);
+        W.u(i.k.fid);
+        W.u(i.k.cgid);
+        for (int j = 0; j < R.scale_num; j++)
+            W.u(i.v[j]);
+    }
+    W.u(R.infos.size());
+    for (auto &i : R.infos)
+    {
+        W.u(i.first);
+        W.u(i.second.pid);
+        W.u(i.second.tgid);
+        W.str(i.second.comm);
+    }
+    W.u(R.cgroups.size());
+    for (auto &i : R.cgroups)
+    {
+        W.u(i.first);
+        W.str(i.second);
+    }
+    W.u(R.funcs.size());
+    for (auto &i : R.funcs)
+    {
+        W.u(i.first);
+        W.str(i.second);
+    }
+    W.u(R.cgroup_paths.size());
+    for (auto &i : R.cgroup_paths)
+    {
+        W.u(i.first);
+        W.str(i.second);
+    }
+    return W.buf;
+}
+
+/// @brief 解码后的一条记录，解析后的调用栈和计数值由其持有
+struct RawProfile
+{
+    std::string collector;
+    std::string name;
+    std::vector<Scale> scales;
+    std::vector<uint32_t> mods; // 文件表中各文件在全局文件表中的序号
+    struct Frame
+    {
+        bool offline;
+        uint32_t mod; // 全局文件表中的序号
+        uint64_t vaddr;
+        std::string str;
+    };
+    std::vector<Frame> frames;
+    std::map<int32_t, std::vector<uint64_t>> traces; // 栈id到栈帧序号
+    std::vector<psid> keys;
+    std::vector<uint64_t> vals;
+    std::map<int32_t, Frames> resolved;
+    Report R;
+};
+
+/// @brief 所有记录共用的文件表，每个文件只解析一次
+struct ModuleTable
+{
+    std::vector<std::string> ids;
+    std::unordered_map<std::string, uint32_t> index;
+    std::vector<std::vector<uint64_t>> addrs; // 各文件中出现过的地址
+    std::vector<std::unordered_map<uint64_t, std::string>> names;
+
+    uint32_t add(const std::string &id)
+    {
+        auto res = index.emplace(id, ids.size());
+        if (res.second)
+        {
+            ids.push_back(id);
+            addrs.emplace_back();
+            names.emplace_back();
+        }
+        return res.first->second;
+    }
+};
+
+static bool decode_raw(const std::string &data, RawProfile &P, ModuleTable &mods)
+{
+    RawReader in(data);
+    if (!in.magic())
+        return false;
+    P.R.time = in.str();
+    P.name = in.str();
+    uint64_t n = in.count();
+    for (uint64_t i = 0; i < n; i++)
+    {
+        Scale sc;
+        sc.Type = in.str();
+        sc.Period = in.u();
+        sc.Unit = in.str();
+        P.scales.push_back(sc);
+    }
+    n = in.count();
+    for (uint64_t i = 0; i < n; i++)
+        P.mods.push_back(mods.add(in.str()));
+    n = in.count();
+    for (uint64_t i = 0; i < n && in.ok; i++)
+    {
+        RawProfile::Frame f = {};
+        f.offline = in.u();
+        if (f.offline)
+        {
+            uint64_t m = in.u();
+            f.vaddr = in.u();
+            if (m >= P.mods.size())
+                return false;
+            f.mod = P.mods[m];
+            mods.addrs[f.mod].push_back(f.vaddr);
+        }
+        else
+            f.str = in.str();
+        P.frames.push_back(std::move(f));
+    }
+    n = in.count();
+    for (uint64_t i = 0; i < n && in.ok; i++)
+    {
+        auto &t = P.traces[in.s()];
+        uint64_t depth = in.count();
+        for (uint64_t j = 0; j < depth; j++)
+        {
+            uint64_t f = in.u();
+            if (f >= P.frames.size())
+                return false;
+            t.push_back(f);
+        }
+    }
+    n = in.count();
+    for (uint64_t i = 0; i < n && in.ok; i++)
+    {
+        psid k;
+        k.pid = in.u();
+        k.usid = in.s();
+        k.ksid = in.s();
+        k.fid = in.u();
+        k.cgid = in.version > 1 ? in.u() : 0;
+        P.keys.push_back(k);
+        for (size_t j = 0; j < P.scales.size(); j++)
+            P.vals.push_back(in.u());
+    }
+    n = in.count();
+    for (uint64_t i = 0; i < n && in.ok; i++)
+    {
+        auto &info = P.R.infos[in.u()];
+        info.pid = in.u();
+        info.tgid = in.u();
+        snprintf(info.comm, sizeof(info.comm), "%s", in.str().c_str());
+    }
+    n = in.count();
+    for (uint64_t i = 0; i < n && in.ok; i++)
+    {
+        uint32_t tgid = in.u();
+        P.R.cgroups[tgid] = in.str();
+    }
+    n = in.count();
+    for (uint64_t i = 0; i < n && in.ok; i++)
+    {
+        uint32_t fid = in.u();
+        P.R.funcs[fid] = in.str();
+    }
+    if (in.version > 1)
+    {
+        n = in.count();
+        for (uint64_t i = 0; i < n && in.ok; i++)
+        {
+            uint64_t cgid = in.u();
+            P.R.cgroup_paths[cgid] = in.str();
+        }
+    }
+    return in.ok;
+}
+
+/// @brief 一个调试文件的函数符号表，地址为ELF中的虚拟地址
+class OfflineSymtab
+{
+private:
+    struct Sym
+    {
+        uint64_t start, size;
+        size_t name;
+    };
+    std::vector<Sym> syms;
+    std::string names;
+
+public:
+    bool load(const char *path)
+    {
+        MappedFile f(path);
+        auto eh = f.elf();
+        if (!eh)
+            return false;
+        auto sh = (const Elf64_Shdr *)(f.data + eh->e_shoff);
+        for (int i = 0; i < eh->e_shnum; i++)
+        {
+            if ((sh[i].sh_type != SHT_SYMTAB && sh[i].sh_type != SHT_DYNSYM) ||
+                sh[i].sh_link >= eh->e_shnum || sh[i].sh_offset + sh[i].sh_size > f.size)
+                continue;
+            auto &str = sh[sh[i].sh_link];
+            if (str.sh_type != SHT_STRTAB || str.sh_offset + str.sh_size > f.size)
+                continue;
+            auto sym = (const Elf64_Sym *)(f.data + sh[i].sh_offset);
+            size_t n = sh[i].sh_size / sizeof(Elf64_Sym);
+            for (size_t j = 0; j < n; j++)
+            {
+                int type = ELF64_ST_TYPE(sym[j].st_info);
+                if ((type != STT_FUNC && type != STT_GNU_IFUNC) || !sym[j].st_value ||
+                    sym[j].st_shndx == SHN_UNDEF || sym[j].st_name >= str.sh_size)
+                    continue;
+                auto name = (const char *)f.data + str.sh_offset + sym[j].st_name;
+                syms.push_back({sym[j].st_value, sym[j].st_size, names.size()});
+                names.append(name, strnlen(name, str.sh_size - sym[j].st_name));
+                names.push_back('\0');
+            }
+        }
+        std::sort(syms.begin(), syms.end(), [](const Sym &a, const Sym &b)
+                  { return a.start < b.start; });
+        return true;
+    }
+
+    /// @return 与在线解析相同格式的栈帧，找不到时为"[unknown]"
+    std::string resolve(uint64_t vaddr) const
+    {
+        auto it = std::upper_bound(syms.begin(), syms.end(), vaddr, [](uint64_t v, const Sym &s)
+                                   { return v < s.start; });
+        // 大小为0的符号可能遮住覆盖该地址的函数，向前多看几个
+        for (int k = 0; k < 4 && it != syms.begin(); k++)
+        {
+            --it;
+            if (vaddr < it->start + it->size)
+            {
+                const char *name = names.c_str() + it->name;
+                std::string res = name;
+                if (name[0] == '_' && name[1] == 'Z')
+                {
+                    char *demangled = abi::__cxa_demangle(name, NULL, NULL, NULL);
+                    if (demangled)
+                    {
+                        clearSpace(demangled);
+                        res = demangled;
+                        free(demangled);
+                    }
+                }
+                return res + "+" + std::to_string(vaddr - it->start);
+            }
+        }
+        return "[unknown]";
+    }
+};
+
+/// @brief 在调试文件目录中查找文件，依次尝试.build-id目录、debuginfod缓存的布局和原路径
+static std::string find_debug_file(const std::string &dir, const std::string &id)
+{
+    std::vector<std::string> cands;
+    if (id[0] == '/')
+    {
+        // 没有build-id的文件以路径标识
+        cands = {dir + id + ".debug", dir + id, id};
+    }
+    else if (id.size() > 2)
+    {
+        auto sub = dir + "/.build-id/" + id.substr(0, 2) + "/" + id.substr(2);
+        cands = {sub + ".debug", sub, dir + "/" + id + "/debuginfo", dir + "/" + id + "/executable"};
+    }
+    for (auto &c : cands)
+        if (!access(c.c_str(), R_OK))
+            return c;
+    return "";
+}
+
+/// @brief 读取输入中的所有记录，gzip压缩的记录先解压
+/// @note 记录格式与OutputSink::writeRecord一致
+static bool read_records(FILE *f, std::vector<std::pair<std::string, std::string>> &records)
+{
+    auto get_len = [f](uint32_t &n)
+    {
+        unsigned char b[4];
+        if (fread(b, 1, 4, f) != 4)
+            return false;
+        n = (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+        return true;
+    };
+    uint32_t n;
+    while (get_len(n))
+    {
+        std::string name(n, '\0'), body;
+        CHECK_ERR(return false, fread(&name[0], 1, n, f) != n || !get_len(n), "Truncated record");
+        body.resize(n);
+        CHECK_ERR(return false, fread(&body[0], 1, n, f) != n, "Truncated record %s", name.c_str());
+        if (n >= 2 && (uint8_t)body[0] == 0x1f && (uint8_t)body[1] == 0x8b)
+        {
+            z_stream z = {};
+            CHECK_ERR(return false, inflateInit2(&z, 15 + 16) != Z_OK, "Failed to init gzip stream");
+            std::string out;
+            char buf[1 << 16];
+            z.next_in = (Bytef *)body.data();
+            z.avail_in = body.size();
+            int ret;
+            do
+            {
+                z.next_out = (Bytef *)buf;
+                z.avail_out = sizeof(buf);
+                ret = inflate(&z, Z_NO_FLUSH);
+                out.append(buf, sizeof(buf) - z.avail_out);
+            } while (ret == Z_OK);
+            inflateEnd(&z);
+            CHECK_ERR(return false, ret != Z_STREAM_END, "Failed to decompress record %s", name.c_str());
+            body.swap(out);
+        }
+        records.emplace_back(std::move(name), std::move(body));
+    }
+    return true;
+}
+
+int symbolize_main(int argc, char *argv[])
+{
+    std::string input, output, dir = "/usr/lib/debug";
+    OutputFormat format = OUTPUT_TEXT;
+    bool gzip = false;
+    auto cli = ((clipp::value("input", input) %
+                 "Raw profile written with " _ERED "-O raw" _RE ", - for stdin"),
+                (clipp::option("-d") &
+                 clipp::value("dir", dir)) %
+                    "Set the debug file directory searched by build-id; default is /usr/lib/debug",
+                (clipp::option("-O") &
+                 (clipp::required("text").set(format, OUTPUT_TEXT) |
+                  clipp::required("folded").set(format, OUTPUT_FOLDED) |
+                  clipp::required("pprof").set(format, OUTPUT_PPROF))) %
+                    "Set the output format; default is text",
+                (clipp::option("-w") &
+                 clipp::value("output", output)) %
+                    "Set the output file, or unix socket as " _ERED "unix:<path>" _RE "; default is stdout",
+                clipp::option("-z").set(gzip) %
+                    "Compress the output with gzip");
+    if (!clipp::parse(argc, argv, cli))
+    {
+        std::cerr << clipp::make_man_page(cli, "stack_analyzer symbolize") << std::endl;
+        return -1;
+    }
+
+    FILE *f = input == "-" ? stdin : fopen(input.c_str(), "r");
+    CHECK_ERR_RN1(!f, "Failed to open %s", input.c_str());
+    std::vector<std::pair<std::string, std::string>> records;
+    bool read_ok = read_records(f, records);
+    if (f != stdin)
+        fclose(f);
+    if (!read_ok)
+        return -1;
+
+    ModuleTable mods;
+    std::vector<RawProfile> profiles(records.size());
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        profiles[i].collector = records[i].first;
+        CHECK_ERR_RN1(!decode_raw(records[i].second, profiles[i], mods),
+                      "Record %zu (%s) is not a raw profile", i, records[i].first.c_str());
+    }
+    records.clear();
+
+    // 每个文件的符号表只加载一次，不同文件在线程池中并行解析
+    {
+        WorkerPool pool(std::thread::hardware_concurrency());
+        std::vector<std::future<void>> done;
+        for (size_t m = 0; m < mods.ids.size(); m++)
+            done.push_back(pool.submit([m, &mods, &dir]
+                                       {
+                auto &addrs = mods.addrs[m];
+                auto &names = mods.names[m];
+                std::sort(addrs.begin(), addrs.end());
+                addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+                OfflineSymtab tab;
+                auto path = find_debug_file(dir, mods.ids[m]);
+                bool loaded = path.size() && tab.load(path.c_str());
+                if (!loaded)
+                    fprintf(stderr, _ERED "No debug file for %s\n" _RE, mods.ids[m].c_str());
+                for (auto a : addrs)
+                    names[a] = loaded ? tab.resolve(a) : "[unknown]"; }));
+        for (auto &d : done)
+            d.get();
+    }
+
+    OutputSink sink;
+    CHECK_ERR_RN1(sink.open(output, gzip), "Failed to open output");
+    std::unordered_set<std::string> strings;
+    for (auto &P : profiles)
+    {
+        std::vector<const std::string *> frames(P.frames.size());
+        for (size_t i = 0; i < P.frames.size(); i++)
+        {
+            auto &fr = P.frames[i];
+            frames[i] = &*strings.insert(fr.offline ? mods.names[fr.mod][fr.vaddr] : fr.str).first;
+        }
+        for (auto &t : P.traces)
+        {
+            auto &res = P.resolved[t.first];
+            for (auto f : t.second)
+                res.push_back(frames[f]);
+            P.R.traces[t.first] = &res;
+        }
+        P.R.name = P.name.c_str();
+        P.R.scales = P.scales.data();
+        P.R.scale_num = P.scales.size();
+        for (size_t i = 0; i < P.keys.size(); i++)
+            P.R.counts.emplace_back(P.keys[i], P.vals.data() + i * P.scales.size());
+
+        if (format == OUTPUT_PPROF)
+            sink.writeRecord(P.collector, renderPprof(P.R));
+        else
+            sink.writeStream(format == OUTPUT_TEXT ? renderText(P.R) : renderFolded(P.R));
+    }
+    sink.close();
+    return 0;
+}
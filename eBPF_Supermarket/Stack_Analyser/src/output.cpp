@@ -0,0 +1,522 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 采集数据的输出格式和输出目标的实现
+
+#include "output.h"
+#include "user.h"
+
+#include <sstream>
+#include <unordered_map>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/// @brief 计数项所属cgroup的名称，有路径时为路径，否则为进程所在cgroup的名称，都没有时为id
+static std::string cgroupName(const Report &R, const psid &id)
+{
+    auto path = R.cgroup_paths.find(id.cgid);
+    if (path != R.cgroup_paths.end())
+        return path->second;
+    auto info = R.infos.find(id.pid);
+    if (info != R.infos.end())
+    {
+        auto group = R.cgroups.find(info->second.tgid);
+        if (group != R.cgroups.end() && group->second.size())
+            return group->second;
+    }
+    return std::to_string(id.cgid);
+}
+
+std::string renderText(const Report &R)
+{
+    std::ostringstream oss;
+    oss << _RED "time:" << R.time << _RE "\n";
+
+    // 同时探测多个函数时计数的键多出函数id一列
+    bool fid = R.funcs.size();
+    // 按cgroup区分时计数的键多出cgroup id一列
+    bool cgid = std::any_of(R.counts.begin(), R.counts.end(), [](const CountItem &i)
+                            { return i.k.cgid; });
+    oss << _BLUE "counts:" _RE "\n";
+    {
+        oss << _GREEN "pid\tusid\tksid" << (fid ? "\tfid" : "") << (cgid ? "\tcgid" : "");
+        for (int i = 0; i < R.scale_num; i++)
+            oss << '\t' << R.scales[i].Type << "/" << R.scales[i].Period << R.scales[i].Unit;
+        oss << _RE "\n";
+        for (auto &i : R.counts)
+        {
+            auto &id = i.k;
+            oss << id.pid << '\t' << id.usid << '\t' << id.ksid;
+            if (fid)
+                oss << '\t' << id.fid;
+            if (cgid)
+                oss << '\t' << id.cgid;
+            for (int j = 0; j < R.scale_num; j++)
+                oss << '\t' << i.v[j];
+            oss << '\n';
+        }
+    }
+
+    oss << _BLUE "traces:" _RE "\n";
+    {
+        oss << _GREEN "sid\ttrace" _RE "\n";
+        for (auto i : R.traces)
+        {
+            oss << i.first << "\t";
+            for (auto s : *i.second)
+                oss << *s << ';';
+            oss << "\n";
+        }
+    }
+
+    if (cgid)
+    {
+        oss << _BLUE "cgroups:" _RE "\n"
+            << _GREEN "cgid\tcgroup" _RE "\n";
+        std::map<uint64_t, std::string> names;
+        for (auto &i : R.counts)
+            if (i.k.cgid && !names.count(i.k.cgid))
+                names[i.k.cgid] = cgroupName(R, i.k);
+        for (auto &i : names)
+            oss << i.first << '\t' << i.second << '\n';
+    }
+
+    oss << _BLUE "info:" _RE "\n";
+    {
+        oss << _GREEN "pid\tNSpid\tcomm\ttgid\tcgroup\t" _RE "\n";
+        for (auto &i : R.infos)
+        {
+            auto group = R.cgroups.find(i.second.tgid);
+            oss << i.first << '\t'
+                << i.second.pid << '\t'
+                << i.second.comm << '\t'
+                << i.second.tgid << '\t'
+                << (group == R.cgroups.end() ? "" : group->second) << '\n';
+        }
+    }
+
+    // 只有流式采集时才有唤醒关系
+    if (R.wakes.size())
+    {
+        oss << _BLUE "wakes:" _RE "\n"
+            << _GREEN "waker_pid\twaker_usid\twaker_ksid\twakee_pid\twakee_usid\twakee_ksid\tcount\ttime" _RE "\n";
+        for (auto &i : R.wakes)
+            oss << i.waker.pid << '\t' << i.waker.usid << '\t' << i.waker.ksid << '\t'
+                << i.wakee.pid << '\t' << i.wakee.usid << '\t' << i.wakee.ksid << '\t'
+                << i.count << '\t' << i.time << '\n';
+    }
+
+    // 只有限制了频率的采集器才有采样统计，计数乘以seen/taken即为还原的值
+    if (R.sample_seen)
+    {
+        oss << _BLUE "sampling:" _RE "\n"
+            << _GREEN "rate\tseen\ttaken\tratio" _RE "\n"
+            << R.rate << '\t' << R.sample_seen << '\t' << R.sample_taken << '\t'
+            << (double)R.sample_taken / R.sample_seen << '\n';
+    }
+
+    // 只有按哈希去重调用栈时才有冲突统计
+    if (R.stack_lookups)
+    {
+        oss << _BLUE "stacks:" _RE "\n"
+            << _GREEN "lookups\tcollisions\trate" _RE "\n"
+            << R.stack_lookups << '\t' << R.stack_collisions << '\t'
+            << (double)R.stack_collisions / R.stack_lookups << '\n';
+    }
+
+    if (fid)
+    {
+        oss << _BLUE "funcs:" _RE "\n"
+            << _GREEN "fid\tname" _RE "\n";
+        for (auto &i : R.funcs)
+            oss << i.first << '\t' << i.second << '\n';
+    }
+
+    // 每个函数只列出非空的桶，区间为[from, to)纳秒
+    if (R.hists.size())
+    {
+        oss << _BLUE "hists:" _RE "\n"
+            << _GREEN "fid\tfrom\tto\tcount" _RE "\n";
+        for (auto &i : R.hists)
+            for (size_t j = 0; j < i.second.size(); j++)
+                if (i.second[j])
+                    oss << i.first << '\t' << (j ? 1ull << j : 0) << '\t'
+                        << (j + 1 < i.second.size() ? std::to_string(1ull << (j + 1)) : "inf") << '\t'
+                        << i.second[j] << '\n';
+    }
+
+    oss << _BLUE "OK" _RE "\n";
+    return oss.str();
+}
+
+/// @brief 查找一条计数对应的栈，没有时为NULL
+static const Frames *findTrace(const Report &R, int32_t sid)
+{
+    if (sid <= 0)
+        return NULL;
+    auto t = R.traces.find(sid);
+    return t == R.traces.end() ? NULL : t->second;
+}
+
+std::string renderFolded(const Report &R)
+{
+    std::string out;
+    for (auto &i : R.counts)
+    {
+        auto &id = i.k;
+        out += R.name;
+        out += ';';
+        // 按cgroup区分时cgroup作为采集器下的第一层栈帧
+        if (id.cgid)
+        {
+            for (auto c : cgroupName(R, id))
+                out += c == ';' ? '_' : c;
+            out += ';';
+        }
+        auto info = R.infos.find(id.pid);
+        // 进程名中的分号会被当作栈帧的分隔符
+        for (const char *c = info == R.infos.end() ? "" : info->second.comm; *c; c++)
+            out += *c == ';' ? '_' : *c;
+        for (auto t : {findTrace(R, id.usid), findTrace(R, id.ksid)})
+        {
+            if (!t)
+                continue;
+            for (auto s : *t)
+            {
+                out += ';';
+                out += *s;
+            }
+        }
+        // 被探测的函数作为最上层的栈帧
+        auto func = R.funcs.find(id.fid);
+        if (func != R.funcs.end())
+        {
+            out += ';';
+            out += func->second;
+        }
+        out += ' ';
+        out += std::to_string(i.v[0]);
+        out += '\n';
+    }
+    return out;
+}
+
+/// @brief protobuf编码缓冲区，只实现profile.proto用到的varint和长度前缀两种类型
+class ProtoBuf
+{
+public:
+    std::string buf;
+
+    void varint(uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            buf.push_back((char)(v | 0x80));
+            v >>= 7;
+        }
+        buf.push_back((char)v);
+    }
+    void key(int field, int wire) { varint((uint64_t)field << 3 | wire); }
+    void num(int field, uint64_t v)
+    {
+        if (!v)
+            return;
+        key(field, 0);
+        varint(v);
+    }
+    void bytes(int field, const std::string &s)
+    {
+        key(field, 2);
+        varint(s.size());
+        buf += s;
+    }
+    void msg(int field, const ProtoBuf &m) { bytes(field, m.buf); }
+    void packed(int field, const std::vector<uint64_t> &v)
+    {
+        if (v.empty())
+            return;
+        ProtoBuf p;
+        for (auto i : v)
+            p.varint(i);
+        bytes(field, p.buf);
+    }
+};
+
+/// @brief 构造pprof的Profile消息，去重字符串、函数和位置
+class PprofBuilder
+{
+private:
+    // profile.proto中Profile消息的字段号
+    enum
+    {
+        SAMPLE_TYPE = 1,
+        SAMPLE = 2,
+        LOCATION = 4,
+        FUNCTION = 5,
+        STRING_TABLE = 6,
+        TIME_NANOS = 9,
+        PERIOD_TYPE = 11,
+        PERIOD = 12,
+    };
+
+    ProtoBuf profile;
+    ProtoBuf strtab;
+    std::unordered_map<std::string, uint64_t> strings;
+    std::unordered_map<uint64_t, uint64_t> functions;          // 函数名的字符串索引到函数id
+    std::unordered_map<const std::string *, uint64_t> locations; // 驻留的栈帧到位置id
+
+public:
+    PprofBuilder() { str(""); }
+
+    uint64_t str(const std::string &s)
+    {
+        auto res = strings.emplace(s, strings.size());
+        if (res.second)
+            strtab.bytes(STRING_TABLE, s);
+        return res.first->second;
+    }
+
+    ProtoBuf valueType(const std::string &type, const std::string &unit)
+    {
+        ProtoBuf vt;
+        vt.num(1, str(type));
+        vt.num(2, str(unit));
+        return vt;
+    }
+
+    /// @brief 栈帧形如"name+offset"，同一函数的不同偏移是不同的位置
+    uint64_t location(const std::string *frame)
+    {
+        auto res = locations.emplace(frame, locations.size() + 1);
+        if (!res.second)
+            return res.first->second;
+        auto name = str(frame->substr(0, frame->rfind('+')));
+        auto fn = functions.emplace(name, functions.size() + 1);
+        if (fn.second)
+        {
+            ProtoBuf f;
+            f.num(1, fn.first->second);
+            f.num(2, name);
+            f.num(3, name);
+            profile.msg(FUNCTION, f);
+        }
+        ProtoBuf line, loc;
+        line.num(1, fn.first->second);
+        loc.num(1, res.first->second);
+        loc.msg(4, line);
+        profile.msg(LOCATION, loc);
+        return res.first->second;
+    }
+
+    void sampleType(const std::string &type, const std::string &unit)
+    {
+        profile.msg(SAMPLE_TYPE, valueType(type, unit));
+    }
+
+    void period(const std::string &type, const std::string &unit, uint64_t period)
+    {
+        profile.msg(PERIOD_TYPE, valueType(type, unit));
+        profile.num(PERIOD, period);
+    }
+
+    void timeNanos(uint64_t t) { profile.num(TIME_NANOS, t); }
+
+    void sample(const ProtoBuf &s) { profile.msg(SAMPLE, s); }
+
+    std::string finish(void) { return profile.buf + strtab.buf; }
+};
+
+std::string renderPprof(const Report &R)
+{
+    PprofBuilder B;
+    for (int i = 0; i < R.scale_num; i++)
+        B.sampleType(R.scales[i].Type, R.scales[i].Unit);
+    if (R.scale_num)
+        B.period(R.scales[0].Type, R.scales[0].Unit, R.scales[0].Period);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    B.timeNanos(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+
+    std::vector<uint64_t> locs, vals;
+    for (auto &i : R.counts)
+    {
+        auto &id = i.k;
+        // 位置由栈顶到栈底排列，内核栈在用户栈之上
+        locs.clear();
+        for (auto t : {findTrace(R, id.ksid), findTrace(R, id.usid)})
+        {
+            if (!t)
+                continue;
+            for (auto s = t->rbegin(); s != t->rend(); s++)
+                locs.push_back(B.location(*s));
+        }
+        vals.assign(i.v, i.v + R.scale_num);
+
+        ProtoBuf s;
+        s.packed(1, locs);
+        s.packed(2, vals);
+        auto label = [&](const char *key, const std::string *str, uint64_t num)
+        {
+            ProtoBuf l;
+            l.num(1, B.str(key));
+            if (str)
+                l.num(2, B.str(*str));
+            else
+                l.num(3, num);
+            s.msg(3, l);
+        };
+        label("pid", NULL, id.pid);
+        if (id.cgid)
+        {
+            std::string group = cgroupName(R, id);
+            label("cgroup_id", NULL, id.cgid);
+            label("cgroup", &group, 0);
+        }
+        auto func = R.funcs.find(id.fid);
+        if (func != R.funcs.end())
+            label("function", &func->second, 0);
+        auto info = R.infos.find(id.pid);
+        if (info != R.infos.end())
+        {
+            std::string comm = info->second.comm;
+            label("tgid", NULL, info->second.tgid);
+            label("nspid", NULL, info->second.pid);
+            label("comm", &comm, 0);
+            auto group = R.cgroups.find(info->second.tgid);
+            if (group != R.cgroups.end() && group->second.size())
+                label("container_id", &group->second, 0);
+        }
+        B.sample(s);
+    }
+    return B.finish();
+}
+
+OutputSink::~OutputSink()
+{
+    close();
+}
+
+int OutputSink::open(const std::string &path, bool compress)
+{
+    gzip = compress;
+    if (path.compare(0, 5, "unix:") == 0)
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        CHECK_ERR_RN1(path.size() - 5 >= sizeof(addr.sun_path), "Socket path %s is too long", path.c_str());
+        strcpy(addr.sun_path, path.c_str() + 5);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        CHECK_ERR_RN1(fd < 0, "Failed to create unix socket");
+        CHECK_ERR(::close(fd); return -1, connect(fd, (struct sockaddr *)&addr, sizeof(addr)), "Failed to connect %s", path.c_str());
+        f = fdopen(fd, "w");
+    }
+    else if (path.size())
+        f = fopen(path.c_str(), "w");
+    CHECK_ERR_RN1(!f, "Failed to open output %s", path.c_str());
+    // 对端关闭套接字时由写入返回错误，而不是被信号终止
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+int OutputSink::put(const void *data, size_t len)
+{
+    CHECK_ERR_RN1(fwrite(data, 1, len, f) != len, "Failed to write output");
+    return 0;
+}
+
+int OutputSink::deflateTo(const std::string &data, int flush)
+{
+    unsigned char out[1 << 16];
+    zs.next_in = (Bytef *)data.data();
+    zs.avail_in = data.size();
+    do
+    {
+        zs.next_out = out;
+        zs.avail_out = sizeof(out);
+        CHECK_ERR_RN1(deflate(&zs, flush) == Z_STREAM_ERROR, "Failed to compress output");
+        if (put(out, sizeof(out) - zs.avail_out))
+            return -1;
+    } while (zs.avail_out == 0);
+    return 0;
+}
+
+int OutputSink::writeStream(const std::string &data)
+{
+    if (!gzip)
+    {
+        if (put(data.data(), data.size()))
+            return -1;
+        return fflush(f);
+    }
+    if (!zinit)
+    {
+        zs = {};
+        // windowBits加16生成gzip格式
+        CHECK_ERR_RN1(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK,
+                      "Failed to init gzip stream");
+        zinit = true;
+    }
+    // 同步刷新使读取方能及时解压出完整的周期数据
+    if (deflateTo(data, Z_SYNC_FLUSH))
+        return -1;
+    return fflush(f);
+}
+
+int OutputSink::writeRecord(const std::string &name, const std::string &data)
+{
+    std::string payload;
+    if (gzip)
+    {
+        z_stream z = {};
+        CHECK_ERR_RN1(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK,
+                      "Failed to init gzip stream");
+        payload.resize(deflateBound(&z, data.size()) + 32);
+        z.next_in = (Bytef *)data.data();
+        z.avail_in = data.size();
+        z.next_out = (Bytef *)&payload[0];
+        z.avail_out = payload.size();
+        int ret = deflate(&z, Z_FINISH);
+        payload.resize(z.total_out);
+        deflateEnd(&z);
+        CHECK_ERR_RN1(ret != Z_STREAM_END, "Failed to compress output");
+    }
+    const std::string &body = gzip ? payload : data;
+    auto put_len = [this](uint32_t n)
+    {
+        unsigned char b[4] = {(unsigned char)(n >> 24), (unsigned char)(n >> 16),
+                              (unsigned char)(n >> 8), (unsigned char)n};
+        return put(b, sizeof(b));
+    };
+    if (put_len(name.size()) || put(name.data(), name.size()) ||
+        put_len(body.size()) || put(body.data(), body.size()))
+        return -1;
+    return fflush(f);
+}
+
+void OutputSink::close(void)
+{
+    if (zinit)
+    {
+        deflateTo("", Z_FINISH);
+        deflateEnd(&zs);
+        zinit = false;
+    }
+    if (f && f != stdout)
+        fclose(f);
+    else if (f)
+        fflush(f);
+    f = NULL;
+}
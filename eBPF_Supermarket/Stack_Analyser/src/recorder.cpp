@@ -0,0 +1,101 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 飞行记录器的实现
+
+#include "recorder.h"
+
+Snapshot::Snapshot(const Report &R, bool ok)
+    : ok(ok), time(R.time), name(R.name), scales(R.scales), scale_num(R.scale_num),
+      wakes(R.wakes), rate(R.rate), sample_seen(R.sample_seen), sample_taken(R.sample_taken),
+      stack_lookups(R.stack_lookups), stack_collisions(R.stack_collisions),
+      funcs(R.funcs), hists(R.hists), cgroup_paths(R.cgroup_paths)
+{
+    keys.reserve(R.counts.size());
+    vals.reserve(R.counts.size() * scale_num);
+    for (auto &i : R.counts)
+    {
+        keys.push_back(i.k);
+        vals.insert(vals.end(), i.v, i.v + scale_num);
+    }
+}
+
+void Snapshot::restore(Report &R) const
+{
+    R.time = time;
+    R.name = name;
+    R.scales = scales;
+    R.scale_num = scale_num;
+    R.counts.clear();
+    R.counts.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        // 报告只读取计数值，去掉const不会修改快照
+        R.counts.emplace_back(keys[i], const_cast<uint64_t *>(vals.data()) + i * scale_num);
+    R.traces.clear();
+    R.infos.clear();
+    R.cgroups.clear();
+    R.wakes = wakes;
+    R.rate = rate;
+    R.sample_seen = sample_seen;
+    R.sample_taken = sample_taken;
+    R.stack_lookups = stack_lookups;
+    R.stack_collisions = stack_collisions;
+    R.funcs = funcs;
+    R.hists = hists;
+    R.cgroup_paths = cgroup_paths;
+}
+
+size_t Snapshot::bytes(void) const
+{
+    size_t n = sizeof(*this) + time.capacity() + keys.capacity() * sizeof(psid) +
+               vals.capacity() * sizeof(uint64_t) + wakes.capacity() * sizeof(WakeEdge);
+    // 有序表的每个节点按三个指针和颜色估计额外开销
+    for (auto &i : funcs)
+        n += 4 * sizeof(void *) + sizeof(i) + i.second.capacity();
+    for (auto &i : hists)
+        n += 4 * sizeof(void *) + sizeof(i) + i.second.capacity() * sizeof(uint64_t);
+    for (auto &i : cgroup_paths)
+        n += 4 * sizeof(void *) + sizeof(i) + i.second.capacity();
+    return n;
+}
+
+size_t FlightRecorder::bytes(const Window &w)
+{
+    size_t n = 0;
+    for (auto &s : w)
+        n += s.bytes();
+    return n;
+}
+
+void FlightRecorder::push(Window &&w)
+{
+    size_t n = bytes(w);
+    while (!windows.empty() && used + n > budget)
+    {
+        used -= bytes(windows.front());
+        windows.pop_front();
+    }
+    used += n;
+    windows.push_back(std::move(w));
+}
+
+std::deque<Window> FlightRecorder::take(void)
+{
+    std::deque<Window> res;
+    res.swap(windows);
+    used = 0;
+    return res;
+}
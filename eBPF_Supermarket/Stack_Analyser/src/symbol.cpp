@@ -0,0 +1,456 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 跨输出周期的符号解析缓存，实现栈帧缓存和栈id记忆表
+
+#include "symbol.h"
+#include "trace.h"
+#include "user.h"
+
+#include <sys/stat.h>
+#include <signal.h>
+#include <errno.h>
+#include <cxxabi.h>
+#include <algorithm>
+
+Symbolizer symbolizer;
+
+/// @brief 读取进程启动时间，即/proc/<pid>/stat的第22个字段
+static uint64_t proc_start_time(uint32_t tgid)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%u/stat", tgid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+    // comm字段可能含有空格，从最后一个')'之后开始数
+    char *p = strrchr(buf, ')');
+    if (!p)
+        return 0;
+    unsigned long long start = 0;
+    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &start);
+    return start;
+}
+
+/// @brief 计算/proc/<pid>/maps内容的指纹，用于判断映射是否变化
+static uint64_t proc_maps_hash(uint32_t tgid)
+{
+    char path[64], buf[4096];
+    snprintf(path, sizeof(path), "/proc/%u/maps", tgid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    uint64_t h = 0xcbf29ce484222325ull;
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+        for (size_t i = 0; i < len; i++)
+            h = (h ^ (uint8_t)buf[i]) * 0x100000001b3ull;
+    fclose(f);
+    return h;
+}
+
+#ifdef USE_BLAZESYM
+/// @brief 生成blazesym解析出的栈帧，附上源码文件名和行号
+/// @note 与ELF符号表解析的栈帧一样去掉名称中的空格
+static std::string blaze_frame(const char *name, const std::string &suffix, const blaze_symbolize_code_info *info)
+{
+    std::string frame = name ? name : "[unknown]";
+    frame.erase(std::remove(frame.begin(), frame.end(), ' '), frame.end());
+    frame += suffix;
+    if (info && info->file)
+        frame += "@" + std::string(info->file) + ":" + std::to_string(info->line);
+    return frame;
+}
+#endif
+
+Symbolizer::~Symbolizer()
+{
+#ifdef USE_BLAZESYM
+    if (blazer)
+        blaze_symbolizer_free(blazer);
+#endif
+}
+
+const std::string *Symbolizer::intern(std::string &&s)
+{
+    std::lock_guard<std::mutex> lock(smutex);
+    auto it = strings.find(s);
+    if (it != strings.end())
+        return &*it;
+    // 移动节点不改变字符串的地址
+    auto node = old_strings.extract(s);
+    if (!node.empty())
+        return &*strings.insert(std::move(node)).position;
+    return &*strings.insert(std::move(s)).first;
+}
+
+const std::string *Symbolizer::keep(const std::string *s)
+{
+    std::lock_guard<std::mutex> lock(smutex);
+    auto node = old_strings.extract(*s);
+    if (!node.empty())
+        strings.insert(std::move(node));
+    return s;
+}
+
+void Symbolizer::rotate(void)
+{
+    std::lock_guard<std::mutex> klock(kmutex);
+    std::lock_guard<std::mutex> slock(smutex);
+    bool full = strings.size() > SYMBOL_CACHE_MAX || uframes.size() > SYMBOL_CACHE_MAX ||
+                kframes.size() > SYMBOL_CACHE_MAX;
+#ifdef USE_BLAZESYM
+    full = full || uinlines.size() > SYMBOL_CACHE_MAX;
+#endif
+    if (!full)
+        return;
+    // 当前代的栈帧只指向当前代的字符串，两者一起降为上一代
+    old_strings = std::move(strings);
+    old_uframes = std::move(uframes);
+    old_kframes = std::move(kframes);
+    strings.clear();
+    uframes.clear();
+    kframes.clear();
+#ifdef USE_BLAZESYM
+    old_uinlines = std::move(uinlines);
+    uinlines.clear();
+#endif
+    generation++;
+}
+
+#ifdef USE_BLAZESYM
+Frames *Symbolizer::findInlines(const FrameKey &key)
+{
+    auto it = uinlines.find(key);
+    if (it != uinlines.end())
+        return &it->second;
+    auto old = old_uinlines.find(key);
+    if (old == old_uinlines.end())
+        return NULL;
+    for (auto f : old->second)
+        keep(f);
+    auto &frames = uinlines[key] = std::move(old->second);
+    old_uinlines.erase(old);
+    return &frames;
+}
+#endif
+
+void Symbolizer::newInterval(void)
+{
+    std::lock_guard<std::mutex> lock(umutex);
+    interval++;
+    for (auto it = procs.begin(); it != procs.end();)
+    {
+        // 本周期和上周期都出现过的进程必然存活，不必检查
+        if (it->second.checked + 1 < interval && kill(it->first, 0) && errno == ESRCH)
+            it = procs.erase(it);
+        else
+            ++it;
+    }
+    syms_cache__reclaim(syms_cache);
+    rotate();
+}
+
+void Symbolizer::prune(TraceMemo &memo)
+{
+    std::lock_guard<std::mutex> lock(umutex);
+    if (memo.generation != generation)
+    {
+        memo.ktraces.clear();
+        memo.utraces.clear();
+        memo.generation = generation;
+    }
+    for (auto it = memo.utraces.begin(); it != memo.utraces.end();)
+    {
+        if (procs.find(it->first) == procs.end())
+            it = memo.utraces.erase(it);
+        else
+            ++it;
+    }
+}
+
+Symbolizer::ProcState &Symbolizer::checkProc(uint32_t tgid)
+{
+    auto res = procs.emplace(tgid, ProcState{});
+    auto &st = res.first->second;
+    if (st.checked == interval)
+        return st;
+    st.checked = interval;
+
+    struct stat sb;
+    char path[64];
+    uint64_t dev = 0, ino = 0;
+    snprintf(path, sizeof(path), "/proc/%u/exe", tgid);
+    if (!stat(path, &sb))
+    {
+        dev = sb.st_dev;
+        ino = sb.st_ino;
+    }
+    uint64_t start = proc_start_time(tgid);
+    if (res.second)
+    {
+        // 新进程的映射版本不能与退出进程遗留在记忆表中的版本重复
+        st.epoch = ++last_epoch;
+        st.maps_hash = proc_maps_hash(tgid);
+    }
+    else if (dev != st.exe_dev || ino != st.exe_ino || start != st.start_time)
+    {
+        // 进程exec或pid被复用
+        invalidate(tgid, st);
+    }
+    st.exe_dev = dev;
+    st.exe_ino = ino;
+    st.start_time = start;
+    return st;
+}
+
+void Symbolizer::invalidate(uint32_t tgid, ProcState &st)
+{
+    st.epoch = ++last_epoch;
+    st.reloaded = interval;
+    st.maps_hash = proc_maps_hash(tgid);
+    syms_cache__reload_syms(syms_cache, tgid);
+}
+
+const std::string *Symbolizer::userFrame(uint32_t tgid, ProcState &st, uint64_t addr)
+{
+    auto syms = syms_cache__get_syms(syms_cache, tgid);
+    if (!syms)
+        return intern("[unknown]");
+    unsigned long dev, ino, off;
+    if (syms__map_addr_file(syms, addr, &dev, &ino, &off))
+    {
+        // 地址不在已知映射中，可能是进程新映射了文件，每个周期最多重新解析一次
+        if (st.reloaded == interval || proc_maps_hash(tgid) == st.maps_hash)
+            return intern("[unknown]");
+        invalidate(tgid, st);
+        syms = syms_cache__get_syms(syms_cache, tgid);
+        if (!syms || syms__map_addr_file(syms, addr, &dev, &ino, &off))
+            return intern("[unknown]");
+    }
+
+    // 匿名映射（如vdso）的偏移不能跨进程复用，不做缓存
+    FrameKey key = {dev, ino, off};
+    if (ino)
+    {
+        auto it = uframes.find(key);
+        if (it != uframes.end())
+            return it->second;
+        auto old = old_uframes.find(key);
+        if (old != old_uframes.end())
+        {
+            auto frame = uframes[key] = keep(old->second);
+            old_uframes.erase(old);
+            return frame;
+        }
+    }
+
+    const std::string *frame;
+    if (offline && ino)
+    {
+        // 离线模式只记录文件标识和文件中的地址，每个文件只读取一次文件头
+        unsigned long file_off;
+        const char *path = syms__map_addr_mapping(syms, addr, &dev, &ino, &file_off);
+        auto res = idents.emplace(FrameKey{dev, ino, 0}, std::pair<std::string, ElfIdent>());
+        auto &file = res.first->second;
+        if (res.second && path)
+        {
+            read_elf_ident(path, file.second);
+            // 没有build-id时以进程视角的路径标识，即去掉/proc/<pid>/root前缀
+            const char *root = strstr(path, "/root/");
+            file.first = file.second.build_id.size() ? file.second.build_id
+                                                     : std::string(root ? root + 6 : path);
+        }
+        uint64_t vaddr;
+        frame = file.first.size() && file.second.toVaddr(file_off, vaddr)
+                    ? intern(offline_frame(file.first, vaddr))
+                    : intern("[unknown]");
+        uframes[key] = frame;
+        return frame;
+    }
+    unsigned long sym_off;
+    const struct sym *sym = syms__map_addr(syms, addr, &sym_off);
+    if (sym)
+    {
+        std::string name = sym->name;
+        if (sym->name[0] == '_' && sym->name[1] == 'Z')
+        {
+            char *demangled = abi::__cxa_demangle(sym->name, NULL, NULL, NULL);
+            if (demangled)
+            {
+                clearSpace(demangled);
+                name = demangled;
+                free(demangled);
+            }
+        }
+        frame = intern(name + "+" + std::to_string(sym_off));
+    }
+    else
+        frame = intern("[unknown]");
+    if (ino)
+        uframes[key] = frame;
+    return frame;
+}
+
+void Symbolizer::userFrames(uint32_t tgid, ProcState &st, uint64_t addr, bool leaf, Frames &frames)
+{
+#ifdef USE_BLAZESYM
+    if (inlines && !offline)
+    {
+        auto syms = syms_cache__get_syms(syms_cache, tgid);
+        unsigned long dev, ino, off;
+        if (syms && !syms__map_addr_file(syms, leaf ? addr : addr - 1, &dev, &ino, &off) && ino)
+        {
+            auto cached = findInlines(FrameKey{dev, ino, off});
+            if (cached)
+            {
+                frames.insert(frames.end(), cached->begin(), cached->end());
+                return;
+            }
+        }
+    }
+#endif
+    frames.push_back(userFrame(tgid, st, addr));
+}
+
+void Symbolizer::prefetch(uint32_t tgid, const std::vector<const std::vector<uint64_t> *> &stacks)
+{
+#ifdef USE_BLAZESYM
+    if (!inlines || offline || stacks.empty())
+        return;
+    std::lock_guard<std::mutex> lock(umutex);
+    auto &st = checkProc(tgid);
+    auto syms = syms_cache__get_syms(syms_cache, tgid);
+    if (!syms)
+        return;
+    // 只解析映射自文件且未缓存的地址，不在已知映射中的地址留给userFrame重新读取映射
+    // 除栈顶外都是返回地址，可能已越过调用所在的函数或内联范围，与回溯时一样以前一字节解析
+    std::vector<uint64_t> miss, raw;
+    std::vector<FrameKey> keys;
+    std::unordered_set<FrameKey, FrameKeyHash> seen;
+    for (auto ips : stacks)
+        for (size_t k = 0; k < ips->size(); k++)
+        {
+            uint64_t addr = (*ips)[k], look = k ? addr - 1 : addr;
+            unsigned long dev, ino, off;
+            if (syms__map_addr_file(syms, look, &dev, &ino, &off) || !ino)
+                continue;
+            FrameKey key = {dev, ino, off};
+            if (findInlines(key) || !seen.insert(key).second)
+                continue;
+            miss.push_back(look);
+            raw.push_back(addr);
+            keys.push_back(key);
+        }
+    if (miss.empty())
+        return;
+    if (!blazer)
+        blazer = blaze_symbolizer_new();
+    blaze_symbolize_src_process src = {};
+    src.type_size = sizeof(src);
+    src.pid = tgid;
+    auto res = blaze_symbolize_process_abs_addrs(blazer, &src, (const uintptr_t *)miss.data(), miss.size());
+    for (size_t i = 0; i < miss.size(); i++)
+    {
+        auto &frames = uinlines[keys[i]];
+        if (!res || i >= res->cnt || !res->syms[i].name)
+        {
+            // 没有调试信息时退回ELF符号表
+            frames.push_back(userFrame(tgid, st, raw[i]));
+            continue;
+        }
+        auto &sym = res->syms[i];
+        // 外层函数的行号是其中内联调用所在的行，最内层内联函数的行号才是该地址所在的行；
+        // 偏移仍按原地址输出，与ELF符号表的结果一致
+        frames.push_back(intern(blaze_frame(sym.name, "+" + std::to_string(sym.offset + raw[i] - miss[i]),
+                                            &sym.code_info)));
+        for (size_t j = 0; j < sym.inlined_cnt; j++)
+            frames.push_back(intern(blaze_frame(sym.inlined[j].name, "[inline]", &sym.inlined[j].code_info)));
+    }
+    blaze_result_free(res);
+#endif
+}
+
+const std::string *Symbolizer::kernelFrame(uint64_t addr)
+{
+    std::lock_guard<std::mutex> lock(kmutex);
+    auto it = kframes.find(addr);
+    if (it != kframes.end())
+        return it->second;
+    auto old = old_kframes.find(addr);
+    if (old != old_kframes.end())
+    {
+        auto frame = kframes[addr] = keep(old->second);
+        old_kframes.erase(old);
+        return frame;
+    }
+    const struct ksym *ksym = ksyms__map_addr(ksyms, addr);
+    auto frame = intern(ksym ? std::string(ksym->name) + "+" + std::to_string(addr - ksym->addr)
+                             : "[unknown]");
+    kframes[addr] = frame;
+    return frame;
+}
+
+const Frames *Symbolizer::findUser(TraceMemo &memo, uint32_t tgid, int32_t usid)
+{
+    std::lock_guard<std::mutex> lock(umutex);
+    auto &st = checkProc(tgid);
+    auto it = memo.utraces.find(tgid);
+    if (it == memo.utraces.end())
+        return NULL;
+    if (it->second.epoch != st.epoch)
+    {
+        memo.utraces.erase(it);
+        return NULL;
+    }
+    auto t = it->second.traces.find(usid);
+    return t == it->second.traces.end() ? NULL : &t->second;
+}
+
+const Frames *Symbolizer::addUser(TraceMemo &memo, uint32_t tgid, int32_t usid, const uint64_t *ips, int n)
+{
+    std::lock_guard<std::mutex> lock(umutex);
+    auto &st = checkProc(tgid);
+    Frames frames;
+    frames.reserve(n);
+    for (int i = 0; i < n; i++)
+        userFrames(tgid, st, ips[n - 1 - i], i == n - 1, frames);
+    // 解析过程中可能重新读取了映射，以最新的版本记录
+    auto &ut = memo.utraces[tgid];
+    if (ut.epoch != st.epoch)
+    {
+        ut.traces.clear();
+        ut.epoch = st.epoch;
+    }
+    return &(ut.traces[usid] = std::move(frames));
+}
+
+const Frames *Symbolizer::findKernel(TraceMemo &memo, int32_t ksid)
+{
+    auto t = memo.ktraces.find(ksid);
+    return t == memo.ktraces.end() ? NULL : &t->second;
+}
+
+const Frames *Symbolizer::addKernel(TraceMemo &memo, int32_t ksid, const uint64_t *ips, int n)
+{
+    Frames frames(n);
+    for (int i = 0; i < n; i++)
+        frames[i] = kernelFrame(ips[n - 1 - i]);
+    return &(memo.ktraces[ksid] = std::move(frames));
+}
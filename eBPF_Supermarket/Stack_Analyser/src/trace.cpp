@@ -14,6 +14,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/resource.h>
 #include <time.h>
 #include <bpf/bpf.h>
@@ -22,6 +23,7 @@
 #include <limits.h>
 #include "trace.h"
 #include "uprobe.h"
+#include "kallsyms.h"
 
 #define min(x, y) ({				\
 	typeof(x) _min1 = (x);			\
@@ -40,104 +42,30 @@ struct ksyms
 {
 	struct ksym *syms;
 	int syms_sz;
-	int syms_cap;
-	char *strs;
-	int strs_sz;
-	int strs_cap;
+	struct kallsyms_index idx; // 符号名所在的索引，可能映射自缓存文件
 };
 
-static int ksyms__add_symbol(struct ksyms *ksyms, const char *name, unsigned long addr)
-{
-	size_t new_cap, name_len = strlen(name) + 1;
-	struct ksym *ksym;
-	void *tmp;
-
-	if (ksyms->strs_sz + name_len > ksyms->strs_cap)
-	{
-		new_cap = ksyms->strs_cap * 4 / 3;
-		if (new_cap < ksyms->strs_sz + name_len)
-			new_cap = ksyms->strs_sz + name_len;
-		if (new_cap < 1024)
-			new_cap = 1024;
-		tmp = realloc(ksyms->strs, new_cap);
-		if (!tmp)
-			return -1;
-		ksyms->strs = (char *)tmp;
-		ksyms->strs_cap = new_cap;
-	}
-	if (ksyms->syms_sz + 1 > ksyms->syms_cap)
-	{
-		new_cap = ksyms->syms_cap * 4 / 3;
-		if (new_cap < 1024)
-			new_cap = 1024;
-		tmp = realloc(ksyms->syms, sizeof(*ksyms->syms) * new_cap);
-		if (!tmp)
-			return -1;
-		ksyms->syms = (struct ksym *)tmp;
-		ksyms->syms_cap = new_cap;
-	}
-
-	ksym = &ksyms->syms[ksyms->syms_sz];
-	/* while constructing, re-use pointer as just a plain offset */
-	ksym->name = (char *)(unsigned long)ksyms->strs_sz;
-	ksym->addr = addr;
-
-	memcpy(ksyms->strs + ksyms->strs_sz, name, name_len);
-	ksyms->strs_sz += name_len;
-	ksyms->syms_sz++;
-
-	return 0;
-}
-
-static int ksym_cmp(const void *p1, const void *p2)
-{
-	const struct ksym *s1 = (struct ksym *)p1, *s2 = (struct ksym *)p2;
-
-	if (s1->addr == s2->addr)
-		return strcmp(s1->name, s2->name);
-	return s1->addr < s2->addr ? -1 : 1;
-}
-
 struct ksyms *ksyms__load(void)
 {
-	char sym_type, sym_name[256];
-	struct ksyms *ksyms;
-	unsigned long sym_addr;
-	int i, ret;
-	FILE *f;
-
-	f = fopen("/proc/kallsyms", "r");
-	if (!f)
-		return NULL;
-
-	ksyms = (struct ksyms *)calloc(1, sizeof(*ksyms));
+	struct ksyms *ksyms = (struct ksyms *)calloc(1, sizeof(*ksyms));
 	if (!ksyms)
+		return NULL;
+	if (kallsyms__load(&ksyms->idx, KALLSYMS_CACHE_DIR))
 		goto err_out;
-
-	while (true)
+	ksyms->syms = (struct ksym *)malloc(sizeof(*ksyms->syms) * ksyms->idx.nr);
+	if (!ksyms->syms)
+		goto err_out;
+	/* the index is already sorted by address, only resolve name pointers */
+	for (size_t i = 0; i < ksyms->idx.nr; i++)
 	{
-		ret = fscanf(f, "%lx %c %s%*[^\n]\n",
-					 &sym_addr, &sym_type, sym_name);
-		if (ret == EOF && feof(f))
-			break;
-		if (ret != 3)
-			goto err_out;
-		if (ksyms__add_symbol(ksyms, sym_name, sym_addr))
-			goto err_out;
+		ksyms->syms[i].name = ksyms->idx.names + ksyms->idx.entries[i].name;
+		ksyms->syms[i].addr = ksyms->idx.entries[i].addr;
 	}
-
-	/* now when strings are finalized, adjust pointers properly */
-	for (i = 0; i < ksyms->syms_sz; i++)
-		ksyms->syms[i].name += (unsigned long)ksyms->strs;
-
-	qsort(ksyms->syms, ksyms->syms_sz, sizeof(*ksyms->syms), ksym_cmp);
-
-	fclose(f);
+	ksyms->syms_sz = ksyms->idx.nr;
 	return ksyms;
 
 err_out:
 	ksyms__free(ksyms);
-	fclose(f);
 	return NULL;
 }
 
@@ -147,7 +75,7 @@ void ksyms__free(struct ksyms *ksyms)
 		return;
 
 	free(ksyms->syms);
-	free(ksyms->strs);
+	kallsyms__free(&ksyms->idx);
 	free(ksyms);
 }
 
@@ -204,16 +132,18 @@ enum elf_type
 	UNKNOWN,
 };
 
-struct dso
+/*
+ * Symbol table of one ELF file. Processes mapping the same file (same
+ * dev/inode), e.g. containers started from the same image, share it.
+ */
+struct dso_syms
 {
-	char *name;
-	struct load_range *ranges;
-	int range_sz;
-	/* Dyn's first text section virtual addr at execution */
-	uint64_t sh_addr;
-	/* Dyn's first text section file offset */
-	uint64_t sh_offset;
-	enum elf_type type;
+	struct dso_syms *next; /* hash chain */
+	uint64_t dev;
+	uint64_t inode;
+	int refcnt;
+	/* 0 for not loaded yet, 1 for loaded, -1 for failed to load */
+	int state;
 
 	struct sym *syms;
 	int syms_sz;
@@ -227,6 +157,101 @@ struct dso
 	struct btf *btf;
 };
 
+struct dso
+{
+	char *name;
+	struct load_range *ranges;
+	int range_sz;
+	/* Dyn's first text section virtual addr at execution */
+	uint64_t sh_addr;
+	/* Dyn's first text section file offset */
+	uint64_t sh_offset;
+	enum elf_type type;
+	/* backing file identity, zero for anonymous mappings like vdso */
+	uint64_t dev;
+	uint64_t inode;
+
+	struct dso_syms *tab;
+};
+
+#define DSO_SYMS_BUCKETS 1024
+
+static struct dso_syms *dso_syms_table[DSO_SYMS_BUCKETS];
+
+static unsigned int dso_syms__hash(uint64_t dev, uint64_t inode)
+{
+	uint64_t h = (inode ^ (dev << 32)) * 0x9e3779b97f4a7c15ull;
+
+	return (unsigned int)(h >> 32) & (DSO_SYMS_BUCKETS - 1);
+}
+
+/*
+ * Take a reference to the shared symbol table of dev/inode. Anonymous and
+ * unknown mappings all have dev/inode 0 and do not identify one file, so
+ * each of them gets a private table that is not linked into the hash.
+ */
+static struct dso_syms *dso_syms__get(uint64_t dev, uint64_t inode)
+{
+	unsigned int h = dso_syms__hash(dev, inode);
+	struct dso_syms *tab;
+
+	if (!dev && !inode)
+	{
+		tab = (struct dso_syms *)calloc(1, sizeof(*tab));
+		if (tab)
+			tab->refcnt = 1;
+		return tab;
+	}
+
+	for (tab = dso_syms_table[h]; tab; tab = tab->next)
+	{
+		if (tab->dev == dev && tab->inode == inode)
+		{
+			tab->refcnt++;
+			return tab;
+		}
+	}
+
+	tab = (struct dso_syms *)calloc(1, sizeof(*tab));
+	if (!tab)
+		return NULL;
+	tab->dev = dev;
+	tab->inode = inode;
+	tab->refcnt = 1;
+	tab->next = dso_syms_table[h];
+	dso_syms_table[h] = tab;
+	return tab;
+}
+
+static void dso_syms__free_fields(struct dso_syms *tab)
+{
+	free(tab->syms);
+	btf__free(tab->btf);
+	tab->syms = NULL;
+	tab->syms_sz = 0;
+	tab->syms_cap = 0;
+	tab->btf = NULL;
+}
+
+static void dso_syms__put(struct dso_syms *tab)
+{
+	struct dso_syms **p;
+
+	if (!tab || --tab->refcnt > 0)
+		return;
+
+	for (p = &dso_syms_table[dso_syms__hash(tab->dev, tab->inode)]; *p; p = &(*p)->next)
+	{
+		if (*p == tab)
+		{
+			*p = tab->next;
+			break;
+		}
+	}
+	dso_syms__free_fields(tab);
+	free(tab);
+}
+
 struct map
 {
 	uint64_t start_addr;
@@ -359,7 +384,11 @@ static int syms__add_dso(struct syms *syms, struct map *map, const char *name)
 		dso = &syms->dsos[syms->dso_sz++];
 		memset(dso, 0, sizeof(*dso));
 		dso->name = strdup(name);
-		dso->btf = btf__new_empty();
+		dso->dev = MKDEV(map->dev_major, map->dev_minor);
+		dso->inode = map->inode;
+		dso->tab = dso_syms__get(dso->dev, dso->inode);
+		if (!dso->tab)
+			return -1;
 	}
 
 	tmp = realloc(dso->ranges, (dso->range_sz + 1) * sizeof(*dso->ranges));
@@ -435,7 +464,7 @@ static int dso__load_sym_table_from_perf_map(struct dso *dso)
 	return -1;
 }
 
-static int dso__add_sym(struct dso *dso, const char *name, uint64_t start,
+static int dso__add_sym(struct dso_syms *tab, const char *name, uint64_t start,
 						uint64_t size)
 {
 	struct sym *sym;
@@ -443,28 +472,27 @@ static int dso__add_sym(struct dso *dso, const char *name, uint64_t start,
 	void *tmp;
 	int off;
 
-	off = btf__add_str(dso->btf, name);
+	off = btf__add_str(tab->btf, name);
 	if (off < 0)
 		return off;
 
-	if (dso->syms_sz + 1 > dso->syms_cap)
+	if (tab->syms_sz + 1 > tab->syms_cap)
 	{
-		new_cap = dso->syms_cap * 4 / 3;
+		new_cap = tab->syms_cap * 4 / 3;
 		if (new_cap < 1024)
 			new_cap = 1024;
-		tmp = realloc(dso->syms, sizeof(*dso->syms) * new_cap);
+		tmp = realloc(tab->syms, sizeof(*tab->syms) * new_cap);
 		if (!tmp)
 			return -1;
-		dso->syms = (struct sym *)tmp;
-		dso->syms_cap = new_cap;
+		tab->syms = (struct sym *)tmp;
+		tab->syms_cap = new_cap;
 	}
 
-	sym = &dso->syms[dso->syms_sz++];
+	sym = &tab->syms[tab->syms_sz++];
 	/* while constructing, re-use pointer as just a plain offset */
 	sym->name = (char *)(unsigned long)off;
 	sym->start = start;
 	sym->size = size;
-	sym->offset = 0;
 
 	return 0;
 }
@@ -478,7 +506,7 @@ static int sym_cmp(const void *p1, const void *p2)
 	return s1->start < s2->start ? -1 : 1;
 }
 
-static int dso__add_syms(struct dso *dso, Elf *e, Elf_Scn *section,
+static int dso__add_syms(struct dso_syms *tab, Elf *e, Elf_Scn *section,
 						 size_t stridx, size_t symsize)
 {
 	Elf_Data *data = NULL;
@@ -505,7 +533,7 @@ static int dso__add_syms(struct dso *dso, Elf *e, Elf_Scn *section,
 			if (sym.st_value == 0)
 				continue;
 
-			if (dso__add_sym(dso, name, sym.st_value, sym.st_size))
+			if (dso__add_sym(tab, name, sym.st_value, sym.st_size))
 				goto err_out;
 		}
 	}
@@ -523,12 +551,12 @@ static void dso__free_fields(struct dso *dso)
 
 	free(dso->name);
 	free(dso->ranges);
-	free(dso->syms);
-	btf__free(dso->btf);
+	dso_syms__put(dso->tab);
 }
 
 static int dso__load_sym_table_from_elf(struct dso *dso, int fd)
 {
+	struct dso_syms *tab = dso->tab;
 	Elf_Scn *section = NULL;
 	Elf *e;
 	int i;
@@ -536,6 +564,9 @@ static int dso__load_sym_table_from_elf(struct dso *dso, int fd)
 	e = fd > 0 ? open_elf_by_fd(fd) : open_elf(dso->name, &fd);
 	if (!e)
 		return -1;
+	tab->btf = btf__new_empty();
+	if (!tab->btf)
+		goto err_out;
 
 	while ((section = elf_nextscn(e, section)) != 0)
 	{
@@ -548,24 +579,24 @@ static int dso__load_sym_table_from_elf(struct dso *dso, int fd)
 			header.sh_type != SHT_DYNSYM)
 			continue;
 
-		if (dso__add_syms(dso, e, section, header.sh_link,
+		if (dso__add_syms(tab, e, section, header.sh_link,
 						  header.sh_entsize))
 			goto err_out;
 	}
 
 	/* now when strings are finalized, adjust pointers properly */
-	for (i = 0; i < dso->syms_sz; i++)
-		dso->syms[i].name =
-			btf__name_by_offset(dso->btf,
-								(unsigned long)dso->syms[i].name);
+	for (i = 0; i < tab->syms_sz; i++)
+		tab->syms[i].name =
+			btf__name_by_offset(tab->btf,
+								(unsigned long)tab->syms[i].name);
 
-	qsort(dso->syms, dso->syms_sz, sizeof(*dso->syms), sym_cmp);
+	qsort(tab->syms, tab->syms_sz, sizeof(*tab->syms), sym_cmp);
 
 	close_elf(e, fd);
 	return 0;
 
 err_out:
-	dso__free_fields(dso);
+	dso_syms__free_fields(tab);
 	close_elf(e, fd);
 	return -1;
 }
@@ -662,22 +693,31 @@ static int dso__load_sym_table(struct dso *dso)
 	return -1;
 }
 
-static struct sym *dso__find_sym(struct dso *dso, uint64_t offset)
+/*
+ * The symbol table may be shared by processes symbolized in parallel, so
+ * the lookup does not write to it and returns the offset in *sym_off*.
+ */
+static const struct sym *dso__find_sym(struct dso *dso, uint64_t offset,
+									   unsigned long *sym_off)
 {
+	struct dso_syms *tab = dso->tab;
 	unsigned long sym_addr;
 	int start, end, mid;
 
-	if (!dso->syms && dso__load_sym_table(dso))
+	/* load once, shared tables are not reloaded after a failure either */
+	if (!tab->state)
+		tab->state = dso__load_sym_table(dso) ? -1 : 1;
+	if (tab->state < 0 || !tab->syms_sz)
 		return NULL;
 
 	start = 0;
-	end = dso->syms_sz - 1;
+	end = tab->syms_sz - 1;
 
 	/* find largest sym_addr <= addr using binary search */
 	while (start < end)
 	{
 		mid = start + (end - start + 1) / 2;
-		sym_addr = dso->syms[mid].start;
+		sym_addr = tab->syms[mid].start;
 
 		if (sym_addr <= offset)
 			start = mid;
@@ -685,11 +725,12 @@ static struct sym *dso__find_sym(struct dso *dso, uint64_t offset)
 			end = mid - 1;
 	}
 
-	if (start == end && dso->syms[start].start <= offset &&
-		offset < dso->syms[start].start + dso->syms[start].size)
+	if (start == end && tab->syms[start].start <= offset &&
+		offset < tab->syms[start].start + tab->syms[start].size)
 	{
-		(dso->syms[start]).offset = offset - dso->syms[start].start;
-		return &dso->syms[start];
+		if (sym_off)
+			*sym_off = offset - tab->syms[start].start;
+		return &tab->syms[start];
 	}
 	return NULL;
 }
@@ -769,7 +810,8 @@ void syms__free(struct syms *syms)
 	free(syms);
 }
 
-struct sym *syms__map_addr(const struct syms *syms, unsigned long addr)
+const struct sym *syms__map_addr(const struct syms *syms, unsigned long addr,
+								 unsigned long *sym_off)
 {
 	struct dso *dso;
 	uint64_t offset;
@@ -777,7 +819,50 @@ struct sym *syms__map_addr(const struct syms *syms, unsigned long addr)
 	dso = syms__find_dso(syms, addr, &offset);
 	if (!dso)
 		return NULL;
-	return dso__find_sym(dso, offset);
+	return dso__find_sym(dso, offset, sym_off);
+}
+
+int syms__map_addr_file(const struct syms *syms, unsigned long addr,
+						unsigned long *dev, unsigned long *inode,
+						unsigned long *offset)
+{
+	struct dso *dso;
+	uint64_t off;
+
+	dso = syms__find_dso(syms, addr, &off);
+	if (!dso)
+		return -1;
+
+	*dev = dso->dev;
+	*inode = dso->inode;
+	*offset = off;
+	return 0;
+}
+
+const char *syms__map_addr_mapping(const struct syms *syms, unsigned long addr,
+								   unsigned long *dev, unsigned long *inode,
+								   unsigned long *file_off)
+{
+	struct load_range *range;
+	struct dso *dso;
+	int i, j;
+
+	for (i = 0; i < syms->dso_sz; i++)
+	{
+		dso = &syms->dsos[i];
+		for (j = 0; j < dso->range_sz; j++)
+		{
+			range = &dso->ranges[j];
+			if (addr <= range->start || addr >= range->end)
+				continue;
+			*dev = dso->dev;
+			*inode = dso->inode;
+			*file_off = addr - range->start + range->file_off;
+			return dso->name;
+		}
+	}
+
+	return NULL;
 }
 
 const struct sym *syms__map_addr_dso(const struct syms *syms, unsigned long addr,
@@ -793,63 +878,160 @@ const struct sym *syms__map_addr_dso(const struct syms *syms, unsigned long addr
 	*dso_name = dso->name;
 	*dso_offset = offset;
 
-	return dso__find_sym(dso, offset);
+	return dso__find_sym(dso, offset, NULL);
 }
 
+#define SYMS_CACHE_DEFAULT_SIZE 4096
+
+struct syms_cache_entry
+{
+	struct syms_cache_entry *hnext;		 /* hash chain */
+	struct syms_cache_entry *prev, *next; /* lru list, most recent first */
+	struct syms *syms;
+	int tgid;
+};
+
 struct syms_cache
 {
-	struct
-	{
-		struct syms *syms;
-		int tgid;
-	} *data;
+	struct syms_cache_entry **buckets;
+	unsigned int mask;
+	/* sentinel of the lru list */
+	struct syms_cache_entry lru;
 	int nr;
+	int max;
 };
 
+static struct syms_cache_entry **syms_cache__slot(struct syms_cache *syms_cache, int tgid)
+{
+	struct syms_cache_entry **p;
+
+	p = &syms_cache->buckets[((unsigned int)tgid * 0x9e3779b1u >> 8) & syms_cache->mask];
+	while (*p && (*p)->tgid != tgid)
+		p = &(*p)->hnext;
+	return p;
+}
+
+static void syms_cache__lru_unlink(struct syms_cache_entry *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+}
+
+static void syms_cache__lru_push(struct syms_cache *syms_cache,
+								 struct syms_cache_entry *entry)
+{
+	entry->prev = &syms_cache->lru;
+	entry->next = syms_cache->lru.next;
+	entry->next->prev = entry;
+	syms_cache->lru.next = entry;
+}
+
+static void syms_cache__remove(struct syms_cache *syms_cache,
+							   struct syms_cache_entry **slot)
+{
+	struct syms_cache_entry *entry = *slot;
+
+	*slot = entry->hnext;
+	syms_cache__lru_unlink(entry);
+	syms__free(entry->syms);
+	free(entry);
+	syms_cache->nr--;
+}
+
 struct syms_cache *syms_cache__new(int nr)
 {
 	struct syms_cache *syms_cache;
+	unsigned int size = 1;
 
 	syms_cache = (struct syms_cache *)calloc(1, sizeof(*syms_cache));
 	if (!syms_cache)
 		return NULL;
-	if (nr > 0)
-		syms_cache->data = (typeof(syms_cache->data))calloc(nr, sizeof(*syms_cache->data));
+	syms_cache->max = nr > 0 ? nr : SYMS_CACHE_DEFAULT_SIZE;
+	while (size < (unsigned int)syms_cache->max)
+		size <<= 1;
+	syms_cache->mask = size - 1;
+	syms_cache->buckets = (struct syms_cache_entry **)calloc(size, sizeof(*syms_cache->buckets));
+	if (!syms_cache->buckets)
+	{
+		free(syms_cache);
+		return NULL;
+	}
+	syms_cache->lru.prev = syms_cache->lru.next = &syms_cache->lru;
 	return syms_cache;
 }
 
 void syms_cache__free(struct syms_cache *syms_cache)
 {
-	int i;
+	struct syms_cache_entry *entry, *next;
 
 	if (!syms_cache)
 		return;
 
-	for (i = 0; i < syms_cache->nr; i++)
-		syms__free(syms_cache->data[i].syms);
-	free(syms_cache->data);
+	for (entry = syms_cache->lru.next; entry != &syms_cache->lru; entry = next)
+	{
+		next = entry->next;
+		syms__free(entry->syms);
+		free(entry);
+	}
+	free(syms_cache->buckets);
 	free(syms_cache);
 }
 
 struct syms *syms_cache__get_syms(struct syms_cache *syms_cache, int tgid)
 {
-	void *tmp;
-	int i;
+	struct syms_cache_entry **slot, *entry;
 
-	for (i = 0; i < syms_cache->nr; i++)
+	slot = syms_cache__slot(syms_cache, tgid);
+	if (*slot)
 	{
-		if (syms_cache->data[i].tgid == tgid)
-			return syms_cache->data[i].syms;
+		entry = *slot;
+		syms_cache__lru_unlink(entry);
+		syms_cache__lru_push(syms_cache, entry);
+		return entry->syms;
 	}
 
-	tmp = realloc(syms_cache->data, (syms_cache->nr + 1) *
-										sizeof(*syms_cache->data));
-	if (!tmp)
+	/* processes that exited are never looked up again and sink to the tail */
+	if (syms_cache->nr >= syms_cache->max)
+	{
+		entry = syms_cache->lru.prev;
+		syms_cache__remove(syms_cache, syms_cache__slot(syms_cache, entry->tgid));
+		slot = syms_cache__slot(syms_cache, tgid);
+	}
+
+	entry = (struct syms_cache_entry *)calloc(1, sizeof(*entry));
+	if (!entry)
 		return NULL;
-	syms_cache->data = (typeof(syms_cache->data))tmp;
-	syms_cache->data[syms_cache->nr].syms = syms__load_pid(tgid);
-	syms_cache->data[syms_cache->nr].tgid = tgid;
-	return syms_cache->data[syms_cache->nr++].syms;
+	entry->tgid = tgid;
+	entry->syms = syms__load_pid(tgid);
+	*slot = entry;
+	syms_cache__lru_push(syms_cache, entry);
+	syms_cache->nr++;
+	return entry->syms;
+}
+
+struct syms *syms_cache__reload_syms(struct syms_cache *syms_cache, int tgid)
+{
+	struct syms_cache_entry **slot = syms_cache__slot(syms_cache, tgid);
+
+	if (*slot)
+		syms_cache__remove(syms_cache, slot);
+	return syms_cache__get_syms(syms_cache, tgid);
+}
+
+int syms_cache__reclaim(struct syms_cache *syms_cache)
+{
+	struct syms_cache_entry *entry, *prev;
+	int n = 0;
+
+	for (entry = syms_cache->lru.prev; entry != &syms_cache->lru; entry = prev)
+	{
+		prev = entry->prev;
+		if (!kill(entry->tgid, 0) || errno != ESRCH)
+			continue;
+		syms_cache__remove(syms_cache, syms_cache__slot(syms_cache, entry->tgid));
+		n++;
+	}
+	return n;
 }
 
 struct partitions
@@ -0,0 +1,1081 @@
+// Copyright 2024 The LMP Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// https://github.com/linuxkerneltravel/lmp/blob/develop/LICENSE
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// author: luiyanbing@foxmail.com
+//
+// 基于.eh_frame和.debug_frame的用户栈回溯
+
+#include "unwind.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <algorithm>
+#include <string>
+
+// DWARF指针编码
+#define DW_EH_PE_absptr 0x00
+#define DW_EH_PE_uleb128 0x01
+#define DW_EH_PE_udata2 0x02
+#define DW_EH_PE_udata4 0x03
+#define DW_EH_PE_udata8 0x04
+#define DW_EH_PE_sleb128 0x09
+#define DW_EH_PE_sdata2 0x0a
+#define DW_EH_PE_sdata4 0x0b
+#define DW_EH_PE_sdata8 0x0c
+#define DW_EH_PE_pcrel 0x10
+#define DW_EH_PE_indirect 0x80
+#define DW_EH_PE_omit 0xff
+
+// 表达式栈的深度
+#define UW_EXPR_STACK 16
+// 进程映射中找不到地址时，重新读取映射的最小间隔（秒）
+#define UW_MAPS_RELOAD 1
+
+enum RuleType : uint8_t
+{
+    RULE_SAME,
+    RULE_UNDEF,
+    RULE_OFFSET,     // 保存在CFA+off处
+    RULE_VAL_OFFSET, // 值为CFA+off
+    RULE_REG,        // 保存在另一寄存器中
+    RULE_UNSUPPORTED,
+};
+
+struct Rule
+{
+    RuleType type;
+    int64_t val;
+};
+
+/// @brief 调用帧信息表中的一行，描述某一地址处CFA和各寄存器的恢复方式
+struct Row
+{
+    uint32_t cfa_reg;
+    int64_t cfa_off;
+    const uint8_t *cfa_expr; // 非空时CFA由表达式计算
+    size_t cfa_expr_len;
+    Rule regs[UW_NREGS];
+};
+
+struct Cie
+{
+    uint64_t code_align;
+    int64_t data_align;
+    uint32_t ra_reg;
+    uint8_t fde_enc;
+    bool aug_z;
+    const uint8_t *insns, *end;
+};
+
+struct Fde
+{
+    uint64_t start, end;
+    const uint8_t *insns, *insns_end;
+    uint32_t cie;
+};
+
+/// @brief 一个文件的调用帧信息，所用的节在加载时复制，各FDE按起始地址排列
+class CfiTable
+{
+private:
+    std::vector<uint8_t> eh_frame, debug_frame;
+    struct Load
+    {
+        uint64_t vaddr, offset, filesz;
+    };
+    std::vector<Load> loads;
+    std::vector<Cie> cies;
+    std::vector<Fde> fdes;
+
+    int parseCie(const std::vector<uint8_t> &sec, size_t off, bool debug,
+                 std::unordered_map<size_t, int> &index);
+    void parse(const std::vector<uint8_t> &sec, uint64_t sec_addr, bool debug);
+    bool execute(const Cie &cie, const uint8_t *p, const uint8_t *end,
+                 uint64_t loc, uint64_t target, Row &row, const Row &init) const;
+
+public:
+    CfiTable() = default;
+    CfiTable(const CfiTable &) = delete;
+    static std::shared_ptr<CfiTable> load(const char *path);
+    bool toVaddr(uint64_t off, uint64_t &vaddr) const;
+    bool findRow(uint64_t vaddr, Row &row) const;
+};
+
+static inline bool read_uleb(const uint8_t *&p, const uint8_t *end, uint64_t &val)
+{
+    val = 0;
+    for (int shift = 0; p < end; shift += 7)
+    {
+        uint8_t b = *p++;
+        if (shift < 64)
+            val |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static inline bool read_sleb(const uint8_t *&p, const uint8_t *end, int64_t &val)
+{
+    uint64_t r = 0;
+    int shift = 0;
+    uint8_t b = 0;
+    do
+    {
+        if (p >= end)
+            return false;
+        b = *p++;
+        if (shift < 64)
+            r |= (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    if (shift < 64 && (b & 0x40))
+        r |= ~0ull << shift;
+    val = (int64_t)r;
+    return true;
+}
+
+template <typename T>
+static inline bool read_fixed(const uint8_t *&p, const uint8_t *end, T &val)
+{
+    if ((size_t)(end - p) < sizeof(T))
+        return false;
+    memcpy(&val, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+/// @brief 读取按enc编码的指针
+/// @param pcrel 指针所在位置的虚拟地址，用于pc相对编码
+static bool read_encoded(const uint8_t *&p, const uint8_t *end, uint8_t enc, uint64_t pcrel, uint64_t &val)
+{
+    if (enc == DW_EH_PE_omit)
+    {
+        val = 0;
+        return true;
+    }
+    bool ok;
+    switch (enc & 0x0f)
+    {
+    case DW_EH_PE_absptr:
+    case DW_EH_PE_udata8:
+    case DW_EH_PE_sdata8:
+        ok = read_fixed(p, end, val);
+        break;
+    case DW_EH_PE_uleb128:
+        ok = read_uleb(p, end, val);
+        break;
+    case DW_EH_PE_sleb128:
+    {
+        int64_t s = 0;
+        ok = read_sleb(p, end, s);
+        val = s;
+        break;
+    }
+    case DW_EH_PE_udata2:
+    {
+        uint16_t v = 0;
+        ok = read_fixed(p, end, v);
+        val = v;
+        break;
+    }
+    case DW_EH_PE_sdata2:
+    {
+        int16_t v = 0;
+        ok = read_fixed(p, end, v);
+        val = v;
+        break;
+    }
+    case DW_EH_PE_udata4:
+    {
+        uint32_t v = 0;
+        ok = read_fixed(p, end, v);
+        val = v;
+        break;
+    }
+    case DW_EH_PE_sdata4:
+    {
+        int32_t v = 0;
+        ok = read_fixed(p, end, v);
+        val = v;
+        break;
+    }
+    default:
+        return false;
+    }
+    if (!ok)
+        return false;
+    switch (enc & 0x70)
+    {
+    case 0:
+        break;
+    case DW_EH_PE_pcrel:
+        val += pcrel;
+        break;
+    default:
+        // textrel、datarel和funcrel在常见的x86_64和arm64程序中不会出现在FDE中
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<CfiTable> CfiTable::load(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(Elf64_Ehdr))
+    {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = st.st_size;
+    auto base = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return nullptr;
+
+    std::shared_ptr<CfiTable> cfi;
+    auto eh = (const Elf64_Ehdr *)base;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) || eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh->e_ident[EI_DATA] != ELFDATA2LSB ||
+        eh->e_phoff + (uint64_t)eh->e_phnum * sizeof(Elf64_Phdr) > size ||
+        eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) > size ||
+        eh->e_shstrndx >= eh->e_shnum)
+        goto out;
+    {
+        cfi = std::make_shared<CfiTable>();
+        auto ph = (const Elf64_Phdr *)(base + eh->e_phoff);
+        for (int i = 0; i < eh->e_phnum; i++)
+            if (ph[i].p_type == PT_LOAD && (ph[i].p_flags & PF_X))
+                cfi->loads.push_back({ph[i].p_vaddr, ph[i].p_offset, ph[i].p_filesz});
+
+        auto sh = (const Elf64_Shdr *)(base + eh->e_shoff);
+        auto &strtab = sh[eh->e_shstrndx];
+        uint64_t eh_addr = 0;
+        for (int i = 0; i < eh->e_shnum; i++)
+        {
+            if (sh[i].sh_type != SHT_PROGBITS || (sh[i].sh_flags & SHF_COMPRESSED) ||
+                sh[i].sh_offset + sh[i].sh_size > size || sh[i].sh_name >= strtab.sh_size)
+                continue;
+            auto name = (const char *)base + strtab.sh_offset + sh[i].sh_name;
+            auto data = base + sh[i].sh_offset;
+            if (!strcmp(name, ".eh_frame"))
+            {
+                cfi->eh_frame.assign(data, data + sh[i].sh_size);
+                eh_addr = sh[i].sh_addr;
+            }
+            else if (!strcmp(name, ".debug_frame"))
+                cfi->debug_frame.assign(data, data + sh[i].sh_size);
+        }
+        cfi->parse(cfi->eh_frame, eh_addr, false);
+        cfi->parse(cfi->debug_frame, 0, true);
+        std::sort(cfi->fdes.begin(), cfi->fdes.end(), [](const Fde &a, const Fde &b)
+                  { return a.start < b.start; });
+    }
+out:
+    munmap((void *)base, size);
+    return cfi;
+}
+
+/// @return CIE在cies中的序号，失败时为-1
+int CfiTable::parseCie(const std::vector<uint8_t> &sec, size_t off, bool debug,
+                       std::unordered_map<size_t, int> &index)
+{
+    auto it = index.find(off);
+    if (it != index.end())
+        return it->second;
+    index[off] = -1;
+    const uint8_t *p = sec.data() + off, *end = sec.data() + sec.size();
+    uint32_t len32 = 0;
+    uint64_t len = 0, id = 0;
+    if (!read_fixed(p, end, len32))
+        return -1;
+    bool dw64 = len32 == 0xffffffff;
+    if (dw64 ? !read_fixed(p, end, len) : !(len = len32))
+        return -1;
+    if (len > (size_t)(end - p))
+        return -1;
+    end = p + len;
+    if (dw64)
+    {
+        if (!read_fixed(p, end, id))
+            return -1;
+    }
+    else
+    {
+        uint32_t id32 = 0;
+        if (!read_fixed(p, end, id32))
+            return -1;
+        id = id32;
+    }
+    if (debug ? id != (dw64 ? ~0ull : 0xffffffffull) : id != 0)
+        return -1;
+
+    Cie cie = {};
+    cie.fde_enc = DW_EH_PE_absptr;
+    uint8_t version;
+    if (!read_fixed(p, end, version))
+        return -1;
+    auto aug = (const char *)p;
+    while (p < end && *p)
+        p++;
+    if (p++ >= end)
+        return -1;
+    if (version >= 4)
+        p += 2; // address_size和segment_selector_size
+    int64_t data_align;
+    if (!read_uleb(p, end, cie.code_align) || !read_sleb(p, end, data_align))
+        return -1;
+    cie.data_align = data_align;
+    if (version == 1)
+    {
+        uint8_t ra;
+        if (!read_fixed(p, end, ra))
+            return -1;
+        cie.ra_reg = ra;
+    }
+    else
+    {
+        uint64_t ra;
+        if (!read_uleb(p, end, ra))
+            return -1;
+        cie.ra_reg = ra;
+    }
+    if (*aug == 'z')
+    {
+        uint64_t aug_len;
+        if (!read_uleb(p, end, aug_len) || aug_len > (size_t)(end - p))
+            return -1;
+        const uint8_t *aug_end = p + aug_len;
+        cie.aug_z = true;
+        bool known = true;
+        for (auto c = aug + 1; *c; c++)
+        {
+            switch (*c)
+            {
+            case 'R':
+                if (!read_fixed(p, aug_end, cie.fde_enc))
+                    return -1;
+                break;
+            case 'P':
+            {
+                uint8_t enc;
+                uint64_t personality;
+                if (!read_fixed(p, aug_end, enc) ||
+                    !read_encoded(p, aug_end, enc & ~DW_EH_PE_indirect, 0, personality))
+                    return -1;
+                break;
+            }
+            case 'L':
+                p++;
+                break;
+            case 'S':
+            case 'B':
+                break;
+            default:
+                // 不认识的扩展之后的数据无法解析，跳过，z已给出了扩展数据的长度
+                known = false;
+                break;
+            }
+            if (!known)
+                break;
+        }
+        p = aug_end;
+    }
+    else if (*aug)
+        return -1;
+    cie.insns = p;
+    cie.end = end;
+    cies.push_back(cie);
+    return index[off] = cies.size() - 1;
+}
+
+void CfiTable::parse(const std::vector<uint8_t> &sec, uint64_t sec_addr, bool debug)
+{
+    std::unordered_map<size_t, int> index;
+    const uint8_t *base = sec.data(), *p = base, *end = base + sec.size();
+    while (p < end)
+    {
+        uint32_t len32 = 0;
+        uint64_t len = 0, id = 0;
+        if (!read_fixed(p, end, len32) || !len32)
+            break;
+        bool dw64 = len32 == 0xffffffff;
+        if (dw64 ? !read_fixed(p, end, len) : !(len = len32))
+            break;
+        if (len > (size_t)(end - p))
+            break;
+        const uint8_t *body = p, *next = p + len;
+        // 长度不足以容纳CIE id的项已损坏，其后的内容不再可信
+        if (dw64)
+        {
+            if (!read_fixed(p, next, id))
+                break;
+        }
+        else
+        {
+            uint32_t id32 = 0;
+            if (!read_fixed(p, next, id32))
+                break;
+            id = id32;
+        }
+        bool is_cie = debug ? id == (dw64 ? ~0ull : 0xffffffffull) : id == 0;
+        if (!is_cie)
+        {
+            // .eh_frame中CIE指针是相对于该字段的偏移，.debug_frame中是相对于节的偏移
+            size_t cie_off = debug ? id : (body - base) - id;
+            int ci = cie_off < sec.size() ? parseCie(sec, cie_off, debug, index) : -1;
+            uint64_t start, range;
+            if (ci >= 0 &&
+                read_encoded(p, next, cies[ci].fde_enc, sec_addr + (p - base), start) &&
+                read_encoded(p, next, cies[ci].fde_enc & 0x0f, 0, range))
+            {
+                uint64_t aug_len = 0;
+                if (!cies[ci].aug_z || (read_uleb(p, next, aug_len) && aug_len <= (size_t)(next - p)))
+                {
+                    p += aug_len;
+                    if (range)
+                        fdes.push_back({start, start + range, p, next, (uint32_t)ci});
+                }
+            }
+        }
+        p = next;
+    }
+}
+
+bool CfiTable::toVaddr(uint64_t off, uint64_t &vaddr) const
+{
+    for (auto &l : loads)
+    {
+        if (off >= l.offset && off < l.offset + l.filesz)
+        {
+            vaddr = off - l.offset + l.vaddr;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @brief 执行调用帧指令直到地址超过target
+bool CfiTable::execute(const Cie &cie, const uint8_t *p, const uint8_t *end,
+                       uint64_t loc, uint64_t target, Row &row, const Row &init) const
+{
+    std::vector<Row> saved;
+    auto set = [&row](uint64_t reg, RuleType type, int64_t val)
+    {
+        if (reg < UW_NREGS)
+            row.regs[reg] = {type, val};
+    };
+    while (p < end)
+    {
+        uint8_t op = *p++;
+        uint64_t reg, off, delta = 0;
+        int64_t soff;
+        switch (op & 0xc0)
+        {
+        case 0x40: // DW_CFA_advance_loc
+            delta = op & 0x3f;
+            goto advance;
+        case 0x80: // DW_CFA_offset
+            if (!read_uleb(p, end, off))
+                return false;
+            set(op & 0x3f, RULE_OFFSET, (int64_t)off * cie.data_align);
+            continue;
+        case 0xc0: // DW_CFA_restore
+            if ((op & 0x3f) < UW_NREGS)
+                row.regs[op & 0x3f] = init.regs[op & 0x3f];
+            continue;
+        }
+        switch (op)
+        {
+        case 0x00: // DW_CFA_nop
+            break;
+        case 0x01: // DW_CFA_set_loc
+            if (!read_encoded(p, end, cie.fde_enc, 0, off))
+                return false;
+            if (off > target)
+                return true;
+            loc = off;
+            break;
+        case 0x02: // DW_CFA_advance_loc1
+        {
+            uint8_t d;
+            if (!read_fixed(p, end, d))
+                return false;
+            delta = d;
+            goto advance;
+        }
+        case 0x03: // DW_CFA_advance_loc2
+        {
+            uint16_t d;
+            if (!read_fixed(p, end, d))
+                return false;
+            delta = d;
+            goto advance;
+        }
+        case 0x04: // DW_CFA_advance_loc4
+        {
+            uint32_t d;
+            if (!read_fixed(p, end, d))
+                return false;
+            delta = d;
+            goto advance;
+        }
+        case 0x05: // DW_CFA_offset_extended
+            if (!read_uleb(p, end, reg) || !read_uleb(p, end, off))
+                return false;
+            set(reg, RULE_OFFSET, (int64_t)off * cie.data_align);
+            break;
+        case 0x06: // DW_CFA_restore_extended
+            if (!read_uleb(p, end, reg))
+                return false;
+            if (reg < UW_NREGS)
+                row.regs[reg] = init.regs[reg];
+            break;
+        case 0x07: // DW_CFA_undefined
+            if (!read_uleb(p, end, reg))
+                return false;
+            set(reg, RULE_UNDEF, 0);
+            break;
+        case 0x08: // DW_CFA_same_value
+            if (!read_uleb(p, end, reg))
+                return false;
+            set(reg, RULE_SAME, 0);
+            break;
+        case 0x09: // DW_CFA_register
+            if (!read_uleb(p, end, reg) || !read_uleb(p, end, off))
+                return false;
+            set(reg, RULE_REG, off);
+            break;
+        case 0x0a: // DW_CFA_remember_state
+            saved.push_back(row);
+            break;
+        case 0x0b: // DW_CFA_restore_state
+            if (saved.empty())
+                return false;
+            row = saved.back();
+            saved.pop_back();
+            break;
+        case 0x0c: // DW_CFA_def_cfa
+            if (!read_uleb(p, end, reg) || !read_uleb(p, end, off))
+                return false;
+            row.cfa_reg = reg;
+            row.cfa_off = off;
+            row.cfa_expr = NULL;
+            break;
+        case 0x0d: // DW_CFA_def_cfa_register
+            if (!read_uleb(p, end, reg))
+                return false;
+            row.cfa_reg = reg;
+            row.cfa_expr = NULL;
+            break;
+        case 0x0e: // DW_CFA_def_cfa_offset
+            if (!read_uleb(p, end, off))
+                return false;
+            row.cfa_off = off;
+            break;
+        case 0x0f: // DW_CFA_def_cfa_expression
+            if (!read_uleb(p, end, off) || off > (size_t)(end - p))
+                return false;
+            row.cfa_expr = p;
+            row.cfa_expr_len = off;
+            p += off;
+            break;
+        case 0x10: // DW_CFA_expression
+        case 0x16: // DW_CFA_val_expression
+            if (!read_uleb(p, end, reg) || !read_uleb(p, end, off) || off > (size_t)(end - p))
+                return false;
+            set(reg, RULE_UNSUPPORTED, 0);
+            p += off;
+            break;
+        case 0x11: // DW_CFA_offset_extended_sf
+            if (!read_uleb(p, end, reg) || !read_sleb(p, end, soff))
+                return false;
+            set(reg, RULE_OFFSET, soff * cie.data_align);
+            break;
+        case 0x12: // DW_CFA_def_cfa_sf
+            if (!read_uleb(p, end, reg) || !read_sleb(p, end, soff))
+                return false;
+            row.cfa_reg = reg;
+            row.cfa_off = soff * cie.data_align;
+            row.cfa_expr = NULL;
+            break;
+        case 0x13: // DW_CFA_def_cfa_offset_sf
+            if (!read_sleb(p, end, soff))
+                return false;
+            row.cfa_off = soff * cie.data_align;
+            break;
+        case 0x14: // DW_CFA_val_offset
+            if (!read_uleb(p, end, reg) || !read_uleb(p, end, off))
+                return false;
+            set(reg, RULE_VAL_OFFSET, (int64_t)off * cie.data_align);
+            break;
+        case 0x15: // DW_CFA_val_offset_sf
+            if (!read_uleb(p, end, reg) || !read_sleb(p, end, soff))
+                return false;
+            set(reg, RULE_VAL_OFFSET, soff * cie.data_align);
+            break;
+        case 0x2d: // DW_CFA_AARCH64_negate_ra_state，返回地址的签名位在回溯时去除
+            break;
+        case 0x2e: // DW_CFA_GNU_args_size
+            if (!read_uleb(p, end, off))
+                return false;
+            break;
+        case 0x2f: // DW_CFA_GNU_negative_offset_extended
+            if (!read_uleb(p, end, reg) || !read_uleb(p, end, off))
+                return false;
+            set(reg, RULE_OFFSET, -(int64_t)off * cie.data_align);
+            break;
+        default:
+            return false;
+        }
+        continue;
+    advance:
+        loc += delta * cie.code_align;
+        if (loc > target)
+            return true;
+    }
+    return true;
+}
+
+bool CfiTable::findRow(uint64_t vaddr, Row &row) const
+{
+    auto it = std::upper_bound(fdes.begin(), fdes.end(), vaddr, [](uint64_t v, const Fde &f)
+                               { return v < f.start; });
+    if (it == fdes.begin())
+        return false;
+    auto &fde = *--it;
+    if (vaddr >= fde.end)
+        return false;
+    auto &cie = cies[fde.cie];
+    Row init = {};
+    init.cfa_reg = UW_NREGS;
+    for (auto &r : init.regs)
+        r.type = RULE_SAME;
+    if (!execute(cie, cie.insns, cie.end, 0, UINT64_MAX, init, init))
+        return false;
+    row = init;
+    return execute(cie, fde.insns, fde.insns_end, fde.start, vaddr, row, init);
+}
+
+/// @brief 在复制的栈中读取8字节
+static inline bool read_stack(const UnwindInput &in, uint64_t addr, uint64_t &val)
+{
+    if (addr < in.sp || addr - in.sp > in.size || in.size - (addr - in.sp) < sizeof(val))
+        return false;
+    memcpy(&val, in.stack + (addr - in.sp), sizeof(val));
+    return true;
+}
+
+/// @brief 计算DWARF表达式，只支持CFA表达式中常见的寄存器、常量、算术和解引用操作，
+/// 如x86_64的PLT项所用的rsp+8+((rip&15)>=11)*8
+static bool eval_expr(const uint8_t *p, size_t len, const uint64_t *regs, const bool *valid,
+                      const UnwindInput &in, uint64_t &result)
+{
+    const uint8_t *end = p + len;
+    uint64_t st[UW_EXPR_STACK];
+    int sp = 0;
+#define PUSH(v)                  \
+    do                           \
+    {                            \
+        uint64_t _v = (v);       \
+        if (sp >= UW_EXPR_STACK) \
+            return false;        \
+        st[sp++] = _v;           \
+    } while (0)
+#define NEED(n)      \
+    if (sp < (n))    \
+        return false;
+    while (p < end)
+    {
+        uint8_t op = *p++;
+        uint64_t u;
+        int64_t s = 0;
+        if (op >= 0x30 && op <= 0x4f) // DW_OP_lit0..31
+            PUSH(op - 0x30);
+        else if (op >= 0x70 && op <= 0x8f) // DW_OP_breg0..31
+        {
+            if (!read_sleb(p, end, s) || op - 0x70 >= UW_NREGS || !valid[op - 0x70])
+                return false;
+            PUSH(regs[op - 0x70] + s);
+        }
+        else
+        {
+            switch (op)
+            {
+            case 0x06: // DW_OP_deref
+                NEED(1);
+                if (!read_stack(in, st[sp - 1], st[sp - 1]))
+                    return false;
+                break;
+            case 0x08: // DW_OP_const1u
+            {
+                uint8_t v;
+                if (!read_fixed(p, end, v))
+                    return false;
+                PUSH(v);
+                break;
+            }
+            case 0x09: // DW_OP_const1s
+            {
+                int8_t v;
+                if (!read_fixed(p, end, v))
+                    return false;
+                PUSH(v);
+                break;
+            }
+            case 0x0a: // DW_OP_const2u
+            {
+                uint16_t v;
+                if (!read_fixed(p, end, v))
+                    return false;
+                PUSH(v);
+                break;
+            }
+            case 0x0b: // DW_OP_const2s
+            {
+                int16_t v;
+                if (!read_fixed(p, end, v))
+                    return false;
+                PUSH(v);
+                break;
+            }
+            case 0x0c: // DW_OP_const4u
+            {
+                uint32_t v;
+                if (!read_fixed(p, end, v))
+                    return false;
+                PUSH(v);
+                break;
+            }
+            case 0x0d: // DW_OP_const4s
+            {
+                int32_t v;
+                if (!read_fixed(p, end, v))
+                    return false;
+                PUSH(v);
+                break;
+            }
+            case 0x0e: // DW_OP_const8u
+            case 0x0f: // DW_OP_const8s
+                if (!read_fixed(p, end, u))
+                    return false;
+                PUSH(u);
+                break;
+            case 0x10: // DW_OP_constu
+                if (!read_uleb(p, end, u))
+                    return false;
+                PUSH(u);
+                break;
+            case 0x11: // DW_OP_consts
+                if (!read_sleb(p, end, s))
+                    return false;
+                PUSH(s);
+                break;
+            case 0x12: // DW_OP_dup
+                NEED(1);
+                PUSH(st[sp - 1]);
+                break;
+            case 0x13: // DW_OP_drop
+                NEED(1);
+                sp--;
+                break;
+            case 0x16: // DW_OP_swap
+                NEED(2);
+                std::swap(st[sp - 1], st[sp - 2]);
+                break;
+            case 0x1a: // DW_OP_and
+                NEED(2);
+                st[sp - 2] &= st[sp - 1];
+                sp--;
+                break;
+            case 0x1c: // DW_OP_minus
+                NEED(2);
+                st[sp - 2] -= st[sp - 1];
+                sp--;
+                break;
+            case 0x1e: // DW_OP_mul
+                NEED(2);
+                st[sp - 2] *= st[sp - 1];
+                sp--;
+                break;
+            case 0x21: // DW_OP_or
+                NEED(2);
+                st[sp - 2] |= st[sp - 1];
+                sp--;
+                break;
+            case 0x22: // DW_OP_plus
+                NEED(2);
+                st[sp - 2] += st[sp - 1];
+                sp--;
+                break;
+            case 0x23: // DW_OP_plus_uconst
+                NEED(1);
+                if (!read_uleb(p, end, u))
+                    return false;
+                st[sp - 1] += u;
+                break;
+            case 0x24: // DW_OP_shl
+                NEED(2);
+                st[sp - 2] = st[sp - 1] < 64 ? st[sp - 2] << st[sp - 1] : 0;
+                sp--;
+                break;
+            case 0x25: // DW_OP_shr
+                NEED(2);
+                st[sp - 2] = st[sp - 1] < 64 ? st[sp - 2] >> st[sp - 1] : 0;
+                sp--;
+                break;
+            case 0x29: // DW_OP_eq
+            case 0x2a: // DW_OP_ge
+            case 0x2b: // DW_OP_gt
+            case 0x2c: // DW_OP_le
+            case 0x2d: // DW_OP_lt
+            case 0x2e: // DW_OP_ne
+            {
+                NEED(2);
+                int64_t a = st[sp - 2], b = st[sp - 1];
+                bool r = op == 0x29 ? a == b : op == 0x2a ? a >= b
+                                           : op == 0x2b   ? a > b
+                                           : op == 0x2c   ? a <= b
+                                           : op == 0x2d   ? a < b
+                                                          : a != b;
+                st[sp - 2] = r;
+                sp--;
+                break;
+            }
+            case 0x96: // DW_OP_nop
+                break;
+            default:
+                return false;
+            }
+        }
+    }
+#undef PUSH
+#undef NEED
+    if (!sp)
+        return false;
+    result = st[sp - 1];
+    return true;
+}
+
+std::shared_ptr<DwarfUnwinder::ProcMaps> DwarfUnwinder::loadMaps(uint32_t tgid)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%u/maps", tgid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return nullptr;
+    auto pm = std::make_shared<ProcMaps>();
+    pm->loaded = time(NULL);
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), f))
+    {
+        Mapping m;
+        char perm[8];
+        unsigned int maj, min;
+        int name = 0;
+        if (sscanf(line, "%lx-%lx %7s %lx %x:%x %lu %n",
+                   &m.start, &m.end, perm, &m.offset, &maj, &min, &m.ino, &name) < 7)
+            continue;
+        // 只关心有文件的可执行映射，[vdso]等没有inode
+        if (perm[2] != 'x' || !m.ino)
+            continue;
+        m.dev = makedev(maj, min);
+        pm->maps.push_back(m);
+    }
+    fclose(f);
+    std::sort(pm->maps.begin(), pm->maps.end(), [](const Mapping &a, const Mapping &b)
+              { return a.start < b.start; });
+    return pm;
+}
+
+const DwarfUnwinder::Mapping *DwarfUnwinder::findMapping(uint32_t tgid, uint64_t pc, std::shared_ptr<ProcMaps> &pm)
+{
+    auto lookup = [pc](const ProcMaps &maps) -> const Mapping *
+    {
+        auto it = std::upper_bound(maps.maps.begin(), maps.maps.end(), pc, [](uint64_t v, const Mapping &m)
+                                   { return v < m.start; });
+        if (it == maps.maps.begin() || pc >= (--it)->end)
+            return nullptr;
+        return &*it;
+    };
+    if (!pm)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = procs.find(tgid);
+        if (it != procs.end())
+            pm = it->second;
+    }
+    if (pm)
+    {
+        auto m = lookup(*pm);
+        if (m || time(NULL) - pm->loaded < UW_MAPS_RELOAD)
+            return m;
+    }
+    // 进程新映射了文件或第一次出现，重新读取映射
+    auto fresh = loadMaps(tgid);
+    if (!fresh)
+        return nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        procs[tgid] = fresh;
+    }
+    pm = fresh;
+    return lookup(*pm);
+}
+
+std::shared_ptr<CfiTable> DwarfUnwinder::getCfi(uint32_t tgid, const Mapping &m)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto key = std::make_pair(m.dev, m.ino);
+    auto it = dsos.find(key);
+    if (it != dsos.end())
+        return it->second;
+    // 经map_files打开，容器内的和已删除的文件也能找到
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%u/map_files/%lx-%lx", tgid, m.start, m.end);
+    auto cfi = CfiTable::load(path);
+    dsos[key] = cfi;
+    return cfi;
+}
+
+int DwarfUnwinder::unwind(uint32_t tgid, const UnwindInput &in, uint64_t *ips, int max)
+{
+#ifndef UW_REG_RA
+    if (max > 0 && in.ip)
+    {
+        ips[0] = in.ip;
+        return 1;
+    }
+    return 0;
+#else
+    uint64_t regs[UW_NREGS] = {};
+    bool valid[UW_NREGS] = {};
+    regs[UW_REG_SP] = in.sp;
+    regs[UW_REG_FP] = in.fp;
+    valid[UW_REG_SP] = valid[UW_REG_FP] = true;
+#ifdef __aarch64__
+    regs[UW_REG_RA] = in.lr;
+    valid[UW_REG_RA] = true;
+#endif
+    std::shared_ptr<ProcMaps> pm;
+    uint64_t pc = in.ip;
+    int n = 0;
+    while (n < max && pc)
+    {
+        ips[n++] = pc;
+#ifdef __x86_64__
+        regs[UW_REG_RA] = pc;
+        valid[UW_REG_RA] = true;
+#endif
+        uint64_t sp = regs[UW_REG_SP], cfa = 0, ra = 0;
+        // 除栈顶外pc都是返回地址，减1使其落在调用指令内
+        uint64_t addr = n == 1 ? pc : pc - 1, vaddr;
+        auto m = findMapping(tgid, addr, pm);
+        std::shared_ptr<CfiTable> cfi = m ? getCfi(tgid, *m) : nullptr;
+        Row row;
+        if (cfi && cfi->toVaddr(addr - m->start + m->offset, vaddr) && cfi->findRow(vaddr, row))
+        {
+            if (row.cfa_expr)
+            {
+                if (!eval_expr(row.cfa_expr, row.cfa_expr_len, regs, valid, in, cfa))
+                    break;
+            }
+            else if (row.cfa_reg < UW_NREGS && valid[row.cfa_reg])
+                cfa = regs[row.cfa_reg] + row.cfa_off;
+            else
+                break;
+            uint64_t next[UW_NREGS];
+            bool nvalid[UW_NREGS];
+            for (int r = 0; r < UW_NREGS; r++)
+            {
+                auto &rule = row.regs[r];
+                nvalid[r] = false;
+                switch (rule.type)
+                {
+                case RULE_SAME:
+                    next[r] = regs[r];
+                    nvalid[r] = valid[r];
+                    break;
+                case RULE_OFFSET:
+                    nvalid[r] = read_stack(in, cfa + rule.val, next[r]);
+                    break;
+                case RULE_VAL_OFFSET:
+                    next[r] = cfa + rule.val;
+                    nvalid[r] = true;
+                    break;
+                case RULE_REG:
+                    if (rule.val < UW_NREGS)
+                    {
+                        next[r] = regs[rule.val];
+                        nvalid[r] = valid[rule.val];
+                    }
+                    break;
+                default:
+                    break;
+                }
+            }
+            // 返回地址规则为undefined时表示已到栈底
+            if (!nvalid[UW_REG_RA])
+                break;
+            ra = next[UW_REG_RA];
+            memcpy(regs, next, sizeof(regs));
+            memcpy(valid, nvalid, sizeof(valid));
+        }
+        else
+        {
+            // 没有调用帧信息时按帧指针回溯
+            uint64_t fp = regs[UW_REG_FP], nfp;
+            if (!valid[UW_REG_FP] || fp < sp || !read_stack(in, fp, nfp) || !read_stack(in, fp + 8, ra))
+                break;
+            regs[UW_REG_FP] = nfp;
+            cfa = fp + 16;
+        }
+        regs[UW_REG_SP] = cfa;
+        valid[UW_REG_SP] = true;
+#ifdef __aarch64__
+        // 去除指针认证的签名位
+        ra &= (1ull << 48) - 1;
+#endif
+        // 栈只会向栈底回溯，防止陷入循环
+        if (cfa < sp || (cfa == sp && ra == pc))
+            break;
+        pc = ra;
+    }
+    return n;
+#endif
+}
+
+void DwarfUnwinder::prune(void)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = procs.begin(); it != procs.end();)
+    {
+        if (kill(it->first, 0) && errno == ESRCH)
+            it = procs.erase(it);
+        else
+            ++it;
+    }
+}
@@ -14,6 +14,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <gelf.h>
+#include <fnmatch.h>
 
 #define warn(...) fprintf(stderr, __VA_ARGS__)
 
@@ -291,4 +292,49 @@ check:
 out:
 	close_elf(e, fd);
 	return ret;
-}
\ No newline at end of file
+}
+
+/*
+ * Calls `cb` for every function symbol defined in the elf file `path` whose
+ * name matches the glob `pattern`. A name found in both the symbol table and
+ * the dynamic symbol table is reported twice. Returns 0 on success; -1 on
+ * failure.
+ */
+int for_each_elf_func(const char *path, const char *pattern,
+		      void (*cb)(const char *name, void *ctx), void *ctx)
+{
+	int i, fd = -1;
+	Elf *e;
+	Elf_Scn *scn;
+	Elf_Data *data;
+	GElf_Shdr shdr[1];
+	GElf_Sym sym[1];
+	char *n;
+
+	e = open_elf(path, &fd);
+	if (!e)
+		return -1;
+
+	scn = NULL;
+	while ((scn = elf_nextscn(e, scn))) {
+		if (!gelf_getshdr(scn, shdr))
+			continue;
+		if (!(shdr->sh_type == SHT_SYMTAB || shdr->sh_type == SHT_DYNSYM))
+			continue;
+		data = NULL;
+		while ((data = elf_getdata(scn, data))) {
+			for (i = 0; gelf_getsym(data, i, sym); i++) {
+				if (GELF_ST_TYPE(sym->st_info) != STT_FUNC ||
+				    sym->st_shndx == SHN_UNDEF || !sym->st_value)
+					continue;
+				n = elf_strptr(e, shdr->sh_link, sym->st_name);
+				if (!n || fnmatch(pattern, n, 0))
+					continue;
+				cb(n, ctx);
+			}
+		}
+	}
+
+	close_elf(e, fd);
+	return 0;
+}